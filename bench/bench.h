@@ -0,0 +1,58 @@
+#ifndef PIPES_BENCH_H
+#define PIPES_BENCH_H
+#pragma once
+
+#include <stddef.h>
+
+#include "pipes.h"
+
+#define BENCH_CSV  0
+#define BENCH_JSON 1
+
+struct bench_options {
+	int    format;
+	long   iterations;
+	long   max_stages;
+	long   max_threads;
+	long   max_rss_mib;
+	size_t bytes;
+	int    spawner;     /* spawn server was started */
+};
+
+/* One measurement. Fields that don't apply are NULL or -1. */
+struct bench_result {
+	char const* suite;
+	char const* metric;
+	char const* api;
+	char const* backend;
+	long   stages;
+	long   threads;
+	long   rss_mib;
+	double value;
+	char const* unit;
+};
+
+struct bench_backend {
+	char const* name;
+	int spawn;
+};
+
+extern struct bench_options bench_options;
+
+double bench_now(void);
+void   bench_report(struct bench_result const* result);
+double bench_percentile(double samples[], size_t count, double percentile);
+size_t bench_backends(struct bench_backend backends[], size_t size);
+
+/* Fill a chain of stages processes running argv. The chain array needs room
+ * for stages + 1 elements. */
+void bench_chain(struct pipes_chain chain[], long stages, char const *const argv[],
+                 struct pipes_attr const* attr);
+
+int bench_spawn(void);
+int bench_rss(void);
+int bench_throughput(void);
+int bench_threads(void);
+int bench_placement(void);
+
+#endif
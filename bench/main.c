@@ -0,0 +1,280 @@
+#define _GNU_SOURCE
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+
+struct bench_options bench_options = {
+	.format      = BENCH_CSV,
+	.iterations  = 200,
+	.max_stages  = 16,
+	.max_threads = 8,
+	.max_rss_mib = 1024,
+	.bytes       = 256 * 1024 * 1024,
+	.spawner     = 0
+};
+
+static int bench_results = 0;
+
+double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void bench_json_string(char const* str) {
+	if (str) {
+		printf("\"%s\"", str);
+	}
+	else {
+		printf("null");
+	}
+}
+
+static void bench_json_long(long value) {
+	if (value < 0) {
+		printf("null");
+	}
+	else {
+		printf("%ld", value);
+	}
+}
+
+void bench_report(struct bench_result const* result) {
+	if (bench_options.format == BENCH_JSON) {
+		printf("%s\n  {\"suite\": ", bench_results ? "," : "[");
+		bench_json_string(result->suite);
+		printf(", \"metric\": ");
+		bench_json_string(result->metric);
+		printf(", \"api\": ");
+		bench_json_string(result->api);
+		printf(", \"backend\": ");
+		bench_json_string(result->backend);
+		printf(", \"stages\": ");
+		bench_json_long(result->stages);
+		printf(", \"threads\": ");
+		bench_json_long(result->threads);
+		printf(", \"rss_mib\": ");
+		bench_json_long(result->rss_mib);
+		printf(", \"value\": %.6g, \"unit\": ", result->value);
+		bench_json_string(result->unit);
+		printf("}");
+	}
+	else {
+		if (!bench_results) {
+			printf("suite,metric,api,backend,stages,threads,rss_mib,value,unit\n");
+		}
+
+		printf("%s,%s,%s,%s,", result->suite, result->metric,
+			result->api ? result->api : "", result->backend ? result->backend : "");
+
+		long const columns[] = { result->stages, result->threads, result->rss_mib };
+		for (size_t index = 0; index < 3; ++ index) {
+			if (columns[index] >= 0) {
+				printf("%ld", columns[index]);
+			}
+			printf(",");
+		}
+
+		printf("%.6g,%s\n", result->value, result->unit);
+	}
+
+	++ bench_results;
+	fflush(stdout);
+}
+
+static int bench_compare(void const* lhs, void const* rhs) {
+	const double a = *(double const*)lhs;
+	const double b = *(double const*)rhs;
+	return a < b ? -1 : a > b ? 1 : 0;
+}
+
+double bench_percentile(double samples[], size_t count, double percentile) {
+	if (count == 0) {
+		return 0;
+	}
+
+	qsort(samples, count, sizeof(double), bench_compare);
+
+	size_t index = (size_t)(percentile / 100.0 * (double)count);
+	if (index >= count) {
+		index = count - 1;
+	}
+
+	return samples[index];
+}
+
+size_t bench_backends(struct bench_backend backends[], size_t size) {
+	static struct bench_backend const all[] = {
+		{ "fork",   PIPES_SPAWN_FORK   },
+		{ "posix",  PIPES_SPAWN_POSIX  },
+		{ "server", PIPES_SPAWN_SERVER }
+	};
+
+	size_t count = 0;
+	for (size_t index = 0; index < sizeof(all) / sizeof(all[0]) && count < size; ++ index) {
+		if (all[index].spawn == PIPES_SPAWN_SERVER && !bench_options.spawner) {
+			continue;
+		}
+		backends[count ++] = all[index];
+	}
+
+	return count;
+}
+
+void bench_chain(struct pipes_chain chain[], long stages, char const *const argv[],
+                 struct pipes_attr const* attr) {
+	static struct pipes const pass = PIPES_PASS;
+
+	for (long index = 0; index < stages; ++ index) {
+		chain[index].pipes = pass;
+		chain[index].argv  = argv;
+		chain[index].envp  = NULL;
+		chain[index].attr  = attr;
+	}
+
+	chain[stages].pipes = pass;
+	chain[stages].argv  = NULL;
+	chain[stages].envp  = NULL;
+	chain[stages].attr  = NULL;
+}
+
+struct bench_suite {
+	char const* name;
+	int (*run)(void);
+};
+
+static struct bench_suite const bench_suites[] = {
+	{ "spawn",      bench_spawn      },
+	{ "rss",        bench_rss        },
+	{ "throughput", bench_throughput },
+	{ "threads",    bench_threads    },
+	{ "placement",  bench_placement  },
+	{ NULL,         NULL             }
+};
+
+static void bench_usage(char const* prog) {
+	fprintf(stderr,
+		"usage: %s [options] [suite...]\n"
+		"\n"
+		"suites: spawn, rss, throughput, threads, placement (default: all)\n"
+		"\n"
+		"options:\n"
+		"  -f FORMAT   output format: csv or json (default: csv)\n"
+		"  -n COUNT    iterations per measurement (default: %ld)\n"
+		"  -s STAGES   maximum number of stages in a chain (default: %ld)\n"
+		"  -t THREADS  maximum number of threads (default: %ld)\n"
+		"  -r MIB      maximum parent RSS in MiB (default: %ld)\n"
+		"  -b MIB      MiB pushed through each throughput and placement chain (default: %zu)\n"
+		"  -S          don't start the spawn server\n",
+		prog,
+		bench_options.iterations,
+		bench_options.max_stages,
+		bench_options.max_threads,
+		bench_options.max_rss_mib,
+		bench_options.bytes / (1024 * 1024));
+}
+
+static long bench_parse(char const* arg, char const* prog) {
+	char *endptr = NULL;
+	long value = strtol(arg, &endptr, 10);
+
+	if (!*arg || *endptr || value < 1) {
+		fprintf(stderr, "illegal number: %s\n", arg);
+		bench_usage(prog);
+		exit(1);
+	}
+
+	return value;
+}
+
+int main(int argc, char* argv[]) {
+	int spawner = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:n:s:t:r:b:Sh")) != -1) {
+		switch (opt) {
+			case 'f':
+				if (strcmp(optarg, "csv") == 0) {
+					bench_options.format = BENCH_CSV;
+				}
+				else if (strcmp(optarg, "json") == 0) {
+					bench_options.format = BENCH_JSON;
+				}
+				else {
+					fprintf(stderr, "illegal format: %s\n", optarg);
+					bench_usage(argv[0]);
+					return 1;
+				}
+				break;
+
+			case 'n': bench_options.iterations  = bench_parse(optarg, argv[0]); break;
+			case 's': bench_options.max_stages  = bench_parse(optarg, argv[0]); break;
+			case 't': bench_options.max_threads = bench_parse(optarg, argv[0]); break;
+			case 'r': bench_options.max_rss_mib = bench_parse(optarg, argv[0]); break;
+			case 'b': bench_options.bytes = (size_t)bench_parse(optarg, argv[0]) * 1024 * 1024; break;
+			case 'S': spawner = 0; break;
+
+			case 'h':
+				bench_usage(argv[0]);
+				return 0;
+
+			default:
+				bench_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	for (int index = optind; index < argc; ++ index) {
+		struct bench_suite const* suite = bench_suites;
+		while (suite->name && strcmp(suite->name, argv[index]) != 0) ++ suite;
+
+		if (!suite->name) {
+			fprintf(stderr, "unknown suite: %s\n", argv[index]);
+			bench_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	// start the spawn server while this process is still small
+	if (spawner) {
+		if (pipes_spawner_start() == 0) {
+			bench_options.spawner = 1;
+		}
+		else {
+			perror("pipes_spawner_start");
+		}
+	}
+
+	int status = 0;
+
+	for (struct bench_suite const* suite = bench_suites; suite->name; ++ suite) {
+		int selected = optind == argc;
+
+		for (int index = optind; index < argc && !selected; ++ index) {
+			selected = strcmp(suite->name, argv[index]) == 0;
+		}
+
+		if (selected && suite->run() != 0) {
+			fprintf(stderr, "suite %s failed\n", suite->name);
+			status = 1;
+		}
+	}
+
+	if (bench_options.format == BENCH_JSON) {
+		printf(bench_results ? "\n]\n" : "[]\n");
+	}
+
+	if (bench_options.spawner) {
+		pipes_spawner_stop();
+	}
+
+	return status;
+}
@@ -0,0 +1,191 @@
+#define _GNU_SOURCE
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+static char const* const bench_true[] = {"true", NULL};
+
+// The same chain as a template, spawned from a pool of one instance.
+static int bench_template(struct pipes_chain chain[], long stages, struct pipes_attr const* attr,
+                          struct bench_result *result) {
+	bench_chain(chain, stages, bench_true, NULL);
+	chain[0].pipes.infd = PIPES_NULL;
+	chain[stages - 1].pipes.outfd = PIPES_NULL;
+
+	struct pipes_template *tmpl = pipes_template_new(chain, attr, 1);
+
+	if (tmpl == NULL) {
+		perror("pipes_template_new");
+		return -1;
+	}
+
+	double open = 0;
+	const double start = bench_now();
+
+	for (long iter = 0; iter < bench_options.iterations; ++ iter) {
+		const double before = bench_now();
+		struct pipes_chain *instance = pipes_template_open(tmpl);
+
+		if (instance == NULL) {
+			perror("pipes_template_open");
+			pipes_template_free(tmpl);
+			return -1;
+		}
+		open += bench_now() - before;
+
+		pipes_template_release(tmpl, instance);
+	}
+
+	const double total = bench_now() - start;
+
+	pipes_template_free(tmpl);
+
+	result->api    = "template";
+	result->metric = "spawns_per_sec";
+	result->value  = (double)(stages * bench_options.iterations) / total;
+	result->unit   = "1/s";
+	bench_report(result);
+
+	result->metric = "open_chain_latency";
+	result->value  = open / (double)bench_options.iterations * 1e6;
+	result->unit   = "us";
+	bench_report(result);
+
+	return 0;
+}
+
+// Spawn and wait for chains of 1..max_stages processes that do nothing.
+int bench_spawn(void) {
+	struct bench_backend backends[3];
+	const size_t nbackends = bench_backends(backends, 3);
+
+	struct pipes_chain *chain = calloc((size_t)bench_options.max_stages + 1, sizeof(struct pipes_chain));
+
+	if (chain == NULL) {
+		perror("allocating chain");
+		return -1;
+	}
+
+	for (size_t backend = 0; backend < nbackends; ++ backend) {
+		struct pipes_attr attr = { backends[backend].spawn, 0, 0, NULL };
+
+		for (long stages = 1; stages <= bench_options.max_stages; stages *= 2) {
+			double open = 0;
+			const double start = bench_now();
+
+			for (long iter = 0; iter < bench_options.iterations; ++ iter) {
+				bench_chain(chain, stages, bench_true, NULL);
+				chain[0].pipes.infd = PIPES_NULL;
+				chain[stages - 1].pipes.outfd = PIPES_NULL;
+
+				const double before = bench_now();
+				if (pipes_open_chain_attr(chain, &attr) == -1) {
+					perror("pipes_open_chain_attr");
+					free(chain);
+					return -1;
+				}
+				open += bench_now() - before;
+
+				pipes_wait_chain(chain, NULL);
+				pipes_close_chain(chain);
+			}
+
+			const double total = bench_now() - start;
+			const double spawns = (double)(stages * bench_options.iterations);
+
+			struct bench_result result = {
+				"spawn", "spawns_per_sec", "pipes", backends[backend].name,
+				stages, 1, -1, spawns / total, "1/s"
+			};
+			bench_report(&result);
+
+			result.metric = "open_chain_latency";
+			result.value  = open / (double)bench_options.iterations * 1e6;
+			result.unit   = "us";
+			bench_report(&result);
+
+			if (bench_template(chain, stages, &attr, &result) == -1) {
+				free(chain);
+				return -1;
+			}
+		}
+	}
+
+	free(chain);
+
+	return 0;
+}
+
+// Spawn latency of single processes while the parent has a growing resident
+// set size. fork() has to copy the page tables, so it gets slower.
+int bench_rss(void) {
+	struct bench_backend backends[3];
+	const size_t nbackends = bench_backends(backends, 3);
+
+	double *samples = calloc((size_t)bench_options.iterations, sizeof(double));
+
+	if (samples == NULL) {
+		perror("allocating samples");
+		return -1;
+	}
+
+	for (long rss = 0; rss <= bench_options.max_rss_mib; rss = rss ? rss * 4 : 16) {
+		const size_t size = (size_t)rss * 1024 * 1024;
+		void *mem = NULL;
+
+		if (size > 0) {
+			mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+			if (mem == MAP_FAILED) {
+				perror("mmap");
+				free(samples);
+				return -1;
+			}
+
+			// make it resident
+			memset(mem, 1, size);
+		}
+
+		for (size_t backend = 0; backend < nbackends; ++ backend) {
+			struct pipes_attr attr = { backends[backend].spawn, 0, 0, NULL };
+
+			for (long iter = 0; iter < bench_options.iterations; ++ iter) {
+				struct pipes pipes = { -1, PIPES_NULL, PIPES_NULL, PIPES_LEAVE, 0, -1, 0, 0, 0, 0, NULL, 0 };
+
+				const double before = bench_now();
+				if (pipes_open_attr(bench_true, NULL, &attr, &pipes) == -1) {
+					perror("pipes_open_attr");
+					if (mem) munmap(mem, size);
+					free(samples);
+					return -1;
+				}
+				samples[iter] = (bench_now() - before) * 1e6;
+
+				pipes_wait(&pipes, NULL);
+				pipes_close(&pipes);
+			}
+
+			struct bench_result result = {
+				"rss", "spawn_latency_p50", "pipes", backends[backend].name,
+				1, 1, rss, bench_percentile(samples, (size_t)bench_options.iterations, 50), "us"
+			};
+			bench_report(&result);
+
+			result.metric = "spawn_latency_p99";
+			result.value  = bench_percentile(samples, (size_t)bench_options.iterations, 99);
+			bench_report(&result);
+		}
+
+		if (mem) {
+			munmap(mem, size);
+		}
+	}
+
+	free(samples);
+
+	return 0;
+}
@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define BENCH_INPUT_SIZE 4096
+
+static char const* const bench_cat[] = {"cat", NULL};
+
+struct bench_worker {
+	pthread_t thread;
+	long chains;
+	int  error;
+};
+
+// Like examples/chain_mt.c: each thread runs its own chains and reads their
+// output with blocking reads.
+static void *bench_worker(void *ptr) {
+	struct bench_worker *worker = ptr;
+	struct pipes_chain chain[4];
+	char input[BENCH_INPUT_SIZE];
+	char buf[BENCH_INPUT_SIZE];
+
+	memset(input, 'x', sizeof(input));
+
+	for (long iter = 0; iter < worker->chains; ++ iter) {
+		bench_chain(chain, 3, bench_cat, NULL);
+
+		if (pipes_open_chain(chain) == -1) {
+			worker->error = errno;
+			return NULL;
+		}
+
+		// the input fits into the pipe, so this doesn't block
+		int infd = pipes_take_in(chain);
+		if (write(infd, input, sizeof(input)) != (ssize_t)sizeof(input)) {
+			worker->error = errno;
+		}
+		close(infd);
+
+		size_t received = 0;
+		for (;;) {
+			ssize_t count = read(chain[2].pipes.outfd, buf, sizeof(buf));
+
+			if (count == 0) break;
+			if (count < 0) {
+				if (errno == EINTR) continue;
+				worker->error = errno;
+				break;
+			}
+
+			received += (size_t)count;
+		}
+
+		pipes_close_chain(chain);
+		pipes_wait_chain(chain, NULL);
+
+		if (worker->error != 0) {
+			return NULL;
+		}
+
+		if (received != sizeof(input)) {
+			worker->error = EIO;
+			return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+int bench_threads(void) {
+	struct bench_worker *workers = calloc((size_t)bench_options.max_threads, sizeof(struct bench_worker));
+
+	if (workers == NULL) {
+		perror("allocating workers");
+		return -1;
+	}
+
+	for (long threads = 1; threads <= bench_options.max_threads; threads *= 2) {
+		// the same total amount of work for every thread count
+		const long chains = bench_options.iterations / threads > 0 ? bench_options.iterations / threads : 1;
+		const double start = bench_now();
+		long started = 0;
+
+		for (; started < threads; ++ started) {
+			workers[started].chains = chains;
+			workers[started].error  = 0;
+
+			int errnum = pthread_create(&workers[started].thread, NULL, bench_worker, &workers[started]);
+			if (errnum != 0) {
+				fprintf(stderr, "error creating thread: %s\n", strerror(errnum));
+				break;
+			}
+		}
+
+		int error = 0;
+		for (long index = 0; index < started; ++ index) {
+			pthread_join(workers[index].thread, NULL);
+
+			if (workers[index].error != 0) {
+				error = workers[index].error;
+			}
+		}
+
+		if (started < threads || error != 0) {
+			if (error != 0) {
+				fprintf(stderr, "threads: %s\n", strerror(error));
+			}
+			free(workers);
+			return -1;
+		}
+
+		const double total = bench_now() - start;
+
+		struct bench_result result = {
+			"threads", "chains_per_sec", "pipes", bench_options.spawner ? "server" : "fork",
+			3, threads, -1, (double)(chains * threads) / total, "1/s"
+		};
+		bench_report(&result);
+	}
+
+	free(workers);
+
+	return 0;
+}
@@ -0,0 +1,320 @@
+#define _GNU_SOURCE
+
+#include "bench.h"
+#include "fpipes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define BENCH_BUFSIZ (64 * 1024)
+
+static char const* const bench_cat[] = {"cat", NULL};
+
+struct bench_writer {
+	int   fd;
+	FILE *fp;
+	size_t bytes;
+	int   error;
+};
+
+static void *bench_write_fd(void *ptr) {
+	struct bench_writer *writer = ptr;
+	static char buf[BENCH_BUFSIZ];
+	size_t left = writer->bytes;
+
+	while (left > 0) {
+		ssize_t count = write(writer->fd, buf, left < sizeof(buf) ? left : sizeof(buf));
+
+		if (count == -1) {
+			if (errno == EINTR) continue;
+			writer->error = errno;
+			break;
+		}
+
+		left -= (size_t)count;
+	}
+
+	close(writer->fd);
+
+	return NULL;
+}
+
+static void *bench_write_fp(void *ptr) {
+	struct bench_writer *writer = ptr;
+	static char buf[BENCH_BUFSIZ];
+	size_t left = writer->bytes;
+
+	while (left > 0) {
+		const size_t size = left < sizeof(buf) ? left : sizeof(buf);
+
+		if (fwrite(buf, size, 1, writer->fp) != 1) {
+			writer->error = errno;
+			break;
+		}
+
+		left -= size;
+	}
+
+	fclose(writer->fp);
+
+	return NULL;
+}
+
+static int bench_pipes_attr(long stages, struct pipes_attr const* attr, size_t *received) {
+	struct pipes_chain *chain = calloc((size_t)stages + 1, sizeof(struct pipes_chain));
+
+	if (chain == NULL) {
+		return -1;
+	}
+
+	bench_chain(chain, stages, bench_cat, attr);
+
+	if (pipes_open_chain(chain) == -1) {
+		free(chain);
+		return -1;
+	}
+
+	struct bench_writer writer = { pipes_take_in(chain), NULL, bench_options.bytes, 0 };
+	pthread_t thread;
+
+	int errnum = pthread_create(&thread, NULL, bench_write_fd, &writer);
+	if (errnum != 0) {
+		close(writer.fd);
+		pipes_close_chain(chain);
+		pipes_wait_chain(chain, NULL);
+		free(chain);
+		errno = errnum;
+		return -1;
+	}
+
+	char buf[BENCH_BUFSIZ];
+	const int outfd = chain[stages - 1].pipes.outfd;
+	int status = 0;
+
+	for (;;) {
+		ssize_t count = read(outfd, buf, sizeof(buf));
+
+		if (count == 0) break;
+		if (count < 0) {
+			if (errno == EINTR) continue;
+			status = -1;
+			break;
+		}
+
+		*received += (size_t)count;
+	}
+
+	errnum = errno;
+	pthread_join(thread, NULL);
+	pipes_close_chain(chain);
+	pipes_wait_chain(chain, NULL);
+	free(chain);
+
+	if (writer.error != 0) {
+		errnum = writer.error;
+		status = -1;
+	}
+
+	errno = errnum;
+
+	return status;
+}
+
+static int bench_pipes(long stages, size_t *received) {
+	return bench_pipes_attr(stages, NULL, received);
+}
+
+// Read the output of the last stage with fread() or, for a ring stream, in
+// place with fpipes_peek().
+static int bench_fpipes_options(long stages, struct fpipes_options const* options, size_t *received) {
+	struct fpipes_chain *chain = calloc((size_t)stages + 1, sizeof(struct fpipes_chain));
+
+	if (chain == NULL) {
+		return -1;
+	}
+
+	static struct fpipes const pass = FPIPES_PASS;
+
+	for (long index = 0; index <= stages; ++ index) {
+		chain[index].pipes = pass;
+		chain[index].argv  = index < stages ? bench_cat : NULL;
+	}
+
+	// stdin is the one of the first stage, the others are linked
+	chain[0].pipes.options          = options;
+	chain[stages - 1].pipes.options = options;
+
+	if (fpipes_open_chain(chain) == -1) {
+		free(chain);
+		return -1;
+	}
+
+	struct bench_writer writer = { -1, fpipes_take_in(chain), bench_options.bytes, 0 };
+	pthread_t thread;
+
+	int errnum = pthread_create(&thread, NULL, bench_write_fp, &writer);
+	if (errnum != 0) {
+		fclose(writer.fp);
+		fpipes_close_chain(chain);
+		fpipes_wait_chain(chain, NULL);
+		free(chain);
+		errno = errnum;
+		return -1;
+	}
+
+	char buf[BENCH_BUFSIZ];
+	FILE *out = chain[stages - 1].pipes.out;
+
+	int status = 0;
+
+	if (options && options->out.mode == FPIPES_BUF_RING) {
+		for (;;) {
+			char const* data = NULL;
+			ssize_t count = fpipes_peek(out, 1, &data);
+
+			if (count <= 0) {
+				status = (int)count;
+				break;
+			}
+
+			*received += (size_t)count;
+			fpipes_consume(out, (size_t)count);
+		}
+	}
+	else {
+		for (;;) {
+			size_t count = fread(buf, 1, sizeof(buf), out);
+
+			if (count == 0) break;
+
+			*received += count;
+		}
+
+		status = ferror(out) ? -1 : 0;
+	}
+
+	errnum = errno;
+	pthread_join(thread, NULL);
+	fpipes_close_chain(chain);
+	fpipes_wait_chain(chain, NULL);
+	free(chain);
+
+	if (writer.error != 0) {
+		errnum = writer.error;
+		status = -1;
+	}
+
+	errno = errnum;
+
+	return status;
+}
+
+static int bench_fpipes(long stages, size_t *received) {
+	return bench_fpipes_options(stages, NULL, received);
+}
+
+// What the streams used to get: a stdio sized buffer instead of one sized
+// to the pipe.
+static int bench_fpipes_stdio(long stages, size_t *received) {
+	static char inbuf[BUFSIZ];
+	static char outbuf[BUFSIZ];
+	static struct fpipes_options const options = {
+		{ FPIPES_BUF_FULL,    sizeof(inbuf),  inbuf,  0 },
+		{ FPIPES_BUF_FULL,    sizeof(outbuf), outbuf, 0 },
+		{ FPIPES_BUF_DEFAULT, 0, NULL, 0 }
+	};
+
+	return bench_fpipes_options(stages, &options, received);
+}
+
+static int bench_fpipes_ring(long stages, size_t *received) {
+	static struct fpipes_options const options = {
+		{ FPIPES_BUF_DEFAULT, 0, NULL, 0 },
+		{ FPIPES_BUF_RING,    0, NULL, 0 },
+		{ FPIPES_BUF_DEFAULT, 0, NULL, 0 }
+	};
+
+	return bench_fpipes_options(stages, &options, received);
+}
+
+// Push bytes through chains of cat processes, using file descriptors, FILE
+// objects with the default pipe sized and with stdio sized buffers and FILE
+// objects read in place.
+int bench_throughput(void) {
+	static struct {
+		char const* name;
+		int (*run)(long stages, size_t *received);
+	} const apis[] = {
+		{ "pipes",        bench_pipes        },
+		{ "fpipes",       bench_fpipes       },
+		{ "fpipes_stdio", bench_fpipes_stdio },
+		{ "fpipes_ring",  bench_fpipes_ring  }
+	};
+
+	for (size_t api = 0; api < sizeof(apis) / sizeof(apis[0]); ++ api) {
+		for (long stages = 1; stages <= bench_options.max_stages; stages *= 4) {
+			size_t received = 0;
+			const double start = bench_now();
+
+			if (apis[api].run(stages, &received) == -1) {
+				perror(apis[api].name);
+				return -1;
+			}
+
+			const double total = bench_now() - start;
+
+			if (received != bench_options.bytes) {
+				fprintf(stderr, "%s: received %zu of %zu bytes\n", apis[api].name, received, bench_options.bytes);
+				return -1;
+			}
+
+			struct bench_result result = {
+				"throughput", "bytes_per_sec", apis[api].name, bench_options.spawner ? "server" : "fork",
+				stages, 1, -1, (double)received / total, "B/s"
+			};
+			bench_report(&result);
+		}
+	}
+
+	return 0;
+}
+
+// The same chains of cat processes, once left to the scheduler and once
+// placed on cores that share a cache.
+int bench_placement(void) {
+	struct pipes_attr attrs[] = { PIPES_ATTR_INIT, PIPES_ATTR_INIT };
+	char const* const names[] = { "scheduler", "placed" };
+
+	attrs[1].flags = PIPES_ATTR_PLACE;
+
+	for (long stages = 2; stages <= bench_options.max_stages; stages *= 2) {
+		for (size_t index = 0; index < 2; ++ index) {
+			size_t received = 0;
+			const double start = bench_now();
+
+			if (bench_pipes_attr(stages, &attrs[index], &received) == -1) {
+				perror(names[index]);
+				return -1;
+			}
+
+			const double total = bench_now() - start;
+
+			if (received != bench_options.bytes) {
+				fprintf(stderr, "%s: received %zu of %zu bytes\n", names[index], received, bench_options.bytes);
+				return -1;
+			}
+
+			struct bench_result result = {
+				"placement", "bytes_per_sec", names[index], bench_options.spawner ? "server" : "fork",
+				stages, 1, -1, (double)received / total, "B/s"
+			};
+			bench_report(&result);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,69 @@
+#include "pipes.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main() {
+	// copies its input to stderr and only then writes the line count to
+	// stdout, so stderr has to be read while stdin is still being written
+	char const* sh[] = {"sh", "-c", "tee /dev/stderr | wc -l", NULL};
+
+	struct pipes_chain chain[] = {
+		{ {-1, PIPES_PIPE, PIPES_PIPE, PIPES_PIPE, 0, -1, 0, 0, 0, 0, NULL, 0}, sh, NULL, NULL, NULL, NULL },
+		{ PIPES_PASS, NULL, NULL, NULL, NULL, NULL }
+	};
+
+	const size_t lines = 100000;
+	const size_t size  = lines * 8;
+	char *input = malloc(size);
+
+	if (input == NULL) {
+		perror("malloc");
+		return 1;
+	}
+
+	for (size_t index = 0; index < lines; ++ index) {
+		memcpy(input + index * 8, "0123456\n", 8);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (pipes_open_chain(chain) == -1) {
+		perror("pipes_open_chain");
+		free(input);
+		return 1;
+	}
+
+	struct pipes_buffer out = PIPES_BUFFER_INIT;
+	struct pipes_buffer err = PIPES_BUFFER_INIT;
+	struct pipes_stats stats[1];
+
+	if (pipes_capture_chain_stats(chain, input, size, &out, &err, stats) == -1) {
+		perror("pipes_capture_chain_stats");
+		pipes_close_chain(chain);
+		pipes_buffer_free(&out);
+		pipes_buffer_free(&err);
+		free(input);
+		return 1;
+	}
+
+	printf("stdout: %s", out.data ? out.data : "\n");
+	printf("stderr: %zu bytes, %s\n", err.size,
+		err.size == size && memcmp(err.data, input, size) == 0 ? "same as input" : "differs from input");
+	printf("status: %d\n", stats[0].status);
+	printf("bytes:  %zu in, %zu out, %zu err\n", stats[0].bytes_in, stats[0].bytes_out, stats[0].bytes_err);
+	printf("time:   %ld.%06ld s wall, %ld.%06ld s user, %ld.%06ld s sys\n",
+		(long)stats[0].wall.tv_sec, (long)stats[0].wall.tv_usec,
+		(long)stats[0].rusage.ru_utime.tv_sec, (long)stats[0].rusage.ru_utime.tv_usec,
+		(long)stats[0].rusage.ru_stime.tv_sec, (long)stats[0].rusage.ru_stime.tv_usec);
+	printf("max rss: %ld KiB\n", stats[0].rusage.ru_maxrss);
+
+	pipes_close_chain(chain);
+	pipes_buffer_free(&out);
+	pipes_buffer_free(&err);
+	free(input);
+
+	return 0;
+}
@@ -3,7 +3,6 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
-#include <sys/wait.h>
 
 int main(int argc, const char* argv[]) {
 	if (argc < 2) {
@@ -23,10 +22,10 @@ int main(int argc, const char* argv[]) {
 	char const* sort[] = {"sort", "-u", NULL};
 
 	struct pipes_chain chain[] = {
-		{ PIPES_IN(fd), grep, NULL },
-		{ PIPES_PASS,   sed,  NULL },
-		{ PIPES_PASS,   sort, NULL },
-		{ PIPES_PASS,   NULL, NULL }
+		PIPES_STAGE(PIPES_IN(fd), grep),
+		PIPES_STAGE(PIPES_PASS,   sed),
+		PIPES_STAGE(PIPES_PASS,   sort),
+		PIPES_STAGE(PIPES_PASS,   NULL)
 	};
 
 	if (pipes_open_chain(chain) == -1) {
@@ -34,33 +33,20 @@ int main(int argc, const char* argv[]) {
 		return 1;
 	}
 
-	char buf[BUFSIZ];
-
-	for (;;) {
-		ssize_t size = read(PIPES_GET_OUT(chain), buf, BUFSIZ);
-
-		if (size == 0) break;
-		if (size < 0) {
-			perror("read");
-			pipes_close_chain(chain);
-			return 1;
-		}
-
-		if (fwrite(buf, (size_t)size, 1, stdout) != 1) {
-			perror("fwrite");
-			pipes_close_chain(chain);
-			return 1;
-		}
+	if (pipes_forward_chain(chain, STDOUT_FILENO) == -1) {
+		perror("pipes_forward_chain");
+		pipes_close_chain(chain);
+		return 1;
 	}
 
-	int status = 0;
-	if (waitpid(PIPES_GET_LAST(chain).pid, &status, 0) == -1) {
-		perror("waitpid");
+	int status[3] = {0, 0, 0};
+	if (pipes_wait_chain(chain, status) == -1) {
+		perror("pipes_wait_chain");
 		pipes_close_chain(chain);
 		return 1;
 	}
 
-	printf("status of last in chain: %d\n", status);
+	printf("status of last in chain: %d\n", status[2]);
 
 	pipes_close_chain(chain);
 
@@ -23,10 +23,10 @@ void *thread_func(void *ptr) {
 	char const* sort[] = {"sort", "-u", NULL};
 
 	struct pipes_chain chain[] = {
-		{ PIPES_IN(fd), grep, NULL },
-		{ PIPES_PASS,   sed,  NULL },
-		{ PIPES_PASS,   sort, NULL },
-		{ PIPES_PASS,   NULL, NULL }
+		{ PIPES_IN(fd), grep, NULL, NULL, NULL, NULL },
+		{ PIPES_PASS,   sed,  NULL, NULL, NULL, NULL },
+		{ PIPES_PASS,   sort, NULL, NULL, NULL, NULL },
+		{ PIPES_PASS,   NULL, NULL, NULL, NULL, NULL }
 	};
 
 	if (pipes_open_chain(chain) == -1) {
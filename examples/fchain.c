@@ -24,10 +24,10 @@ int main(int argc, const char* argv[]) {
 	char const* sort[] = {"sort", "-u", NULL};
 
 	struct fpipes_chain chain[] = {
-		{ FPIPES_IN(fp), grep, NULL },
-		{ FPIPES_PASS,   sed,  NULL },
-		{ FPIPES_PASS,   sort, NULL },
-		{ FPIPES_PASS,   NULL, NULL }
+		FPIPES_STAGE(FPIPES_IN(fp), grep),
+		FPIPES_STAGE(FPIPES_PASS,   sed),
+		FPIPES_STAGE(FPIPES_PASS,   sort),
+		FPIPES_STAGE(FPIPES_PASS,   NULL)
 	};
 
 	if (fpipes_open_chain(chain) == -1) {
@@ -0,0 +1,74 @@
+#include "fpipes.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+
+// Sum up the numbers printed by seq. The lines are parsed right where the
+// pipe was read to, without copying them into a line buffer first.
+int main() {
+	char const* seq[] = {"seq", "1000000", NULL};
+
+	struct fpipes_options options = {
+		{ FPIPES_BUF_DEFAULT, 0, NULL, 0 },
+		{ FPIPES_BUF_RING,    0, NULL, 0 },
+		{ FPIPES_BUF_DEFAULT, 0, NULL, 0 }
+	};
+
+	struct fpipes pipes = FPIPES_FIRST;
+	pipes.options = &options;
+
+	if (fpipes_open(seq, NULL, &pipes) == -1) {
+		perror("fpipes_open");
+		return 1;
+	}
+
+	unsigned long long sum = 0;
+	size_t need = 1;
+
+	for (;;) {
+		char const* data = NULL;
+		const ssize_t size = fpipes_peek(pipes.out, need, &data);
+
+		if (size == -1) {
+			perror("fpipes_peek");
+			break;
+		}
+
+		char const* end = memchr(data, '\n', (size_t)size);
+
+		if (end == NULL) {
+			// wait for the rest of the line, unless there is no more
+			if ((size_t)size < need) {
+				break;
+			}
+			need = (size_t)size + 1;
+			continue;
+		}
+
+		unsigned long long number = 0;
+		for (char const* ptr = data; ptr < end; ++ ptr) {
+			number = number * 10 + (unsigned)(*ptr - '0');
+		}
+		sum += number;
+
+		fpipes_consume(pipes.out, (size_t)(end - data) + 1);
+		need = 1;
+	}
+
+	fpipes_close(&pipes);
+
+	int status = 0;
+	if (fpipes_wait(&pipes, &status) == -1) {
+		perror("fpipes_wait");
+		return 1;
+	}
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "seq exited with status %d\n", status);
+	}
+
+	printf("sum: %llu\n", sum);
+
+	return 0;
+}
@@ -10,9 +10,9 @@ int main() {
 	char const* xxd[]  = {"xxd", NULL};
 
 	struct fpipes_chain chain[] = {
-		{ FPIPES_FIRST,            head, NULL },
-		{ FPIPES_OUT(FPIPES_TEMP), xxd,  NULL },
-		{ FPIPES_PASS,             NULL, NULL }
+		{ FPIPES_FIRST,            head, NULL, NULL },
+		{ FPIPES_OUT(FPIPES_TEMP), xxd,  NULL, NULL },
+		{ FPIPES_PASS,             NULL, NULL, NULL }
 	};
 
 	if (fpipes_open_chain(chain) == -1) {
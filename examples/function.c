@@ -0,0 +1,77 @@
+#define _GNU_SOURCE
+
+#include "pipes.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/wait.h>
+
+// Pass on the lines whose digits add up to a multiple of 7. A stage like
+// this would otherwise need a process of its own.
+static int filter(int infd, int outfd, void* ctx) {
+	unsigned long *matches = ctx;
+
+	// infd and outfd are closed by the library, the streams get their own.
+	// Processes are spawned at the same time, so they must be close-on-exec.
+	FILE *in  = fdopen(fcntl(infd,  F_DUPFD_CLOEXEC, 0), "r");
+	FILE *out = fdopen(fcntl(outfd, F_DUPFD_CLOEXEC, 0), "w");
+
+	if (in == NULL || out == NULL) {
+		if (in)  fclose(in);
+		if (out) fclose(out);
+		return 1;
+	}
+
+	char line[256];
+	while (fgets(line, sizeof(line), in)) {
+		unsigned sum = 0;
+		for (char const* ptr = line; *ptr >= '0' && *ptr <= '9'; ++ ptr) {
+			sum += (unsigned)(*ptr - '0');
+		}
+
+		if (sum % 7 == 0) {
+			++ *matches;
+			if (fputs(line, out) == EOF) {
+				break;
+			}
+		}
+	}
+
+	const int failed = ferror(in) || ferror(out);
+
+	fclose(in);
+	return fclose(out) == EOF || failed ? 1 : 0;
+}
+
+int main() {
+	char const* seq[]  = {"seq", "1000000", NULL};
+	char const* name[] = {"filter", NULL};
+	char const* tail[] = {"tail", "-n", "3", NULL};
+	unsigned long matches = 0;
+
+	struct pipes_chain chain[] = {
+		{ PIPES_FIRST, seq,  NULL, NULL, NULL,   NULL     },
+		{ PIPES_PASS,  name, NULL, NULL, filter, &matches },
+		{ PIPES_LAST,  tail, NULL, NULL, NULL,   NULL     },
+		{ PIPES_LAST,  NULL, NULL, NULL, NULL,   NULL     }
+	};
+
+	if (pipes_open_chain(chain) == -1) {
+		perror("pipes_open_chain");
+		return 1;
+	}
+
+	int status[3];
+	pipes_close_chain(chain);
+	pipes_wait_chain(chain, status);
+
+	for (size_t index = 0; index < 3; ++ index) {
+		if (!WIFEXITED(status[index]) || WEXITSTATUS(status[index]) != 0) {
+			fprintf(stderr, "%s: exited with status %d\n", chain[index].argv[0], status[index]);
+		}
+	}
+
+	fprintf(stderr, "%lu matching lines\n", matches);
+
+	return 0;
+}
@@ -0,0 +1,89 @@
+#include "pipes.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// seq 1 2 30 -+-> sort -> comm 3 <-+
+//             +-> wc -l            |
+// seq 1 3 30 -+-> sort -> comm 4 <-+
+//
+// The outputs of both seq processes go to two nodes each and wc -l counts
+// the lines of both, so no shell with temporary files or named pipes is
+// needed for comm to get two inputs.
+int main() {
+	char const* odd[]   = {"seq", "1", "2", "30", NULL};
+	char const* third[] = {"seq", "1", "3", "30", NULL};
+	char const* sort[]  = {"sort", NULL};
+	char const* comm[]  = {"comm", "/dev/fd/3", "/dev/fd/4", NULL};
+	char const* wc[]    = {"wc", "-l", NULL};
+
+	struct pipes_chain node    = { PIPES_FIRST, NULL, NULL, NULL, NULL, NULL };
+	struct pipes_chain counter = { PIPES_FIRST, wc,   NULL, NULL, NULL, NULL };
+
+	// every stream that is connected to another node is left to the graph
+	node.pipes.outfd    = PIPES_LEAVE;
+	counter.pipes.outfd = PIPES_PIPE;
+
+	struct pipes_graph *graph = pipes_graph_new();
+
+	if (graph == NULL) {
+		perror("pipes_graph_new");
+		return 1;
+	}
+
+	node.argv = odd;
+	const int seq1 = pipes_graph_add(graph, &node);
+	node.argv = third;
+	const int seq2 = pipes_graph_add(graph, &node);
+	node.argv = sort;
+	const int sort1 = pipes_graph_add(graph, &node);
+	const int sort2 = pipes_graph_add(graph, &node);
+	node.argv = comm;
+	const int common = pipes_graph_add(graph, &node);
+	const int count  = pipes_graph_add(graph, &counter);
+
+	if (count == -1 ||
+	    pipes_graph_connect(graph, seq1,  STDOUT_FILENO, sort1,  STDIN_FILENO) == -1 ||
+	    pipes_graph_connect(graph, seq2,  STDOUT_FILENO, sort2,  STDIN_FILENO) == -1 ||
+	    pipes_graph_connect(graph, sort1, STDOUT_FILENO, common, 3) == -1 ||
+	    pipes_graph_connect(graph, sort2, STDOUT_FILENO, common, 4) == -1 ||
+	    pipes_graph_connect(graph, seq1,  STDOUT_FILENO, count,  STDIN_FILENO) == -1 ||
+	    pipes_graph_connect(graph, seq2,  STDOUT_FILENO, count,  STDIN_FILENO) == -1) {
+		perror("building graph");
+		pipes_graph_free(graph);
+		return 1;
+	}
+
+	if (pipes_graph_open(graph, NULL) == -1) {
+		perror("pipes_graph_open");
+		pipes_graph_free(graph);
+		return 1;
+	}
+
+	struct pipes_chain *nodes = pipes_graph_chain(graph);
+	char buf[64];
+	ssize_t size = read(nodes[count].pipes.outfd, buf, sizeof(buf) - 1);
+
+	if (size > 0) {
+		buf[size] = 0;
+		fprintf(stderr, "lines in total: %s", buf);
+	}
+
+	pipes_close_chain(nodes);
+
+	int status[6];
+	if (pipes_graph_wait(graph, status) == -1) {
+		perror("pipes_graph_wait");
+	}
+
+	for (int index = 0; index < 6; ++ index) {
+		if (!WIFEXITED(status[index]) || WEXITSTATUS(status[index]) != 0) {
+			fprintf(stderr, "%s: exited with status %d\n", nodes[index].argv[0], status[index]);
+		}
+	}
+
+	pipes_graph_free(graph);
+
+	return 0;
+}
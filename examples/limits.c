@@ -0,0 +1,59 @@
+#define _GNU_SOURCE
+
+#include "pipes.h"
+
+#include <sched.h>
+#include <stdio.h>
+#include <sys/wait.h>
+
+int main() {
+	char const* seq[]  = {"seq", "1000000", NULL};
+	char const* sort[] = {"sort", "-n", NULL};
+	char const* tail[] = {"tail", "-n", "3", NULL};
+
+	// sort gets the lowest CPU priority, only idle I/O bandwidth, runs on
+	// CPU 0 only and may not use more than 512 MiB of address space
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(0, &cpus);
+
+	struct pipes_rlimit rlimits[] = {
+		{ RLIMIT_AS, { 512 * 1024 * 1024, 512 * 1024 * 1024 } }
+	};
+
+	struct pipes_limits limits = PIPES_LIMITS_INIT;
+	limits.rlimits   = rlimits;
+	limits.nrlimits  = sizeof(rlimits) / sizeof(rlimits[0]);
+	limits.cpus      = &cpus;
+	limits.cpus_size = sizeof(cpus);
+	limits.nice      = 19;
+	limits.ioprio    = PIPES_IOPRIO(PIPES_IOPRIO_CLASS_IDLE, 0);
+	limits.flags     = PIPES_LIMITS_NICE | PIPES_LIMITS_IOPRIO;
+
+	struct pipes_attr attr = PIPES_ATTR_INIT;
+	attr.limits = &limits;
+
+	struct pipes_chain chain[] = {
+		{ PIPES_FIRST, seq,  NULL, NULL,  NULL, NULL },
+		{ PIPES_PASS,  sort, NULL, &attr, NULL, NULL },
+		{ PIPES_LAST,  tail, NULL, NULL,  NULL, NULL },
+		{ PIPES_LAST,  NULL, NULL, NULL,  NULL, NULL }
+	};
+
+	if (pipes_open_chain(chain) == -1) {
+		perror("pipes_open_chain");
+		return 1;
+	}
+
+	int status[3];
+	pipes_close_chain(chain);
+	pipes_wait_chain(chain, status);
+
+	for (size_t index = 0; index < 3; ++ index) {
+		if (!WIFEXITED(status[index]) || WEXITSTATUS(status[index]) != 0) {
+			fprintf(stderr, "%s: exited with status %d\n", chain[index].argv[0], status[index]);
+		}
+	}
+
+	return 0;
+}
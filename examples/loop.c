@@ -0,0 +1,140 @@
+#include "pipes.h"
+#include "loop.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/wait.h>
+
+struct job {
+	long int id;
+	size_t   lines;
+};
+
+void on_data(struct pipes_task* task, int stream, char const* data, size_t size, void* ctx) {
+	struct job *job = (struct job*)ctx;
+	(void)task;
+
+	if (stream == PIPES_STDERR) {
+		if (size > 0 && fwrite(data, size, 1, stderr) != 1) {
+			perror("fwrite");
+		}
+		return;
+	}
+
+	for (size_t index = 0; index < size; ++ index) {
+		if (data[index] == '\n') {
+			++ job->lines;
+		}
+	}
+}
+
+void on_proc_exit(struct pipes_task* task, size_t index, int status, void* ctx) {
+	struct job *job = (struct job*)ctx;
+	(void)task;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "job %ld: process %zu exited with status %d\n", job->id, index, status);
+	}
+}
+
+void on_done(struct pipes_task* task, int error, void* ctx) {
+	struct job *job = (struct job*)ctx;
+	(void)task;
+
+	if (error != 0) {
+		fprintf(stderr, "job %ld: %s\n", job->id, strerror(error));
+	}
+
+	printf("job %ld: %zu functions\n", job->id, job->lines);
+}
+
+int main(int argc, const char* argv[]) {
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <chain_count> <filename>\n", argc < 1 ? "loop" : argv[0]);
+		return 1;
+	}
+
+	char *endptr = NULL;
+	long int count = strtol(argv[1], &endptr, 10);
+	if (!*argv[1] || *endptr) {
+		perror("parsing chain count");
+		return 1;
+	}
+
+	if (count < 1) {
+		fprintf(stderr, "illegal chain count: %ld\n", count);
+		return 1;
+	}
+
+	const char *filename = argv[2];
+
+	// a chain that exits early must not kill us when we write its input
+	signal(SIGPIPE, SIG_IGN);
+
+	struct pipes_loop *loop = pipes_loop_new();
+	if (loop == NULL) {
+		perror("pipes_loop_new");
+		return 1;
+	}
+
+	struct job *jobs = calloc(sizeof(struct job), count);
+	if (jobs == NULL) {
+		perror("creating job array");
+		pipes_loop_free(loop);
+		return 1;
+	}
+
+	static struct pipes_loop_callbacks const callbacks = { on_data, on_proc_exit, on_done };
+
+	char const* grep[] = {"grep", "^[^#]*\\w\\+(.*)", NULL};
+	char const* sed[]  = {"sed", "s/.*\\b\\(\\w\\+\\)(.*).*/\\1/", NULL};
+	char const* sort[] = {"sort", "-u", NULL};
+
+	for (long int i = 0; i < count; ++ i) {
+		int fd = open(filename, O_RDONLY);
+
+		if (fd == -1) {
+			perror(filename);
+			exit(EXIT_FAILURE);
+		}
+
+		struct pipes_chain chain[] = {
+			{ PIPES_IN(fd), grep, NULL, NULL, NULL, NULL },
+			{ PIPES_PASS,   sed,  NULL, NULL, NULL, NULL },
+			{ PIPES_PASS,   sort, NULL, NULL, NULL, NULL },
+			{ PIPES_PASS,   NULL, NULL, NULL, NULL, NULL }
+		};
+
+		if (pipes_open_chain(chain) == -1) {
+			perror("pipes_open_chain");
+			exit(EXIT_FAILURE);
+		}
+
+		jobs[i].id = i;
+
+		// the loop takes over the pipes and processes of the chain
+		if (pipes_loop_add(loop, chain, NULL, 0, &callbacks, &jobs[i]) == -1) {
+			perror("pipes_loop_add");
+			pipes_close_chain(chain);
+			exit(EXIT_FAILURE);
+		}
+
+		pipes_close_chain(chain);
+	}
+
+	while (pipes_loop_count(loop) > 0) {
+		if (pipes_loop_run(loop, -1) == -1) {
+			perror("pipes_loop_run");
+			break;
+		}
+	}
+
+	pipes_loop_free(loop);
+	free(jobs);
+
+	return 0;
+}
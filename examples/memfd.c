@@ -0,0 +1,66 @@
+#include "pipes.h"
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+int main() {
+	char const* ls[]   = {"ls", "-l", "/", NULL};
+	char const* sort[] = {"sort", "-k", "5", "-n", NULL};
+
+	struct pipes_chain chain[] = {
+		{ PIPES_FIRST,            ls,   NULL, NULL, NULL, NULL },
+		{ PIPES_OUT(PIPES_MEMFD), sort, NULL, NULL, NULL, NULL },
+		{ PIPES_PASS,             NULL, NULL, NULL, NULL, NULL }
+	};
+
+	if (pipes_open_chain(chain) == -1) {
+		perror("pipes_open_chain");
+		return 1;
+	}
+
+	int status[2] = {0, 0};
+	if (pipes_wait_chain(chain, status) == -1) {
+		perror("pipes_wait_chain");
+		pipes_close_chain(chain);
+		return 1;
+	}
+
+	int fd = pipes_take_out(chain);
+
+	pipes_close_chain(chain);
+
+	// the whole output is in memory, no need to read it
+	struct pipes_view view;
+	if (pipes_map(fd, &view) == -1) {
+		perror("pipes_map");
+		close(fd);
+		return 1;
+	}
+
+	close(fd);
+
+	size_t lines = 0;
+	char const* ptr = view.data;
+	char const* end = ptr + view.size;
+	while (ptr < end) {
+		char const* next = memchr(ptr, '\n', (size_t)(end - ptr));
+		if (next == NULL) break;
+		ptr = next + 1;
+		++ lines;
+	}
+
+	if (view.size > 0 && fwrite(view.data, view.size, 1, stdout) != 1) {
+		perror("fwrite");
+		pipes_unmap(&view);
+		return 1;
+	}
+
+	printf("%zu lines, %zu bytes, status of last in chain: %d\n", lines, view.size, status[1]);
+
+	pipes_unmap(&view);
+
+	return 0;
+}
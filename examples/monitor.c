@@ -0,0 +1,67 @@
+#include "pipes.h"
+
+#include <stdio.h>
+
+static char const* const blocked[] = {"", ", blocked reading", ", blocked writing"};
+
+static void report(struct pipes_sample const samples[], size_t count, void* ctx) {
+	char const* const* names = ctx;
+
+	for (size_t index = 0; index < count; ++ index) {
+		struct pipes_sample const* sample = &samples[index];
+
+		if (sample->state == 0) {
+			continue;
+		}
+
+		fprintf(stderr, "%-5s %c %6llu ticks", names[index], sample->state, sample->cpu);
+
+		if (sample->fill > -1) {
+			fprintf(stderr, ", stdin %d/%d bytes", sample->fill, sample->capacity);
+		}
+
+		fprintf(stderr, "%s\n", blocked[sample->blocked]);
+	}
+	fprintf(stderr, "\n");
+}
+
+int main() {
+	// gzip is the slowest stage, so head should mostly wait for room in its
+	// pipe and wc for data
+	char const* head[] = {"head", "-c", "200000000", "/dev/zero", NULL};
+	char const* gzip[] = {"gzip", "-1", NULL};
+	char const* wc[]   = {"wc", "-c", NULL};
+	char const* names[] = {"head", "gzip", "wc"};
+
+	struct pipes_chain chain[] = {
+		{ PIPES_FIRST, head, NULL, NULL, NULL, NULL },
+		{ PIPES_PASS,  gzip, NULL, NULL, NULL, NULL },
+		{ PIPES_LAST,  wc,   NULL, NULL, NULL, NULL },
+		{ PIPES_LAST,  NULL, NULL, NULL, NULL, NULL }
+	};
+
+	if (pipes_open_chain(chain) == -1) {
+		perror("pipes_open_chain");
+		return 1;
+	}
+
+	struct pipes_monitor *monitor = pipes_monitor_start(chain, 100, report, names);
+
+	if (monitor == NULL) {
+		perror("pipes_monitor_start");
+	}
+
+	pipes_close_chain(chain);
+
+	// wait for the last stage only, so the monitor still sees the others
+	int status = 0;
+	pipes_wait(&chain[2].pipes, &status);
+
+	if (monitor) {
+		pipes_monitor_stop(monitor);
+	}
+
+	pipes_wait_chain(chain, NULL);
+
+	return 0;
+}
@@ -10,9 +10,9 @@ int main() {
 	char const* xxd[]  = {"xxd", NULL};
 
 	struct pipes_chain chain[] = {
-		{ PIPES_FIRST,           head, NULL },
-		{ PIPES_OUT(PIPES_TEMP), xxd,  NULL },
-		{ PIPES_PASS,            NULL, NULL }
+		{ PIPES_FIRST,           head, NULL, NULL, NULL, NULL },
+		{ PIPES_OUT(PIPES_TEMP), xxd,  NULL, NULL, NULL, NULL },
+		{ PIPES_PASS,            NULL, NULL, NULL, NULL, NULL }
 	};
 
 	if (pipes_open_chain(chain) == -1) {
@@ -0,0 +1,319 @@
+#define _POSIX_SOURCE
+#define _GNU_SOURCE
+
+#include "pipes.h"
+#include "internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define PIPES_CAPTURE_BUFSIZ (64 * 1024)
+
+void pipes_buffer_free(struct pipes_buffer* buffer) {
+	if (buffer->data != NULL && !(buffer->flags & PIPES_BUFFER_FIXED)) {
+		munmap(buffer->data, buffer->capacity);
+	}
+
+	buffer->data     = NULL;
+	buffer->size     = 0;
+	buffer->capacity = 0;
+}
+
+// Make sure there is room for at least need more bytes (plus a terminating
+// NUL byte). Buffers are anonymous mappings that grow geometrically using
+// mremap(), so the kernel can move the pages instead of copying them.
+static int pipes_buffer_reserve(struct pipes_buffer* buffer, size_t need) {
+	if (buffer->size > SIZE_MAX - need - 1) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	const size_t min = buffer->size + need + 1;
+
+	if (min <= buffer->capacity) {
+		return 0;
+	}
+
+	if (buffer->flags & PIPES_BUFFER_FIXED) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t capacity = buffer->capacity > SIZE_MAX / 2 ? SIZE_MAX : buffer->capacity * 2;
+
+	if (capacity < min) {
+		capacity = min;
+	}
+
+	if (capacity > SIZE_MAX - page) {
+		errno = ENOMEM;
+		return -1;
+	}
+	capacity = (capacity + page - 1) / page * page;
+
+	void *data = buffer->data == NULL ?
+		mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) :
+		mremap(buffer->data, buffer->capacity, capacity, MREMAP_MAYMOVE);
+
+	if (data == MAP_FAILED) {
+		return -1;
+	}
+
+	buffer->data     = data;
+	buffer->capacity = capacity;
+
+	return 0;
+}
+
+struct pipes_capture {
+	int fd;
+	struct pipes_buffer* buffer;
+	size_t hint;  // bytes to have room for before each read
+	int full;     // output didn't fit into a fixed buffer
+	size_t *moved; // byte counter in struct pipes
+};
+
+static size_t pipes_capture_hint(int fd, struct pipes const* pipes) {
+#ifdef F_GETPIPE_SZ
+	const int size = fcntl(fd, F_GETPIPE_SZ);
+
+	if (size > 0) {
+		return (size_t)size;
+	}
+#else
+	(void)fd;
+#endif
+	return pipes->pipe_size > 0 ? (size_t)pipes->pipe_size : PIPES_CAPTURE_BUFSIZ;
+}
+
+// Read once from capture->fd. Returns the number of bytes read, 0 on end of
+// file or -1 on error.
+static ssize_t pipes_capture_read(struct pipes_capture* capture) {
+	struct pipes_buffer* buffer = capture->buffer;
+
+	// A fixed buffer can't grow, so it only gets what room it has left.
+	if (!(buffer->flags & PIPES_BUFFER_FIXED) && pipes_buffer_reserve(buffer, capture->hint) == -1) {
+		return -1;
+	}
+
+	char discard[PIPES_CAPTURE_BUFSIZ];
+	char *ptr   = discard;
+	size_t room = sizeof(discard);
+
+	// once a fixed buffer is full the rest is read and thrown away
+	if (buffer->size + 1 < buffer->capacity) {
+		ptr  = buffer->data + buffer->size;
+		room = buffer->capacity - buffer->size - 1;
+	}
+
+	ssize_t count;
+	do {
+		count = read(capture->fd, ptr, room);
+	} while (count == -1 && errno == EINTR);
+
+	if (count > 0) {
+		*capture->moved += (size_t)count;
+		PIPES_TRACEPOINT_READ(capture->fd, (size_t)count);
+
+		if (ptr != discard) {
+			buffer->size += (size_t)count;
+			buffer->data[buffer->size] = 0;
+		}
+		else {
+			capture->full = 1;
+		}
+	}
+
+	return count;
+}
+
+static struct pipes_chain* pipes_capture_check(struct pipes_chain chain[], void const* input, size_t size,
+                                               struct pipes_buffer* out, struct pipes_buffer* err) {
+	struct pipes_chain *last = chain;
+	for (struct pipes_chain *ptr = chain; ptr->argv; ++ ptr) {
+		last = ptr;
+	}
+
+	if (!chain->argv || (out && last->pipes.outfd < 0) || (err && last->pipes.errfd < 0) ||
+		(input && size > 0 && chain->pipes.infd < 0)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return last;
+}
+
+// Write input to the chain and read the output of its last stage until all
+// pipes are closed. Returns 0 or an errno value, the caller still has to wait
+// for the chain.
+static int pipes_capture_pump(struct pipes_chain chain[], struct pipes_chain *last, void const* input, size_t size,
+                              struct pipes_buffer* out, struct pipes_buffer* err) {
+	int errnum = 0;
+	int infd = chain->pipes.infd;
+	chain->pipes.infd = -1;
+
+	struct pipes_capture captures[2] = {
+		{ -1, out, 0, 0, &last->pipes.bytes_out },
+		{ -1, err, 0, 0, &last->pipes.bytes_err }
+	};
+
+	if (out) {
+		captures[0].fd   = last->pipes.outfd;
+		captures[0].hint = pipes_capture_hint(captures[0].fd, &last->pipes);
+		last->pipes.outfd = -1;
+	}
+
+	if (err) {
+		captures[1].fd   = last->pipes.errfd;
+		captures[1].hint = pipes_capture_hint(captures[1].fd, &last->pipes);
+		last->pipes.errfd = -1;
+	}
+
+	if (infd > -1 && (input == NULL || size == 0)) {
+		close(infd);
+		infd = -1;
+	}
+
+	if (infd > -1) {
+		// Write the input only as far as the pipe has room, so the output
+		// is read while the process is still consuming its input.
+		const int flags = fcntl(infd, F_GETFL);
+		if (flags == -1 || fcntl(infd, F_SETFL, flags | O_NONBLOCK) == -1) {
+			errnum = errno;
+		}
+	}
+
+	char const* inptr = input;
+	size_t left = size;
+
+	while (errnum == 0 && (infd > -1 || captures[0].fd > -1 || captures[1].fd > -1)) {
+		struct pollfd fds[3];
+		nfds_t nfds = 0;
+
+		if (infd > -1) {
+			fds[nfds].fd      = infd;
+			fds[nfds].events  = POLLOUT;
+			fds[nfds].revents = 0;
+			++ nfds;
+		}
+
+		for (size_t index = 0; index < 2; ++ index) {
+			if (captures[index].fd > -1) {
+				fds[nfds].fd      = captures[index].fd;
+				fds[nfds].events  = POLLIN;
+				fds[nfds].revents = 0;
+				++ nfds;
+			}
+		}
+
+		if (poll(fds, nfds, -1) == -1) {
+			if (errno != EINTR) {
+				errnum = errno;
+			}
+			continue;
+		}
+
+		for (nfds_t index = 0; index < nfds && errnum == 0; ++ index) {
+			if (fds[index].revents == 0) {
+				continue;
+			}
+
+			if (fds[index].fd == infd) {
+				const ssize_t count = write(infd, inptr, left);
+
+				if (count == -1) {
+					if (errno == EPIPE) {
+						// the process doesn't want any more input
+						left = 0;
+					}
+					else if (errno != EAGAIN && errno != EINTR) {
+						errnum = errno;
+					}
+				}
+				else {
+					inptr += count;
+					left  -= (size_t)count;
+					chain->pipes.bytes_in += (size_t)count;
+					PIPES_TRACEPOINT_WRITE(infd, (size_t)count);
+				}
+
+				if (left == 0) {
+					close(infd);
+					infd = -1;
+				}
+				continue;
+			}
+
+			struct pipes_capture* capture = fds[index].fd == captures[0].fd ? &captures[0] : &captures[1];
+			const ssize_t count = pipes_capture_read(capture);
+
+			if (count == -1) {
+				errnum = errno;
+			}
+			else if (count == 0) {
+				close(capture->fd);
+				capture->fd = -1;
+			}
+		}
+	}
+
+	if (infd > -1) close(infd);
+	if (captures[0].fd > -1) close(captures[0].fd);
+	if (captures[1].fd > -1) close(captures[1].fd);
+
+	if (errnum == 0 && (captures[0].full || captures[1].full)) {
+		errnum = ENOBUFS;
+	}
+
+	return errnum;
+}
+
+int pipes_capture_chain(struct pipes_chain chain[], void const* input, size_t size,
+                        struct pipes_buffer* out, struct pipes_buffer* err, int status[]) {
+	struct pipes_chain *last = pipes_capture_check(chain, input, size, out, err);
+
+	if (last == NULL) {
+		return -1;
+	}
+
+	int errnum = pipes_capture_pump(chain, last, input, size, out, err);
+
+	if (pipes_wait_chain(chain, status) == -1 && errnum == 0) {
+		errnum = errno;
+	}
+
+	if (errnum != 0) {
+		errno = errnum;
+		return -1;
+	}
+
+	return 0;
+}
+
+int pipes_capture_chain_stats(struct pipes_chain chain[], void const* input, size_t size,
+                              struct pipes_buffer* out, struct pipes_buffer* err, struct pipes_stats stats[]) {
+	struct pipes_chain *last = pipes_capture_check(chain, input, size, out, err);
+
+	if (last == NULL) {
+		return -1;
+	}
+
+	int errnum = pipes_capture_pump(chain, last, input, size, out, err);
+
+	if (pipes_wait_chain_stats(chain, stats) == -1 && errnum == 0) {
+		errnum = errno;
+	}
+
+	if (errnum != 0) {
+		errno = errnum;
+		return -1;
+	}
+
+	return 0;
+}
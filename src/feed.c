@@ -0,0 +1,133 @@
+#define _POSIX_SOURCE
+#define _GNU_SOURCE
+
+#include "pipes.h"
+#include "internal.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+
+#define PIPES_FEED_IOVS 64
+
+#if defined(__linux__) && defined(SPLICE_F_GIFT)
+static int pipes_feed_unsupported(int errnum) {
+	return errnum == EINVAL || errnum == EBADF || errnum == ENOSYS;
+}
+#endif
+
+// Write one batch of segments. With *splice set the pipe references the user
+// pages instead of copying them (only whole pages can be gifted). If fd isn't
+// a pipe *splice is cleared and writev() is used instead.
+static ssize_t pipes_feed_batch(int fd, struct iovec const batch[], int count, int aligned, int *splice) {
+#if defined(__linux__) && defined(SPLICE_F_GIFT)
+	if (*splice) {
+		const ssize_t written = vmsplice(fd, batch, (size_t)count, aligned ? SPLICE_F_GIFT : 0);
+
+		if (written != -1 || !pipes_feed_unsupported(errno)) {
+			return written;
+		}
+
+		*splice = 0;
+	}
+#else
+	(void)aligned;
+	*splice = 0;
+#endif
+
+	return writev(fd, batch, count);
+}
+
+ssize_t pipes_feed(int fd, struct iovec const iov[], size_t count, int flags) {
+	size_t index  = 0; // current segment
+	size_t offset = 0; // bytes of the current segment already written
+	size_t total  = 0;
+
+	int splice = (flags & PIPES_FEED_GIFT) != 0;
+	const uintptr_t pagemask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+
+	for (;;) {
+		while (index < count && offset >= iov[index].iov_len) {
+			++ index;
+			offset = 0;
+		}
+
+		if (index == count) {
+			break;
+		}
+
+		struct iovec batch[PIPES_FEED_IOVS];
+		int nbatch  = 0;
+		int aligned = 1;
+
+		for (size_t next = index; next < count && nbatch < PIPES_FEED_IOVS; ++ next) {
+			const size_t skip = next == index ? offset : 0;
+
+			if (iov[next].iov_len == skip) {
+				continue;
+			}
+
+			batch[nbatch].iov_base = (char*)iov[next].iov_base + skip;
+			batch[nbatch].iov_len  = iov[next].iov_len - skip;
+
+			if (((uintptr_t)batch[nbatch].iov_base & pagemask) != 0 ||
+				(batch[nbatch].iov_len & pagemask) != 0) {
+				aligned = 0;
+			}
+
+			++ nbatch;
+		}
+
+		const ssize_t written = pipes_feed_batch(fd, batch, nbatch, aligned, &splice);
+
+		if (written == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			if (errno == EAGAIN && total > 0) {
+				break;
+			}
+
+			return -1;
+		}
+
+		total += (size_t)written;
+		PIPES_TRACEPOINT_WRITE(fd, (size_t)written);
+
+		// advance the position by the written bytes
+		size_t left = (size_t)written;
+		while (left > 0) {
+			const size_t rest = iov[index].iov_len - offset;
+
+			if (left < rest) {
+				offset += left;
+				left = 0;
+			}
+			else {
+				left -= rest;
+				++ index;
+				offset = 0;
+			}
+		}
+	}
+
+	return (ssize_t)total;
+}
+
+ssize_t pipes_feed_chain(struct pipes_chain chain[], struct iovec const iov[], size_t count, int flags) {
+	if (!chain->argv || chain->pipes.infd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	const ssize_t size = pipes_feed(chain->pipes.infd, iov, count, flags);
+
+	if (size > 0) {
+		chain->pipes.bytes_in += (size_t)size;
+	}
+
+	return size;
+}
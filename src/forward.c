@@ -0,0 +1,460 @@
+#define _POSIX_SOURCE
+#define _GNU_SOURCE
+
+#include "pipes.h"
+#include "internal.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <poll.h>
+
+#ifdef __linux__
+#	include <fcntl.h>
+#	include <sys/sendfile.h>
+#endif
+
+#define PIPES_FORWARD_BUFSIZ (64 * 1024)
+#define PIPES_FORWARD_CHUNK  (1024 * 1024 * 1024)
+
+enum pipes_forward_method {
+	PIPES_FORWARD_SPLICE,
+	PIPES_FORWARD_COPY_FILE_RANGE,
+	PIPES_FORWARD_SENDFILE,
+	PIPES_FORWARD_READ_WRITE
+};
+
+// Errors that mean the method is not supported for this pair of file
+// descriptors (or by the kernel) and the next method should be tried.
+static int pipes_forward_unsupported(int errnum) {
+	return errnum == EINVAL || errnum == ENOSYS || errnum == EXDEV ||
+	       errnum == EOPNOTSUPP || errnum == ENOTSUP || errnum == EBADF;
+}
+
+static int pipes_write_all(int fd, char const* buf, size_t size) {
+	size_t offset = 0;
+
+	while (offset < size) {
+		ssize_t written = write(fd, buf + offset, size - offset);
+
+		if (written == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		offset += (size_t)written;
+		PIPES_TRACEPOINT_WRITE(fd, (size_t)written);
+	}
+
+	return 0;
+}
+
+static ssize_t pipes_read(int fd, char *buf, size_t size) {
+	ssize_t count;
+
+	do {
+		count = read(fd, buf, size);
+	} while (count == -1 && errno == EINTR);
+
+	if (count > 0) {
+		PIPES_TRACEPOINT_READ(fd, (size_t)count);
+	}
+
+	return count;
+}
+
+static ssize_t pipes_forward_read_write(int from, int to, size_t count) {
+	char buf[PIPES_FORWARD_BUFSIZ];
+
+	if (count > sizeof(buf)) {
+		count = sizeof(buf);
+	}
+
+	ssize_t size = pipes_read(from, buf, count);
+
+	if (size <= 0) {
+		return size;
+	}
+
+	if (pipes_write_all(to, buf, (size_t)size) == -1) {
+		return -1;
+	}
+
+	return size;
+}
+
+static ssize_t pipes_forward_method(int method, int from, int to, size_t count) {
+	ssize_t size;
+
+	do {
+		switch (method) {
+#ifdef __linux__
+			case PIPES_FORWARD_SPLICE:
+				size = splice(from, NULL, to, NULL, count, SPLICE_F_MOVE);
+				break;
+
+			case PIPES_FORWARD_COPY_FILE_RANGE:
+				size = copy_file_range(from, NULL, to, NULL, count, 0);
+				break;
+
+			case PIPES_FORWARD_SENDFILE:
+				size = sendfile(to, from, NULL, count);
+				break;
+#endif
+			case PIPES_FORWARD_READ_WRITE:
+				return pipes_forward_read_write(from, to, count);
+
+			default:
+				errno = ENOSYS;
+				return -1;
+		}
+	} while (size == -1 && errno == EINTR);
+
+	if (size > 0) {
+		PIPES_TRACEPOINT_READ(from, (size_t)size);
+		PIPES_TRACEPOINT_WRITE(to, (size_t)size);
+	}
+
+	return size;
+}
+
+// Returns the size of the first successful transfer and stores the method
+// that worked in *method.
+static ssize_t pipes_forward_probe(int from, int to, size_t count, int *method) {
+	for (int probe = PIPES_FORWARD_SPLICE; probe < PIPES_FORWARD_READ_WRITE; ++ probe) {
+		ssize_t size = pipes_forward_method(probe, from, to, count);
+
+		if (size != -1 || !pipes_forward_unsupported(errno)) {
+			*method = probe;
+			return size;
+		}
+	}
+
+	*method = PIPES_FORWARD_READ_WRITE;
+	return pipes_forward_read_write(from, to, count);
+}
+
+ssize_t pipes_forward(int from, int to, size_t count) {
+	int method = PIPES_FORWARD_READ_WRITE;
+
+	if (count > SSIZE_MAX) {
+		count = SSIZE_MAX;
+	}
+
+	return pipes_forward_probe(from, to, count, &method);
+}
+
+ssize_t pipes_forward_all(int from, int to) {
+	int method = PIPES_FORWARD_READ_WRITE;
+	ssize_t total = 0;
+
+	ssize_t size = pipes_forward_probe(from, to, PIPES_FORWARD_CHUNK, &method);
+
+	while (size > 0) {
+		total += size;
+		size = pipes_forward_method(method, from, to, PIPES_FORWARD_CHUNK);
+	}
+
+	if (size < 0) {
+		return -1;
+	}
+
+	return total;
+}
+
+ssize_t pipes_forward_chain(struct pipes_chain chain[], int to) {
+	struct pipes_chain *prev = chain;
+	for (struct pipes_chain *ptr = chain; ptr->argv; ++ ptr) {
+		prev = ptr;
+	}
+
+	if (!prev->argv || prev->pipes.outfd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	const ssize_t size = pipes_forward_all(prev->pipes.outfd, to);
+
+	if (size > 0) {
+		prev->pipes.bytes_out += (size_t)size;
+	}
+
+	return size;
+}
+
+static int pipes_fanout_copy(int from, int const to[], size_t count) {
+	char buf[PIPES_FORWARD_BUFSIZ];
+
+	for (;;) {
+		ssize_t size = pipes_read(from, buf, sizeof(buf));
+
+		if (size == 0) return 0;
+		if (size < 0)  return -1;
+
+		for (size_t index = 0; index < count; ++ index) {
+			if (pipes_write_all(to[index], buf, (size_t)size) == -1) {
+				return -1;
+			}
+		}
+	}
+}
+
+#ifdef __linux__
+static ssize_t pipes_tee(int from, int to, size_t count) {
+	ssize_t size;
+
+	do {
+		size = tee(from, to, count, 0);
+	} while (size == -1 && errno == EINTR);
+
+	// tee() doesn't consume the input, so this is only a write
+	if (size > 0) {
+		PIPES_TRACEPOINT_WRITE(to, (size_t)size);
+	}
+
+	return size;
+}
+
+// Consume size bytes from from. All but the last output already got sent[i]
+// bytes of it via tee(). sent[i] is -1 if the output doesn't support tee().
+static int pipes_fanout_round(int from, int const to[], ssize_t const sent[], size_t count, size_t size) {
+	const size_t last = count - 1;
+	int complete = 1;
+
+	for (size_t index = 0; index < last; ++ index) {
+		if (sent[index] < (ssize_t)size) {
+			complete = 0;
+			break;
+		}
+	}
+
+	if (complete) {
+		size_t left = size;
+
+		while (left > 0) {
+			ssize_t moved = pipes_forward_method(PIPES_FORWARD_SPLICE, from, to[last], left);
+
+			if (moved == -1 && left == size && pipes_forward_unsupported(errno)) {
+				// last output doesn't support splice(), use the buffer below
+				break;
+			}
+
+			if (moved <= 0) {
+				if (moved == 0) errno = EPIPE;
+				return -1;
+			}
+
+			left -= (size_t)moved;
+		}
+
+		if (left == 0) {
+			return 0;
+		}
+	}
+
+	// Some outputs only got part of the data (or none at all), so this round
+	// has to go through a buffer. Only the missing tails are written.
+	char buf[PIPES_FORWARD_BUFSIZ];
+	size_t offset = 0;
+
+	while (offset < size) {
+		const size_t want = size - offset < sizeof(buf) ? size - offset : sizeof(buf);
+		ssize_t got = pipes_read(from, buf, want);
+
+		if (got <= 0) {
+			if (got == 0) errno = EPIPE;
+			return -1;
+		}
+
+		const size_t end = offset + (size_t)got;
+
+		for (size_t index = 0; index < count; ++ index) {
+			const size_t start = index == last || sent[index] < 0 ? 0 : (size_t)sent[index];
+
+			if (end > start) {
+				const size_t skip = start > offset ? start - offset : 0;
+
+				if (pipes_write_all(to[index], buf + skip, (size_t)got - skip) == -1) {
+					return -1;
+				}
+			}
+		}
+
+		offset = end;
+	}
+
+	return 0;
+}
+#endif
+
+int pipes_fanout(int from, int const to[], size_t count) {
+	if (count == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (count == 1) {
+		return pipes_forward_all(from, to[0]) == -1 ? -1 : 0;
+	}
+
+#ifdef __linux__
+	ssize_t *sent = calloc(count, sizeof(ssize_t));
+
+	if (sent == NULL) {
+		return -1;
+	}
+
+	int status = 0;
+
+	for (;;) {
+		// tee() to the first output blocks until there is data and tells
+		// us how much this round is about.
+		ssize_t size = pipes_tee(from, to[0], PIPES_FORWARD_CHUNK);
+
+		if (size == 0) {
+			break;
+		}
+
+		if (size < 0) {
+			if (pipes_forward_unsupported(errno)) {
+				// input or first output is not a pipe
+				status = pipes_fanout_copy(from, to, count);
+			}
+			else {
+				status = -1;
+			}
+			break;
+		}
+
+		sent[0] = size;
+
+		for (size_t index = 1; index < count - 1; ++ index) {
+			if (sent[index] < 0) continue;
+
+			sent[index] = pipes_tee(from, to[index], (size_t)size);
+
+			if (sent[index] < 0 && !pipes_forward_unsupported(errno)) {
+				status = -1;
+				break;
+			}
+		}
+
+		if (status == -1 || pipes_fanout_round(from, to, sent, count, (size_t)size) == -1) {
+			status = -1;
+			break;
+		}
+	}
+
+	free(sent);
+
+	return status;
+#else
+	return pipes_fanout_copy(from, to, count);
+#endif
+}
+
+int pipes_fanout_chain(struct pipes_chain chain[], struct pipes_chain *const targets[], size_t count) {
+	struct pipes_chain *prev = chain;
+	for (struct pipes_chain *ptr = chain; ptr->argv; ++ ptr) {
+		prev = ptr;
+	}
+
+	if (!prev->argv || prev->pipes.outfd < 0 || count == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	int *fds = calloc(count, sizeof(int));
+
+	if (fds == NULL) {
+		return -1;
+	}
+
+	for (size_t index = 0; index < count; ++ index) {
+		if (!targets[index]->argv || targets[index]->pipes.infd < 0) {
+			free(fds);
+			errno = EINVAL;
+			return -1;
+		}
+
+		fds[index] = targets[index]->pipes.infd;
+	}
+
+	int status = pipes_fanout(prev->pipes.outfd, fds, count);
+	int errnum = errno;
+
+	free(fds);
+
+	if (status != 0) {
+		errno = errnum;
+	}
+
+	return status;
+}
+
+int pipes_merge(int const from[], size_t count, int to) {
+	if (count == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct pollfd *fds = calloc(count, sizeof(struct pollfd));
+	int *methods = calloc(count, sizeof(int));
+
+	if (fds == NULL || methods == NULL) {
+		free(fds);
+		free(methods);
+		return -1;
+	}
+
+	for (size_t index = 0; index < count; ++ index) {
+		fds[index].fd     = from[index];
+		fds[index].events = POLLIN;
+		methods[index]    = -1;
+	}
+
+	// Whatever is ready is moved as a whole, mostly using splice(), so the
+	// inputs are interleaved in chunks of unspecified size, not lines.
+	size_t left = count;
+	int status  = 0;
+
+	while (left > 0 && status == 0) {
+		if (poll(fds, (nfds_t)count, -1) == -1) {
+			if (errno != EINTR) {
+				status = -1;
+			}
+			continue;
+		}
+
+		for (size_t index = 0; index < count && status == 0; ++ index) {
+			if (fds[index].fd < 0 || fds[index].revents == 0) {
+				continue;
+			}
+
+			const ssize_t size = methods[index] == -1 ?
+				pipes_forward_probe(fds[index].fd, to, PIPES_FORWARD_CHUNK, &methods[index]) :
+				pipes_forward_method(methods[index], fds[index].fd, to, PIPES_FORWARD_CHUNK);
+
+			if (size == 0) {
+				// negative file descriptors are ignored by poll()
+				fds[index].fd = -1;
+				-- left;
+			}
+			else if (size < 0) {
+				status = -1;
+			}
+		}
+	}
+
+	const int errnum = errno;
+
+	free(fds);
+	free(methods);
+
+	if (status != 0) {
+		errno = errnum;
+	}
+
+	return status;
+}
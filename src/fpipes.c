@@ -2,26 +2,600 @@
 #define _GNU_SOURCE
 
 #include "fpipes.h"
+#include "internal.h"
 
 #include <signal.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
-#ifdef __APPLE__
-#	include <crt_externs.h>
-#	define environ (*_NSGetEnviron())
+#define FPIPES_IS_FILE(F) ((F) > FPIPES_MEMFD)
+#define FPIPES_IS_TEMP(F) ((F) == FPIPES_TEMP || (F) == FPIPES_MEMFD)
+
+// Like tmpfile(), but backed by pipes_memfd().
+static int fpipes_memfile(FILE** fp) {
+	const int fd = pipes_memfd();
+
+	if (fd < 0) {
+		return -1;
+	}
+
+	*fp = fdopen(fd, "w+");
+
+	if (*fp == NULL) {
+		const int errnum = errno;
+		close(fd);
+		errno = errnum;
+		return -1;
+	}
+
+	return 0;
+}
+
+// Head of the cookie of every fopencookie() stream the library opens. fd is
+// the pipe the stream reads from or writes to, which fileno() doesn't know.
+struct fpipes_stream {
+	FILE *fp;
+	int fd;
+	int ring; // whether this is a struct fpipes_ring
+};
+
+// Read buffer of a FPIPES_BUF_RING stream. The pages are mapped twice in a
+// row, so the unread bytes are contiguous even when they wrap around.
+struct fpipes_ring {
+	struct fpipes_stream stream;
+	char *data;
+	size_t size;
+	size_t head;  // offset of the first unread byte
+	size_t count; // unread bytes
+	int eof;
+};
+
+// The open cookie streams by their FILE, so fpipes_fileno(), fpipes_peek()
+// and co. find them. An open addressing hash table with linear probing that
+// a stream removes itself from when it is closed.
+static struct {
+	pthread_mutex_t lock;
+	struct fpipes_stream **slots;
+	size_t capacity; // a power of two
+	size_t count;
+	unsigned long generation; // changed whenever a stream is removed
+} fpipes_streams = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0 };
+
+// The last stream found by this thread. A parser calls fpipes_peek() and
+// fpipes_consume() on the same stream over and over, so this spares them
+// the lock. It is valid as long as no stream was removed in the meantime.
+static __thread struct {
+	FILE *fp;
+	struct fpipes_stream *stream;
+	unsigned long generation;
+} fpipes_stream_cache;
+
+static size_t fpipes_stream_slot(FILE const* fp, size_t capacity) {
+	const uint64_t key = (uint64_t)(uintptr_t)fp * UINT64_C(0x9E3779B97F4A7C15);
+
+	return (size_t)(key >> 32) & (capacity - 1);
+}
+
+// Called with the table locked and room for one more stream.
+static void fpipes_stream_insert(struct fpipes_stream** slots, size_t capacity, struct fpipes_stream* stream) {
+	size_t index = fpipes_stream_slot(stream->fp, capacity);
+
+	while (slots[index] != NULL) {
+		index = (index + 1) & (capacity - 1);
+	}
+
+	slots[index] = stream;
+}
+
+static int fpipes_stream_add(FILE* fp, struct fpipes_stream* stream) {
+	int status = 0;
+
+	stream->fp = fp;
+
+	pthread_mutex_lock(&fpipes_streams.lock);
+
+	// at most half full, so the probe sequences stay short
+	if ((fpipes_streams.count + 1) * 2 > fpipes_streams.capacity) {
+		const size_t capacity = fpipes_streams.capacity ? fpipes_streams.capacity * 2 : 16;
+		struct fpipes_stream **slots = calloc(capacity, sizeof(struct fpipes_stream*));
+
+		if (slots == NULL) {
+			status = -1;
+		}
+		else {
+			for (size_t index = 0; index < fpipes_streams.capacity; ++ index) {
+				if (fpipes_streams.slots[index] != NULL) {
+					fpipes_stream_insert(slots, capacity, fpipes_streams.slots[index]);
+				}
+			}
+
+			free(fpipes_streams.slots);
+			fpipes_streams.slots    = slots;
+			fpipes_streams.capacity = capacity;
+		}
+	}
+
+	if (status == 0) {
+		fpipes_stream_insert(fpipes_streams.slots, fpipes_streams.capacity, stream);
+		++ fpipes_streams.count;
+	}
+
+	pthread_mutex_unlock(&fpipes_streams.lock);
+
+	return status;
+}
+
+static void fpipes_stream_remove(struct fpipes_stream const* stream) {
+	pthread_mutex_lock(&fpipes_streams.lock);
+
+	const size_t mask = fpipes_streams.capacity - 1;
+	size_t index = fpipes_streams.capacity ? fpipes_stream_slot(stream->fp, fpipes_streams.capacity) : 0;
+
+	while (fpipes_streams.capacity && fpipes_streams.slots[index] != NULL && fpipes_streams.slots[index] != stream) {
+		index = (index + 1) & mask;
+	}
+
+	if (fpipes_streams.capacity && fpipes_streams.slots[index] == stream) {
+		fpipes_streams.slots[index] = NULL;
+		-- fpipes_streams.count;
+
+		// Move the following streams of the cluster back into the gap,
+		// unless that would put them in front of their own slot.
+		for (size_t next = (index + 1) & mask; fpipes_streams.slots[next] != NULL; next = (next + 1) & mask) {
+			const size_t home = fpipes_stream_slot(fpipes_streams.slots[next]->fp, fpipes_streams.capacity);
+
+			if (((next - home) & mask) >= ((next - index) & mask)) {
+				fpipes_streams.slots[index] = fpipes_streams.slots[next];
+				fpipes_streams.slots[next]  = NULL;
+				index = next;
+			}
+		}
+
+		__atomic_store_n(&fpipes_streams.generation, fpipes_streams.generation + 1, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&fpipes_streams.lock);
+}
+
+// The cookie of fp or NULL if fp isn't a cookie stream of the library.
+static struct fpipes_stream *fpipes_stream_find(FILE* fp) {
+	if (fp != NULL && fpipes_stream_cache.fp == fp &&
+	    fpipes_stream_cache.generation == __atomic_load_n(&fpipes_streams.generation, __ATOMIC_ACQUIRE)) {
+		return fpipes_stream_cache.stream;
+	}
+
+	struct fpipes_stream *stream = NULL;
+
+	pthread_mutex_lock(&fpipes_streams.lock);
+
+	if (fpipes_streams.capacity > 0) {
+		size_t index = fpipes_stream_slot(fp, fpipes_streams.capacity);
+
+		while (fpipes_streams.slots[index] != NULL) {
+			if (fpipes_streams.slots[index]->fp == fp) {
+				stream = fpipes_streams.slots[index];
+				break;
+			}
+			index = (index + 1) & (fpipes_streams.capacity - 1);
+		}
+	}
+
+	if (stream != NULL) {
+		fpipes_stream_cache.fp         = fp;
+		fpipes_stream_cache.stream     = stream;
+		fpipes_stream_cache.generation = fpipes_streams.generation;
+	}
+
+	pthread_mutex_unlock(&fpipes_streams.lock);
+
+	return stream;
+}
+
+static struct fpipes_ring *fpipes_ring_find(FILE* fp) {
+	struct fpipes_stream *stream = fpipes_stream_find(fp);
+
+	if (stream == NULL || !stream->ring) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return (struct fpipes_ring*)stream;
+}
+
+int fpipes_fileno(FILE* fp) {
+	struct fpipes_stream *stream = fpipes_stream_find(fp);
+
+	return stream != NULL ? stream->fd : fileno(fp);
+}
+
+// Read from the pipe into the free part of the ring. Returns the number of
+// bytes read, 0 on end of file or -1 on error (EAGAIN for an empty
+// non-blocking pipe).
+static ssize_t fpipes_ring_fill(struct fpipes_ring* ring) {
+	ssize_t count;
+
+	do {
+		count = read(ring->stream.fd, ring->data + (ring->head + ring->count) % ring->size, ring->size - ring->count);
+	} while (count == -1 && errno == EINTR);
+
+	if (count > 0) {
+		ring->count += (size_t)count;
+		PIPES_TRACEPOINT_READ(ring->stream.fd, (size_t)count);
+	}
+	else if (count == 0) {
+		ring->eof = 1;
+	}
+
+	return count;
+}
+
+static void fpipes_ring_consume(struct fpipes_ring* ring, size_t count) {
+	ring->head   = (ring->head + count) % ring->size;
+	ring->count -= count;
+
+	if (ring->count == 0) {
+		ring->head = 0;
+	}
+}
+
+static ssize_t fpipes_ring_read(void* cookie, char* buf, size_t size) {
+	struct fpipes_ring *ring = cookie;
+
+	if (ring->count == 0 && !ring->eof) {
+		// nothing to peek at in between, so big reads go straight through
+		if (size >= ring->size) {
+			ssize_t count;
+
+			do {
+				count = read(ring->stream.fd, buf, size);
+			} while (count == -1 && errno == EINTR);
+
+			if (count > 0) {
+				PIPES_TRACEPOINT_READ(ring->stream.fd, (size_t)count);
+			}
+			else if (count == 0) {
+				ring->eof = 1;
+			}
+
+			return count;
+		}
+
+		if (fpipes_ring_fill(ring) == -1) {
+			return -1;
+		}
+	}
+
+	const size_t count = size < ring->count ? size : ring->count;
+
+	memcpy(buf, ring->data + ring->head, count);
+	fpipes_ring_consume(ring, count);
+
+	return (ssize_t)count;
+}
+
+static void fpipes_ring_free(struct fpipes_ring* ring) {
+	if (ring->data != MAP_FAILED) {
+		munmap(ring->data, ring->size * 2);
+	}
+	free(ring);
+}
+
+static int fpipes_ring_close(void* cookie) {
+	struct fpipes_ring *ring = cookie;
+	const int status = ring->stream.fd > -1 ? close(ring->stream.fd) : 0;
+
+	fpipes_stream_remove(&ring->stream);
+	fpipes_ring_free(ring);
+
+	return status;
+}
+
+// Wrap the read end fd of a pipe in a stream that reads through a ring of at
+// least size bytes (the capacity of the pipe if 0). fd is only taken over on
+// success.
+static FILE *fpipes_ring_open(int fd, size_t size) {
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	int memfd = -1;
+	struct fpipes_ring *ring = calloc(1, sizeof(struct fpipes_ring));
+
+	if (ring == NULL) {
+		return NULL;
+	}
+
+	ring->stream.fd   = -1;
+	ring->stream.ring = 1;
+	ring->data        = MAP_FAILED;
+
+	if (size == 0) {
+#ifdef F_GETPIPE_SZ
+		const int capacity = fcntl(fd, F_GETPIPE_SZ);
+		size = capacity > 0 ? (size_t)capacity : BUFSIZ;
 #else
-	extern char **environ;
+		size = BUFSIZ;
 #endif
+	}
 
-#define FPIPES_IS_FILE(F) ((F) > FPIPES_TEMP)
+	if (size > SIZE_MAX / 2 - page) {
+		errno = ENOMEM;
+		goto error;
+	}
+	ring->size = (size + page - 1) / page * page;
+
+	// reserve the address range first, then map the file into both halves
+	ring->data = mmap(NULL, ring->size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
-void pipes_redirect_fd(int oldfd, int newfd, const char *msg);
+	if (ring->data == MAP_FAILED || (memfd = pipes_memfd()) == -1 || ftruncate(memfd, (off_t)ring->size) == -1 ||
+	    mmap(ring->data, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memfd, 0) == MAP_FAILED ||
+	    mmap(ring->data + ring->size, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memfd, 0) == MAP_FAILED) {
+		goto error;
+	}
+
+	close(memfd);
+	memfd = -1;
+
+	cookie_io_functions_t io = { fpipes_ring_read, NULL, NULL, fpipes_ring_close };
+	FILE *fp = fopencookie(ring, "r", io);
+
+	if (fp == NULL) {
+		goto error;
+	}
+
+	// The ring is the buffer. A stdio buffer on top of it would take data
+	// out of the ring that fpipes_peek() then wouldn't see. The price is a
+	// call of fpipes_ring_read() for every getc() or fgets() character.
+	setvbuf(fp, NULL, _IONBF, 0);
+
+	if (fpipes_stream_add(fp, &ring->stream) == -1) {
+		const int errnum = errno;
+		fclose(fp); // frees the ring, but leaves fd alone
+		errno = errnum;
+		return NULL;
+	}
+
+	ring->stream.fd = fd;
+
+	return fp;
+
+error:
+	(void)0;
+
+	const int errnum = errno;
+
+	if (memfd > -1) {
+		close(memfd);
+	}
+	fpipes_ring_free(ring);
+
+	errno = errnum;
+
+	return NULL;
+}
+
+ssize_t fpipes_peek(FILE* fp, size_t min, char const** data) {
+	struct fpipes_ring *ring = fpipes_ring_find(fp);
+
+	if (ring == NULL) {
+		return -1;
+	}
+
+	if (min > ring->size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (min == 0) {
+		min = 1;
+	}
+
+	while (ring->count < min && !ring->eof) {
+		if (fpipes_ring_fill(ring) == -1) {
+			return -1;
+		}
+	}
+
+	*data = ring->data + ring->head;
+
+	return (ssize_t)ring->count;
+}
+
+int fpipes_consume(FILE* fp, size_t count) {
+	struct fpipes_ring *ring = fpipes_ring_find(fp);
+
+	if (ring == NULL) {
+		return -1;
+	}
+
+	if (count > ring->count) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fpipes_ring_consume(ring, count);
+
+	return 0;
+}
+
+int fpipes_ready(FILE* fp, int timeout) {
+	struct fpipes_ring *ring = fpipes_ring_find(fp);
+
+	if (ring == NULL) {
+		return -1;
+	}
+
+	if (ring->count > 0 || ring->eof) {
+		return 1;
+	}
+
+	struct pollfd pfd = { ring->stream.fd, POLLIN, 0 };
+	int ready;
+
+	do {
+		ready = poll(&pfd, 1, timeout);
+	} while (ready == -1 && errno == EINTR);
+
+	return ready;
+}
+
+// A stream with a buffer of the library. fopencookie() is used so the
+// buffer is freed when the stream is closed, whichever way that happens.
+struct fpipes_buffered {
+	struct fpipes_stream stream;
+	char buffer[];
+};
+
+static ssize_t fpipes_buffered_read(void* cookie, char* buf, size_t size) {
+	struct fpipes_buffered *buffered = cookie;
+	ssize_t count;
+
+	do {
+		count = read(buffered->stream.fd, buf, size);
+	} while (count == -1 && errno == EINTR);
+
+	return count;
+}
+
+static ssize_t fpipes_buffered_write(void* cookie, char const* buf, size_t size) {
+	struct fpipes_buffered *buffered = cookie;
+	ssize_t count;
+
+	do {
+		count = write(buffered->stream.fd, buf, size);
+	} while (count == -1 && errno == EINTR);
+
+	return count;
+}
+
+static int fpipes_buffered_close(void* cookie) {
+	struct fpipes_buffered *buffered = cookie;
+	const int status = buffered->stream.fd > -1 ? close(buffered->stream.fd) : 0;
+
+	fpipes_stream_remove(&buffered->stream);
+	free(buffered);
+
+	return status;
+}
+
+// Wrap fd in a stream with a buffer of size bytes (the capacity of the pipe
+// if 0). fd is only taken over on success.
+static FILE *fpipes_buffered_open(int fd, char const* mode, int buffering, size_t size) {
+	if (size == 0) {
+#ifdef F_GETPIPE_SZ
+		const int capacity = fcntl(fd, F_GETPIPE_SZ);
+		size = capacity > 0 ? (size_t)capacity : BUFSIZ;
+#else
+		size = BUFSIZ;
+#endif
+	}
+
+	if (size > SIZE_MAX - sizeof(struct fpipes_buffered)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	struct fpipes_buffered *buffered = malloc(sizeof(struct fpipes_buffered) + size);
+
+	if (buffered == NULL) {
+		return NULL;
+	}
+
+	buffered->stream.fd   = -1;
+	buffered->stream.ring = 0;
+
+	cookie_io_functions_t io = {
+		*mode == 'r' ? fpipes_buffered_read : NULL,
+		*mode == 'w' ? fpipes_buffered_write : NULL,
+		NULL,
+		fpipes_buffered_close
+	};
+	FILE *fp = fopencookie(buffered, mode, io);
+
+	if (fp == NULL) {
+		free(buffered);
+		return NULL;
+	}
+
+	// can't fail for a fresh stream and a valid mode
+	setvbuf(fp, buffered->buffer, buffering, size);
+
+	if (fpipes_stream_add(fp, &buffered->stream) == -1) {
+		const int errnum = errno;
+		fclose(fp); // frees the buffer, but leaves fd alone
+		errno = errnum;
+		return NULL;
+	}
+
+	buffered->stream.fd = fd;
+
+	return fp;
+}
+
+// Like fdopen(), but buffered as requested by options. By default the
+// buffer has the size of the pipe. fd is only taken over on success.
+static FILE *fpipes_fdopen(int fd, char const* mode, struct fpipes_buffering const* options) {
+	static struct fpipes_buffering const defaults = { FPIPES_BUF_DEFAULT, 0, NULL, 0 };
+
+	if (options == NULL) {
+		options = &defaults;
+	}
+
+	if ((options->mode != FPIPES_BUF_DEFAULT && options->mode != FPIPES_BUF_FULL &&
+	     options->mode != FPIPES_BUF_LINE && options->mode != FPIPES_BUF_NONE &&
+	     options->mode != FPIPES_BUF_RING) ||
+	    (options->flags & ~FPIPES_BUF_NONBLOCK) != 0 ||
+	    (options->buffer != NULL && options->size == 0) ||
+	    (options->mode == FPIPES_BUF_RING && (options->buffer != NULL || *mode != 'r'))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (options->flags & FPIPES_BUF_NONBLOCK) {
+		const int flags = fcntl(fd, F_GETFL);
+
+		if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+			return NULL;
+		}
+	}
+
+	const int buffering = options->mode == FPIPES_BUF_LINE ? _IOLBF : _IOFBF;
+
+	if (options->mode == FPIPES_BUF_RING) {
+		return fpipes_ring_open(fd, options->size);
+	}
+
+	if (options->mode != FPIPES_BUF_NONE && options->buffer == NULL) {
+		return fpipes_buffered_open(fd, mode, buffering, options->size);
+	}
+
+	FILE *fp = fdopen(fd, mode);
+
+	// setvbuf() can't fail for a fresh stream and a valid mode
+	if (fp && options->mode == FPIPES_BUF_NONE) {
+		setvbuf(fp, NULL, _IONBF, 0);
+	}
+	else if (fp) {
+		setvbuf(fp, options->buffer, buffering, options->size);
+	}
+
+	return fp;
+}
 
 int fpipes_open(char const *const argv[], char const *const envp[], struct fpipes* pipes) {
+	return fpipes_open_attr(argv, envp, NULL, pipes);
+}
+
+// Open the process of pipes. If linked its stdout is passed on to the next
+// stage of a chain, so it's a plain stream without a buffer of its own.
+static int fpipes_start(char const *const argv[], char const *const envp[],
+                        struct pipes_attr const* attr, struct fpipes* pipes, int linked) {
+	struct fpipes_options const* options = pipes->options;
 	int infd  = -1;
 	int outfd = -1;
 	int errfd = -1;
@@ -29,6 +603,10 @@ int fpipes_open(char const *const argv[], char const *const envp[], struct fpipe
 	FILE* inaction  = pipes->in;
 	FILE* outaction = pipes->out;
 	FILE* erraction = pipes->err;
+	const int pipe_size = attr ? attr->pipe_size : 0;
+
+	pipes->pipe_size = 0;
+	pipes->pidfd     = -1;
 
 	// stdin
 	if (inaction == FPIPES_PIPE) {
@@ -37,8 +615,10 @@ int fpipes_open(char const *const argv[], char const *const envp[], struct fpipe
 			goto error;
 		}
 
+		pipes_resize_pipe(pair[0], pipe_size, &pipes->pipe_size);
+
 		infd = pair[0];
-		pipes->in = fdopen(pair[1], "w");
+		pipes->in = fpipes_fdopen(pair[1], "w", options ? &options->in : NULL);
 
 		if (pipes->in == NULL) {
 			close(pair[1]);
@@ -54,7 +634,7 @@ int fpipes_open(char const *const argv[], char const *const envp[], struct fpipe
 		}
 	}
 	else if (FPIPES_IS_FILE(inaction)) {
-		infd = fileno(pipes->in);
+		infd = fpipes_fileno(pipes->in);
 
 		if (infd < 0) {
 			goto error;
@@ -70,6 +650,13 @@ int fpipes_open(char const *const argv[], char const *const envp[], struct fpipe
 
 		infd = fileno(pipes->in);
 	}
+	else if (inaction == FPIPES_MEMFD) {
+		if (fpipes_memfile(&pipes->in) == -1) {
+			goto error;
+		}
+
+		infd = fileno(pipes->in);
+	}
 	else if (inaction == FPIPES_LEAVE) {
 		pipes->in = NULL;
 	}
@@ -85,7 +672,9 @@ int fpipes_open(char const *const argv[], char const *const envp[], struct fpipe
 			goto error;
 		}
 
-		pipes->out = fdopen(pair[0], "r");
+		pipes_resize_pipe(pair[0], pipe_size, &pipes->pipe_size);
+
+		pipes->out = linked ? fdopen(pair[0], "r") : fpipes_fdopen(pair[0], "r", options ? &options->out : NULL);
 		outfd = pair[1];
 
 		if (pipes->out == NULL) {
@@ -106,8 +695,8 @@ int fpipes_open(char const *const argv[], char const *const envp[], struct fpipe
 		pipes->err = NULL;
 	}
 	else if (FPIPES_IS_FILE(outaction)) {
-		outfd = fileno(pipes->out);
-		
+		outfd = fpipes_fileno(pipes->out);
+
 		if (outfd < 0) {
 			goto error;
 		}
@@ -122,6 +711,13 @@ int fpipes_open(char const *const argv[], char const *const envp[], struct fpipe
 
 		outfd = fileno(pipes->out);
 	}
+	else if (outaction == FPIPES_MEMFD) {
+		if (fpipes_memfile(&pipes->out) == -1) {
+			goto error;
+		}
+
+		outfd = fileno(pipes->out);
+	}
 	else if (outaction == FPIPES_LEAVE) {
 		pipes->out = NULL;
 	}
@@ -137,7 +733,9 @@ int fpipes_open(char const *const argv[], char const *const envp[], struct fpipe
 			goto error;
 		}
 
-		pipes->err = fdopen(pair[0], "r");
+		pipes_resize_pipe(pair[0], pipe_size, &pipes->pipe_size);
+
+		pipes->err = fpipes_fdopen(pair[0], "r", options ? &options->err : NULL);
 		errfd = pair[1];
 
 		if (pipes->err == NULL) {
@@ -158,7 +756,7 @@ int fpipes_open(char const *const argv[], char const *const envp[], struct fpipe
 		pipes->err = NULL;
 	}
 	else if (FPIPES_IS_FILE(erraction)) {
-		errfd = fileno(pipes->err);
+		errfd = fpipes_fileno(pipes->err);
 
 		if (errfd < 0) {
 			goto error;
@@ -174,6 +772,13 @@ int fpipes_open(char const *const argv[], char const *const envp[], struct fpipe
 
 		errfd = fileno(pipes->err);
 	}
+	else if (erraction == FPIPES_MEMFD) {
+		if (fpipes_memfile(&pipes->err) == -1) {
+			goto error;
+		}
+
+		errfd = fileno(pipes->err);
+	}
 	else if (erraction == FPIPES_LEAVE) {
 		pipes->err = NULL;
 	}
@@ -182,75 +787,26 @@ int fpipes_open(char const *const argv[], char const *const envp[], struct fpipe
 		goto error;
 	}
 
-	pid_t pid = fork();
+	const pid_t pid = pipes_spawn(NULL, argv, envp, attr,
+		infd,
+		outaction == FPIPES_TO_STDERR ? PIPES_TO_STDERR : outfd,
+		erraction == FPIPES_TO_STDOUT ? PIPES_TO_STDOUT : errfd,
+		NULL, 0, &pipes->pidfd);
 
 	if (pid == -1) {
 		goto error;
 	}
 
-	if (pid == 0) {
-		// child
-
-		// close unused ends
-		if (pipes->in != NULL && fileno(pipes->in) != infd) {
-			fclose(pipes->in);
-			pipes->in = NULL;
-		}
-
-		if (pipes->out != NULL && fileno(pipes->out) != outfd) {
-			fclose(pipes->out);
-			pipes->out = NULL;
-		}
-
-		if (pipes->err != NULL && fileno(pipes->err) != errfd) {
-			fclose(pipes->err);
-			pipes->err = NULL;
-		}
-
-		pipes_redirect_fd(infd, STDIN_FILENO, "redirecting stdin");
-
-		if (outaction == FPIPES_TO_STDERR) {
-			if (dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
-				perror("redirecting stdout");
-				exit(EXIT_FAILURE);
-			}
-		}
-		else {
-			pipes_redirect_fd(outfd, STDOUT_FILENO, "redirecting stdout");
-		}
-
-		if (erraction == FPIPES_TO_STDOUT) {
-			if (dup2(STDOUT_FILENO, STDERR_FILENO) == -1) {
-				perror("redirecting stderr");
-				exit(EXIT_FAILURE);
-			}
-		}
-		else {
-			pipes_redirect_fd(errfd, STDERR_FILENO, "redirecting stderr");
-		}
-
-		if (envp) {
-			environ = (char**)envp;
-		}
-
-		if (execvp(argv[0], (char * const*)argv) == -1) {
-			perror(argv[0]);
-		}
-		exit(EXIT_FAILURE);
-	}
-	else {
-		// parent
-		pipes->pid = pid;
+	pipes->pid = pid;
 
-		if (FPIPES_IS_FILE(inaction)) fclose(inaction);
-		else if (inaction  != FPIPES_TEMP && infd  > -1) close(infd);
+	if (FPIPES_IS_FILE(inaction)) fclose(inaction);
+	else if (!FPIPES_IS_TEMP(inaction) && infd  > -1) close(infd);
 
-		if (FPIPES_IS_FILE(outaction)) fclose(outaction);
-		else if (outaction != FPIPES_TEMP && outfd > -1) close(outfd);
+	if (FPIPES_IS_FILE(outaction)) fclose(outaction);
+	else if (!FPIPES_IS_TEMP(outaction) && outfd > -1) close(outfd);
 
-		if (FPIPES_IS_FILE(erraction)) fclose(erraction);
-		else if (erraction != FPIPES_TEMP && errfd > -1) close(errfd);
-	}
+	if (FPIPES_IS_FILE(erraction)) fclose(erraction);
+	else if (!FPIPES_IS_TEMP(erraction) && errfd > -1) close(errfd);
 
 	return 0;
 
@@ -259,14 +815,15 @@ error:
 
 	int errnum = errno;
 
-	if (infd  > -1) close(infd);
-	if (outfd > -1) close(outfd);
-	if (errfd > -1) close(errfd);
+	// file descriptors of passed and temporary files are closed by fclose()
+	if (infd  > -1 && !FPIPES_IS_FILE(inaction)  && !FPIPES_IS_TEMP(inaction)) close(infd);
+	if (outfd > -1 && !FPIPES_IS_FILE(outaction) && !FPIPES_IS_TEMP(outaction)) close(outfd);
+	if (errfd > -1 && !FPIPES_IS_FILE(erraction) && !FPIPES_IS_TEMP(erraction)) close(errfd);
 
 	if (FPIPES_IS_FILE(inaction)) {
 		fclose(inaction);
 	}
-	else if (pipes->in) {
+	else if (FPIPES_IS_FILE(pipes->in)) {
 		fclose(pipes->in);
 	}
 	pipes->in = NULL;
@@ -274,7 +831,7 @@ error:
 	if (FPIPES_IS_FILE(outaction)) {
 		fclose(outaction);
 	}
-	else if (pipes->out) {
+	else if (FPIPES_IS_FILE(pipes->out)) {
 		fclose(pipes->out);
 	}
 	pipes->out = NULL;
@@ -282,7 +839,7 @@ error:
 	if (FPIPES_IS_FILE(erraction)) {
 		fclose(erraction);
 	}
-	else if (pipes->err) {
+	else if (FPIPES_IS_FILE(pipes->err)) {
 		fclose(pipes->err);
 	}
 	pipes->err = NULL;
@@ -294,6 +851,10 @@ error:
 	return -1;
 }
 
+int fpipes_open_attr(char const *const argv[], char const *const envp[],
+                     struct pipes_attr const* attr, struct fpipes* pipes) {
+	return fpipes_start(argv, envp, attr, pipes, 0);
+}
 
 int fpipes_close(struct fpipes* pipes) {
 	int status = 0;
@@ -319,15 +880,27 @@ int fpipes_close(struct fpipes* pipes) {
 		pipes->err = NULL;
 	}
 
+	if (pipes->pidfd > -1) {
+		if (close(pipes->pidfd) != 0) {
+			status = -1;
+		}
+		pipes->pidfd = -1;
+	}
+
 	return status;
 }
 
 int fpipes_open_chain(struct fpipes_chain chain[]) {
+	return fpipes_open_chain_attr(chain, NULL);
+}
+
+int fpipes_open_chain_attr(struct fpipes_chain chain[], struct pipes_attr const* attr) {
 	struct fpipes_chain *ptr  = chain;
 	struct fpipes_chain *prev = chain;
 
 	for (; ptr->argv; ++ ptr) {
-		ptr->pipes.pid = -1;
+		ptr->pipes.pid   = -1;
+		ptr->pipes.pidfd = -1;
 	}
 
 	if (chain == NULL || chain[0].argv == NULL) {
@@ -348,7 +921,11 @@ int fpipes_open_chain(struct fpipes_chain chain[]) {
 	ptr  = chain;
 	prev = chain;
 
-	if (fpipes_open(ptr->argv, ptr->envp, &ptr->pipes) == -1) {
+	struct pipes_placement placement;
+	placement.group = (size_t)-1;
+
+	if (fpipes_start(ptr->argv, ptr->envp, pipes_place_stage(&placement, ptr->attr ? ptr->attr : attr),
+	                 &ptr->pipes, ptr[1].argv && ptr[1].pipes.in == FPIPES_PIPE) == -1) {
 		goto error;
 	}
 
@@ -358,7 +935,10 @@ int fpipes_open_chain(struct fpipes_chain chain[]) {
 			prev->pipes.out = NULL;
 		}
 
-		if (fpipes_open(ptr->argv, ptr->envp, &ptr->pipes) == -1) {
+		struct pipes_attr const* stage_attr = pipes_place_stage(&placement, ptr->attr ? ptr->attr : attr);
+
+		if (fpipes_start(ptr->argv, ptr->envp, stage_attr, &ptr->pipes,
+		                 ptr[1].argv && ptr[1].pipes.in == FPIPES_PIPE) == -1) {
 			goto error;
 		}
 
@@ -400,7 +980,7 @@ int fpipes_kill_chain(struct fpipes_chain chain[], int sig) {
 
 	for (struct fpipes_chain *ptr = chain; ptr->argv; ++ ptr) {
 		if (ptr->pipes.pid > -1) {
-			if (kill(ptr->pipes.pid, sig) != 0) {
+			if (pipes_pidfd_kill(ptr->pipes.pid, ptr->pipes.pidfd, sig) != 0) {
 				status = -1;
 			}
 		}
@@ -409,6 +989,57 @@ int fpipes_kill_chain(struct fpipes_chain chain[], int sig) {
 	return status;
 }
 
+int fpipes_wait(struct fpipes* pipes, int* status) {
+	if (pipes->pid < 0) {
+		errno = ECHILD;
+		return -1;
+	}
+
+	return pipes_reap(&pipes->pid, &pipes->pidfd, status, 0) == -1 ? -1 : 0;
+}
+
+int fpipes_wait_chain(struct fpipes_chain chain[], int status[]) {
+	int result = 0;
+
+	for (size_t index = 0; chain[index].argv; ++ index) {
+		if (chain[index].pipes.pid > -1) {
+			if (pipes_reap(&chain[index].pipes.pid, &chain[index].pipes.pidfd,
+			               status ? &status[index] : NULL, 0) == -1) {
+				result = -1;
+			}
+		}
+	}
+
+	return result;
+}
+
+int fpipes_poll_chain(struct fpipes_chain chain[], int status[], int timeout) {
+	size_t count = 0;
+	while (chain[count].argv) ++ count;
+
+	struct pipes_proc *procs = calloc(count ? count : 1, sizeof(struct pipes_proc));
+
+	if (procs == NULL) {
+		return -1;
+	}
+
+	for (size_t index = 0; index < count; ++ index) {
+		procs[index].pid   = &chain[index].pipes.pid;
+		procs[index].pidfd = &chain[index].pipes.pidfd;
+	}
+
+	int running = pipes_poll_procs(procs, count, status, timeout);
+	int errnum  = errno;
+
+	free(procs);
+
+	if (running == -1) {
+		errno = errnum;
+	}
+
+	return running;
+}
+
 FILE* fpipes_take_in(struct fpipes_chain chain[]) {
 	if (chain[0].argv) {
 		FILE *fp = chain[0].pipes.in;
@@ -6,6 +6,7 @@
 #include <stdio.h>
 
 #include "export.h"
+#include "pipes.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -19,43 +20,93 @@ extern "C" {
 #define FPIPES_TO_STDOUT  ((FILE*)4)
 #define FPIPES_TO_STDERR  ((FILE*)5)
 #define FPIPES_TEMP       ((FILE*)6)
+#define FPIPES_MEMFD      ((FILE*)7)
 
-#define FPIPES_PASS     {-1, FPIPES_PIPE,  FPIPES_PIPE,  FPIPES_LEAVE}
-#define FPIPES_IN(IN)   {-1, (IN),         FPIPES_PIPE,  FPIPES_LEAVE}
-#define FPIPES_OUT(OUT) {-1, FPIPES_PIPE,  (OUT),        FPIPES_LEAVE}
-#define FPIPES_ERR(ERR) {-1, FPIPES_PIPE,  FPIPES_PIPE,  (ERR)}
-#define FPIPES_FIRST    {-1, FPIPES_LEAVE, FPIPES_PIPE,  FPIPES_LEAVE}
-#define FPIPES_LAST     {-1, FPIPES_PIPE,  FPIPES_LEAVE, FPIPES_LEAVE}
+/* Buffering modes for struct fpipes_buffering. */
+#define FPIPES_BUF_DEFAULT 0
+#define FPIPES_BUF_FULL    1
+#define FPIPES_BUF_LINE    2
+#define FPIPES_BUF_NONE    3
+#define FPIPES_BUF_RING    4
+
+/* Flags for struct fpipes_buffering. */
+#define FPIPES_BUF_NONBLOCK 0x1
+
+#define FPIPES_PASS     {-1, FPIPES_PIPE,  FPIPES_PIPE,  FPIPES_LEAVE, 0, -1, NULL}
+#define FPIPES_IN(IN)   {-1, (IN),         FPIPES_PIPE,  FPIPES_LEAVE, 0, -1, NULL}
+#define FPIPES_OUT(OUT) {-1, FPIPES_PIPE,  (OUT),        FPIPES_LEAVE, 0, -1, NULL}
+#define FPIPES_ERR(ERR) {-1, FPIPES_PIPE,  FPIPES_PIPE,  (ERR),        0, -1, NULL}
+#define FPIPES_FIRST    {-1, FPIPES_LEAVE, FPIPES_PIPE,  FPIPES_LEAVE, 0, -1, NULL}
+#define FPIPES_LAST     {-1, FPIPES_PIPE,  FPIPES_LEAVE, FPIPES_LEAVE, 0, -1, NULL}
+
+/* Like PIPES_STAGE() for struct fpipes_chain. */
+#define FPIPES_STAGE(PIPES, ARGV) {PIPES, (ARGV), NULL, NULL}
 
 #define FPIPES_GET_LAST(CHAIN) ((CHAIN)[(sizeof(CHAIN) / sizeof(struct fpipes_chain))-2].pipes)
 #define FPIPES_GET_IN(CHAIN)   ((CHAIN)[0].pipes.in)
 #define FPIPES_GET_OUT(CHAIN)  (FPIPES_GET_LAST(CHAIN).out)
 #define FPIPES_GET_ERR(CHAIN)  (FPIPES_GET_LAST(CHAIN).err)
 
+/* Buffering of a stream the library opens a pipe for. Unless a buffer is
+ * passed or the mode is _NONE the library allocates the buffer, and the
+ * stream is a fopencookie() stream that frees it when it is closed. fileno()
+ * returns -1 for such a stream, use fpipes_fileno() to get its pipe, e.g. to
+ * poll it. */
+struct fpipes_buffering {
+	int mode;     /* FPIPES_BUF_DEFAULT (same as _FULL), _FULL, _LINE, _NONE or _RING */
+	size_t size;  /* size of the buffer or 0 for the capacity of the pipe */
+	char* buffer; /* buffer of size bytes or NULL to let the library allocate it */
+	int flags;    /* FPIPES_BUF_NONBLOCK or 0 */
+};
+
+struct fpipes_options {
+	struct fpipes_buffering in;
+	struct fpipes_buffering out;
+	struct fpipes_buffering err;
+};
+
 struct fpipes {
 	pid_t pid;
 	FILE *in;
 	FILE *out;
 	FILE *err;
+	int pipe_size;
+	int pidfd;
+	struct fpipes_options const* options; /* NULL for the defaults */
 };
 
 struct fpipes_chain {
 	struct fpipes pipes;
 	char const* const* argv;
 	char const* const* envp;
+	struct pipes_attr const* attr;
 };
 
 PIPES_EXPORT int fpipes_open(char const *const argv[], char const *const envp[], struct fpipes* pipes);
+PIPES_EXPORT int fpipes_open_attr(char const *const argv[], char const *const envp[],
+                                  struct pipes_attr const* attr, struct fpipes* pipes);
 PIPES_EXPORT int fpipes_close(struct fpipes* pipes);
+PIPES_EXPORT int fpipes_wait( struct fpipes* pipes, int* status);
 
 PIPES_EXPORT int fpipes_open_chain( struct fpipes_chain chain[]);
+PIPES_EXPORT int fpipes_open_chain_attr(struct fpipes_chain chain[], struct pipes_attr const* attr);
 PIPES_EXPORT int fpipes_close_chain(struct fpipes_chain chain[]);
 PIPES_EXPORT int fpipes_kill_chain( struct fpipes_chain chain[], int sig);
+PIPES_EXPORT int fpipes_wait_chain( struct fpipes_chain chain[], int status[]);
+PIPES_EXPORT int fpipes_poll_chain( struct fpipes_chain chain[], int status[], int timeout);
 
 PIPES_EXPORT FILE* fpipes_take_in( struct fpipes_chain chain[]);
 PIPES_EXPORT FILE* fpipes_take_out(struct fpipes_chain chain[]);
 PIPES_EXPORT FILE* fpipes_take_err(struct fpipes_chain chain[]);
 
+/* The file descriptor of fp, also for the fopencookie() streams of the
+ * library. Returns -1 and sets errno if fp has none. */
+PIPES_EXPORT int fpipes_fileno(FILE* fp);
+
+PIPES_EXPORT ssize_t fpipes_peek(FILE* fp, size_t min, char const** data);
+PIPES_EXPORT int fpipes_consume(FILE* fp, size_t count);
+PIPES_EXPORT int fpipes_ready(  FILE* fp, int timeout);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,240 @@
+#define _POSIX_SOURCE
+#define _GNU_SOURCE
+
+#include "internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+// seconds an idle worker waits for another stage before it exits
+#define PIPES_WORKER_IDLE 5
+
+struct pipes_job {
+	int (*fn)(int infd, int outfd, void* ctx);
+	void *ctx;
+	int infd;
+	int outfd;
+	int donefd; // write end of the pipe returned by pipes_function_start()
+	struct pipes_job *next;
+};
+
+// Function stages of a chain block on each other like processes do, so every
+// queued job gets a worker of its own. Workers are only reused once they are
+// done with a stage.
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	struct pipes_job *head;
+	struct pipes_job *tail;
+	size_t queued;
+	size_t idle;
+} pipes_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0, 0 };
+
+static void pipes_job_run(struct pipes_job *job) {
+	const int code = job->fn(job->infd, job->outfd, job->ctx);
+
+	// closing the pipes is what ends the neighbouring stages
+	close(job->infd);
+	close(job->outfd);
+
+	// an exit status just like the one of a process that called exit(code)
+	const int status = (code & 0xff) << 8;
+	ssize_t written;
+
+	do {
+		written = write(job->donefd, &status, sizeof(status));
+	} while (written == -1 && errno == EINTR);
+
+	close(job->donefd);
+	free(job);
+
+	// SIGPIPE is blocked in the workers, so writes to closed pipes only
+	// failed with EPIPE. Don't keep the signal pending for the next stage.
+	sigset_t sigpipe;
+	struct timespec zero = { 0, 0 };
+	sigemptyset(&sigpipe);
+	sigaddset(&sigpipe, SIGPIPE);
+	while (sigtimedwait(&sigpipe, NULL, &zero) > 0);
+}
+
+static void *pipes_worker(void *arg) {
+	(void)arg;
+
+	pthread_mutex_lock(&pipes_pool.lock);
+
+	for (;;) {
+		while (pipes_pool.head == NULL) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += PIPES_WORKER_IDLE;
+
+			++ pipes_pool.idle;
+			const int errnum = pthread_cond_timedwait(&pipes_pool.wakeup, &pipes_pool.lock, &deadline);
+			-- pipes_pool.idle;
+
+			if (errnum == ETIMEDOUT && pipes_pool.head == NULL) {
+				pthread_mutex_unlock(&pipes_pool.lock);
+				return NULL;
+			}
+		}
+
+		struct pipes_job *job = pipes_pool.head;
+		pipes_pool.head = job->next;
+		if (pipes_pool.head == NULL) {
+			pipes_pool.tail = NULL;
+		}
+		-- pipes_pool.queued;
+
+		pthread_mutex_unlock(&pipes_pool.lock);
+
+		pipes_job_run(job);
+
+		pthread_mutex_lock(&pipes_pool.lock);
+	}
+}
+
+// Start another worker. Called with the pool locked.
+static int pipes_worker_create(void) {
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	int errnum = pthread_attr_init(&attr);
+	if (errnum != 0) {
+		return errnum;
+	}
+
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	// signals are for the threads of the application, not for the workers
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	errnum = pthread_create(&thread, &attr, pipes_worker, NULL);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+
+	return errnum;
+}
+
+int pipes_function_start(int (*fn)(int infd, int outfd, void* ctx), void* ctx, int infd, int outfd) {
+	int done[2] = {-1, -1};
+	int errnum  = 0;
+	struct pipes_job *job = calloc(1, sizeof(struct pipes_job));
+
+	if (job == NULL) {
+		return -1;
+	}
+
+	job->fn     = fn;
+	job->ctx    = ctx;
+	job->infd   = -1;
+	job->outfd  = -1;
+	job->donefd = -1;
+
+	// The stage gets file descriptors of its own. The ones passed in are
+	// closed by the caller like the ones of a spawned process.
+	if (pipe2(done, O_CLOEXEC) == -1 ||
+	    (job->infd  = fcntl(infd,  F_DUPFD_CLOEXEC, 0)) == -1 ||
+	    (job->outfd = fcntl(outfd, F_DUPFD_CLOEXEC, 0)) == -1) {
+		goto error;
+	}
+
+	job->donefd = done[1];
+
+	pthread_mutex_lock(&pipes_pool.lock);
+
+	if (pipes_pool.tail) {
+		pipes_pool.tail->next = job;
+	}
+	else {
+		pipes_pool.head = job;
+	}
+	pipes_pool.tail = job;
+	++ pipes_pool.queued;
+
+	if (pipes_pool.idle >= pipes_pool.queued) {
+		pthread_cond_signal(&pipes_pool.wakeup);
+	}
+	else if ((errnum = pipes_worker_create()) != 0) {
+		// nobody took it yet, it's still the tail
+		struct pipes_job **ptr = &pipes_pool.head;
+		pipes_pool.tail = NULL;
+		while (*ptr != job) {
+			pipes_pool.tail = *ptr;
+			ptr = &(*ptr)->next;
+		}
+		*ptr = NULL;
+		-- pipes_pool.queued;
+	}
+
+	pthread_mutex_unlock(&pipes_pool.lock);
+
+	if (errnum != 0) {
+		errno = errnum;
+		goto error;
+	}
+
+	return done[0];
+
+error:
+	errnum = errno;
+
+	if (done[0] > -1) close(done[0]);
+	if (done[1] > -1) close(done[1]);
+	if (job->infd  > -1) close(job->infd);
+	if (job->outfd > -1) close(job->outfd);
+	free(job);
+
+	errno = errnum;
+
+	return -1;
+}
+
+int pipes_function_reap(int *donefd, int *status, int options) {
+	struct pollfd done = { *donefd, POLLIN, 0 };
+	int ready;
+
+	do {
+		ready = poll(&done, 1, options & WNOHANG ? 0 : -1);
+	} while (ready == -1 && errno == EINTR);
+
+	if (ready == -1) {
+		return -1;
+	}
+
+	if (ready == 0) {
+		return 0;
+	}
+
+	int wstatus = 0;
+	ssize_t count;
+
+	do {
+		count = read(*donefd, &wstatus, sizeof(wstatus));
+	} while (count == -1 && errno == EINTR);
+
+	const int errnum = errno;
+
+	close(*donefd);
+	*donefd = -1;
+
+	if (count == -1) {
+		errno = errnum;
+		return -1;
+	}
+
+	if (status) {
+		*status = wstatus;
+	}
+
+	return 1;
+}
@@ -0,0 +1,532 @@
+#define _POSIX_SOURCE
+#define _GNU_SOURCE
+
+#include "pipes.h"
+#include "internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+struct pipes_graph_edge {
+	int from;
+	int fromfd;
+	int to;
+	int tofd;
+};
+
+struct pipes_graph {
+	struct pipes_chain *nodes; // terminated by a node without argv
+	size_t count;
+	size_t capacity;
+	struct pipes_graph_edge *edges;
+	size_t nedges;
+	size_t edges_capacity;
+	int *helpers;              // done fds of the fan-in and fan-out helpers
+	size_t nhelpers;
+	int opened;
+};
+
+// Context of a fan-in or fan-out helper. fds are the inputs (fan-in) or
+// outputs (fan-out), the first one is the infd or outfd the helper is
+// started with. The helper owns the others and the context itself.
+struct pipes_graph_helper {
+	size_t count;
+	int fds[];
+};
+
+struct pipes_graph* pipes_graph_new(void) {
+	struct pipes_graph *graph = calloc(1, sizeof(struct pipes_graph));
+
+	if (graph == NULL) {
+		return NULL;
+	}
+
+	graph->nodes = calloc(1, sizeof(struct pipes_chain));
+
+	if (graph->nodes == NULL) {
+		free(graph);
+		return NULL;
+	}
+
+	graph->capacity = 1;
+
+	return graph;
+}
+
+void pipes_graph_free(struct pipes_graph* graph) {
+	if (graph == NULL) {
+		return;
+	}
+
+	pipes_close_chain(graph->nodes);
+
+	// The helpers end with their closed pipes and free their contexts
+	// themselves, nobody waits for them.
+	for (size_t index = 0; index < graph->nhelpers; ++ index) {
+		if (graph->helpers[index] > -1) {
+			close(graph->helpers[index]);
+		}
+	}
+
+	for (size_t index = 0; index < graph->count; ++ index) {
+		if (graph->nodes[index].pipes.pidfd > -1) {
+			close(graph->nodes[index].pipes.pidfd);
+		}
+	}
+
+	free(graph->nodes);
+	free(graph->edges);
+	free(graph->helpers);
+	free(graph);
+}
+
+int pipes_graph_add(struct pipes_graph* graph, struct pipes_chain const* node) {
+	if (graph == NULL || node == NULL || node->argv == NULL || graph->opened || graph->count >= INT_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	// one more for the terminating node
+	if (graph->count + 2 > graph->capacity) {
+		const size_t capacity = graph->capacity * 2;
+		struct pipes_chain *nodes = realloc(graph->nodes, capacity * sizeof(struct pipes_chain));
+
+		if (nodes == NULL) {
+			return -1;
+		}
+
+		graph->nodes    = nodes;
+		graph->capacity = capacity;
+	}
+
+	struct pipes_chain *ptr = &graph->nodes[graph->count];
+	*ptr = *node;
+	ptr->pipes.pid   = -1;
+	ptr->pipes.pidfd = -1;
+
+	memset(&graph->nodes[graph->count + 1], 0, sizeof(struct pipes_chain));
+
+	return (int)graph->count ++;
+}
+
+int pipes_graph_connect(struct pipes_graph* graph, int from, int fromfd, int to, int tofd) {
+	if (graph == NULL || graph->opened ||
+	    from < 0 || (size_t)from >= graph->count || to < 0 || (size_t)to >= graph->count ||
+	    fromfd < STDOUT_FILENO || (tofd != STDIN_FILENO && tofd <= STDERR_FILENO)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (graph->nedges == graph->edges_capacity) {
+		const size_t capacity = graph->edges_capacity ? graph->edges_capacity * 2 : 8;
+		struct pipes_graph_edge *edges = realloc(graph->edges, capacity * sizeof(struct pipes_graph_edge));
+
+		if (edges == NULL) {
+			return -1;
+		}
+
+		graph->edges          = edges;
+		graph->edges_capacity = capacity;
+	}
+
+	struct pipes_graph_edge edge = { from, fromfd, to, tofd };
+	graph->edges[graph->nedges ++] = edge;
+
+	return 0;
+}
+
+struct pipes_chain* pipes_graph_chain(struct pipes_graph* graph) {
+	if (graph == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return graph->nodes;
+}
+
+static void pipes_graph_helper_free(struct pipes_graph_helper* helper) {
+	for (size_t index = 1; index < helper->count; ++ index) {
+		close(helper->fds[index]);
+	}
+	free(helper);
+}
+
+static int pipes_graph_merge(int infd, int outfd, void* ctx) {
+	struct pipes_graph_helper *helper = ctx;
+	int errnum = 0;
+
+	helper->fds[0] = infd;
+
+	if (pipes_merge(helper->fds, helper->count, outfd) == -1) {
+		errnum = errno;
+	}
+
+	pipes_graph_helper_free(helper);
+
+	return errnum;
+}
+
+static int pipes_graph_fanout(int infd, int outfd, void* ctx) {
+	struct pipes_graph_helper *helper = ctx;
+	int errnum = 0;
+
+	helper->fds[0] = outfd;
+
+	if (pipes_fanout(infd, helper->fds, helper->count) == -1) {
+		errnum = errno;
+	}
+
+	pipes_graph_helper_free(helper);
+
+	return errnum;
+}
+
+// File descriptors created by pipes_graph_open(). Whatever is still in
+// there at the end is closed, so handing a file descriptor on (to a node
+// or a helper) removes it.
+struct pipes_graph_fds {
+	int *fds;
+	size_t count;
+};
+
+static int pipes_graph_pipe(struct pipes_graph_fds* owned, struct pipes_attr const* attr, int pair[2]) {
+	if (pipe2(pair, O_CLOEXEC) == -1) {
+		return -1;
+	}
+
+	if (attr && attr->pipe_size > 0) {
+		int granted = 0;
+		pipes_resize_pipe(pair[0], attr->pipe_size, &granted);
+	}
+
+	owned->fds[owned->count ++] = pair[0];
+	owned->fds[owned->count ++] = pair[1];
+
+	return 0;
+}
+
+static void pipes_graph_disown(struct pipes_graph_fds* owned, int fd) {
+	for (size_t index = 0; index < owned->count; ++ index) {
+		if (owned->fds[index] == fd) {
+			owned->fds[index] = -1;
+			return;
+		}
+	}
+}
+
+// Start a helper that moves data between infd, outfd and the count file
+// descriptors in fds, which it takes over on success.
+static int pipes_graph_helper(struct pipes_graph* graph, struct pipes_graph_fds* owned,
+                              int (*fn)(int infd, int outfd, void* ctx),
+                              int infd, int outfd, int const fds[], size_t count) {
+	struct pipes_graph_helper *helper = malloc(sizeof(struct pipes_graph_helper) + (count + 1) * sizeof(int));
+
+	if (helper == NULL) {
+		return -1;
+	}
+
+	helper->count  = count + 1;
+	helper->fds[0] = -1;
+	memcpy(helper->fds + 1, fds, count * sizeof(int));
+
+	const int donefd = pipes_function_start(fn, helper, infd, outfd);
+
+	if (donefd == -1) {
+		free(helper);
+		return -1;
+	}
+
+	graph->helpers[graph->nhelpers ++] = donefd;
+
+	for (size_t index = 0; index < count; ++ index) {
+		pipes_graph_disown(owned, fds[index]);
+	}
+
+	return 0;
+}
+
+static int pipes_graph_check(struct pipes_graph const* graph) {
+	if (graph->count == 0) {
+		return -1;
+	}
+
+	// function nodes have no file descriptors besides stdin and stdout
+	for (size_t index = 0; index < graph->count; ++ index) {
+		if (graph->nodes[index].fn && graph->nodes[index].pipes.nfds > 0) {
+			return -1;
+		}
+	}
+
+	for (size_t index = 0; index < graph->nedges; ++ index) {
+		struct pipes_graph_edge const* edge = &graph->edges[index];
+		struct pipes_chain const* from = &graph->nodes[edge->from];
+		struct pipes_chain const* to   = &graph->nodes[edge->to];
+
+		// connected standard streams have to be left to the graph
+		if ((edge->fromfd == STDOUT_FILENO && from->pipes.outfd != PIPES_LEAVE) ||
+		    (edge->fromfd == STDERR_FILENO && from->pipes.errfd != PIPES_LEAVE) ||
+		    (edge->tofd   == STDIN_FILENO  && to->pipes.infd    != PIPES_LEAVE)) {
+			return -1;
+		}
+
+		// function nodes only have stdin and stdout
+		if ((from->fn && edge->fromfd != STDOUT_FILENO) || (to->fn && edge->tofd != STDIN_FILENO)) {
+			return -1;
+		}
+
+		// a file descriptor of a node is either read or written
+		for (size_t other = 0; other < graph->nedges; ++ other) {
+			if (graph->edges[other].to == edge->from && graph->edges[other].tofd == edge->fromfd) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int pipes_graph_open(struct pipes_graph* graph, struct pipes_attr const* attr) {
+	if (graph == NULL || graph->opened || pipes_graph_check(graph) == -1) {
+		if (graph && !graph->opened) {
+			pipes_close_chain(graph->nodes);
+		}
+		errno = EINVAL;
+		return -1;
+	}
+
+	const size_t nedges = graph->nedges;
+	const size_t count  = graph->count;
+
+	graph->opened = 1;
+
+	// Every edge is a pipe. An output with more than one edge writes to
+	// another pipe that a fan-out helper copies to the edges, an input with
+	// more than one edge reads from another pipe that a fan-in helper
+	// merges the edges into. So at most two pipes per edge.
+	struct pipes_graph_fds owned = { calloc(nedges * 4 + 1, sizeof(int)), 0 };
+	int (*edgefds)[2]  = calloc(nedges + 1, sizeof(*edgefds));
+	int *srcfds        = calloc(nedges + 1, sizeof(int));
+	int *dstfds        = calloc(nedges + 1, sizeof(int));
+	int *group         = calloc(nedges + 1, sizeof(int));
+	struct pipes_fdmap *map      = calloc(nedges * 2 + 1, sizeof(struct pipes_fdmap));
+	struct pipes_stage_map *maps = calloc(count, sizeof(struct pipes_stage_map));
+	int (*fds)[3]      = calloc(count, sizeof(*fds));
+	int *helpers       = realloc(graph->helpers, (nedges * 2 + 1) * sizeof(int));
+	int errnum = 0;
+
+	if (helpers) {
+		graph->helpers = helpers;
+	}
+
+	if (owned.fds == NULL || edgefds == NULL || srcfds == NULL || dstfds == NULL || group == NULL ||
+	    map == NULL || maps == NULL || fds == NULL || helpers == NULL) {
+		errnum = errno;
+		pipes_close_chain(graph->nodes);
+		goto cleanup;
+	}
+
+	for (size_t index = 0; index < nedges; ++ index) {
+		struct pipes_graph_edge const* edge = &graph->edges[index];
+		struct pipes_attr const* to_attr = graph->nodes[edge->to].attr ? graph->nodes[edge->to].attr : attr;
+
+		srcfds[index] = dstfds[index] = -1;
+
+		if (pipes_graph_pipe(&owned, to_attr, edgefds[index]) == -1) {
+			goto error;
+		}
+	}
+
+	// outputs, handled once by their first edge
+	for (size_t index = 0; index < nedges; ++ index) {
+		struct pipes_graph_edge const* edge = &graph->edges[index];
+		size_t size = 0;
+
+		for (size_t other = 0; other < nedges; ++ other) {
+			if (graph->edges[other].from == edge->from && graph->edges[other].fromfd == edge->fromfd) {
+				if (other < index) break;
+				group[size ++] = edgefds[other][1];
+			}
+		}
+
+		if (size == 0) {
+			continue;
+		}
+
+		if (size == 1) {
+			srcfds[index] = group[0];
+			continue;
+		}
+
+		int pair[2];
+		if (pipes_graph_pipe(&owned, attr, pair) == -1 ||
+		    pipes_graph_helper(graph, &owned, pipes_graph_fanout, pair[0], group[0], group + 1, size - 1) == -1) {
+			goto error;
+		}
+
+		srcfds[index] = pair[1];
+	}
+
+	// inputs, likewise
+	for (size_t index = 0; index < nedges; ++ index) {
+		struct pipes_graph_edge const* edge = &graph->edges[index];
+		size_t size = 0;
+
+		for (size_t other = 0; other < nedges; ++ other) {
+			if (graph->edges[other].to == edge->to && graph->edges[other].tofd == edge->tofd) {
+				if (other < index) break;
+				group[size ++] = edgefds[other][0];
+			}
+		}
+
+		if (size == 0) {
+			continue;
+		}
+
+		if (size == 1) {
+			dstfds[index] = group[0];
+			continue;
+		}
+
+		int pair[2];
+		if (pipes_graph_pipe(&owned, attr, pair) == -1 ||
+		    pipes_graph_helper(graph, &owned, pipes_graph_merge, group[0], pair[1], group + 1, size - 1) == -1) {
+			goto error;
+		}
+
+		dstfds[index] = pair[0];
+	}
+
+	// Hand the ends over to the nodes. Standard streams become file
+	// descriptor actions, so they are closed like the ones of a chain.
+	size_t nmap = 0;
+	for (size_t node = 0; node < count; ++ node) {
+		struct pipes_chain *ptr = &graph->nodes[node];
+
+		maps[node].map   = map + nmap;
+		maps[node].count = 0;
+
+		for (size_t index = 0; index < nedges; ++ index) {
+			struct pipes_graph_edge const* edge = &graph->edges[index];
+
+			if ((size_t)edge->from == node && srcfds[index] > -1) {
+				if (edge->fromfd == STDOUT_FILENO) {
+					ptr->pipes.outfd = srcfds[index];
+					pipes_graph_disown(&owned, srcfds[index]);
+				}
+				else if (edge->fromfd == STDERR_FILENO) {
+					ptr->pipes.errfd = srcfds[index];
+					pipes_graph_disown(&owned, srcfds[index]);
+				}
+				else {
+					map[nmap].fd     = srcfds[index];
+					map[nmap].target = edge->fromfd;
+					++ nmap;
+					++ maps[node].count;
+				}
+			}
+
+			if ((size_t)edge->to == node && dstfds[index] > -1) {
+				if (edge->tofd == STDIN_FILENO) {
+					ptr->pipes.infd = dstfds[index];
+					pipes_graph_disown(&owned, dstfds[index]);
+				}
+				else {
+					map[nmap].fd     = dstfds[index];
+					map[nmap].target = edge->tofd;
+					++ nmap;
+					++ maps[node].count;
+				}
+			}
+		}
+	}
+
+	// closes everything given to the nodes on error
+	if (pipes_open_nodes(graph->nodes, count, attr, maps, fds) == -1) {
+		errnum = errno;
+		goto cleanup;
+	}
+
+	goto cleanup;
+
+error:
+	errnum = errno;
+	pipes_close_chain(graph->nodes);
+
+cleanup:
+	// The helpers have their own duplicates, so this leaves only them and
+	// the nodes with the pipes.
+	for (size_t index = 0; index < owned.count; ++ index) {
+		if (owned.fds[index] > -1) {
+			close(owned.fds[index]);
+		}
+	}
+
+	if (errnum != 0) {
+		// Started helpers end with their closed pipes, nobody waits for them.
+		for (size_t index = 0; index < graph->nhelpers; ++ index) {
+			close(graph->helpers[index]);
+			graph->helpers[index] = -1;
+		}
+	}
+
+	free(owned.fds);
+	free(edgefds);
+	free(srcfds);
+	free(dstfds);
+	free(group);
+	free(map);
+	free(maps);
+	free(fds);
+
+	if (errnum != 0) {
+		errno = errnum;
+		return -1;
+	}
+
+	return 0;
+}
+
+int pipes_graph_wait(struct pipes_graph* graph, int status[]) {
+	if (graph == NULL || graph->count == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	int result = pipes_wait_chain(graph->nodes, status);
+	int errnum = errno;
+
+	for (size_t index = 0; index < graph->nhelpers; ++ index) {
+		int code = 0;
+
+		if (graph->helpers[index] < 0) {
+			continue;
+		}
+
+		if (pipes_function_reap(&graph->helpers[index], &code, 0) == -1) {
+			if (result == 0) {
+				result = -1;
+				errnum = errno;
+			}
+			continue;
+		}
+
+		// A helper exits with its errno. EPIPE only means a node stopped
+		// reading early, like a process killed by SIGPIPE.
+		code = WEXITSTATUS(code);
+		if (code != 0 && code != EPIPE && result == 0) {
+			result = -1;
+			errnum = code;
+		}
+	}
+
+	if (result != 0) {
+		errno = errnum;
+	}
+
+	return result;
+}
@@ -0,0 +1,276 @@
+#ifndef PIPES_INTERNAL_H
+#define PIPES_INTERNAL_H
+#pragma once
+
+#include <sys/types.h>
+
+#include "pipes.h"
+
+/* Library internal helpers. This header is not installed. */
+
+void pipes_redirect_fd(int oldfd, int newfd, const char *msg);
+
+/* Most file descriptors above the standard streams a process can get. */
+#define PIPES_MAX_FDMAP 64
+
+/* The file descriptor fd of the parent becomes the file descriptor target
+ * (above the standard streams) of the child. */
+struct pipes_fdmap {
+	int fd;
+	int target;
+};
+
+/* Check that map has at most PIPES_MAX_FDMAP entries with distinct targets
+ * above the standard streams. Returns the lowest file descriptor above all
+ * targets. */
+int pipes_fdmap_check(struct pipes_fdmap const map[], size_t count);
+
+/* Duplicate the file descriptors of map to close on exec file descriptors
+ * from lowfd on, so redirecting the standard streams can't clobber them.
+ * Called in the child before the standard streams are redirected. */
+int pipes_redirect_map_prepare(struct pipes_fdmap const map[], size_t count, int lowfd, int moved[]);
+
+/* Duplicate moved[index] to map[index].target. Called in the child after the
+ * standard streams are redirected. */
+int pipes_redirect_map(struct pipes_fdmap const map[], size_t count, int const moved[]);
+
+/* If size is positive try to set the capacity of the pipe fd to size bytes.
+ * Never fails because of a too big size, instead the capacity that was
+ * actually granted is stored in *granted if it is smaller than the value
+ * already stored there (or that is 0). */
+void pipes_resize_pipe(int fd, int size, int *granted);
+
+/* Create an unnamed temporary file in P_tmpdir. */
+int pipes_temp_fd(void);
+
+/* Create an anonymous in-memory file that allows sealing. Falls back to a
+ * temporary file if memfd_create() isn't supported. */
+int pipes_memfd(void);
+
+/* The PATH that is used for a process with the environment envp (NULL for
+ * the environment of the calling process). */
+char const* pipes_search_path(char const *const envp[]);
+
+/* Search name in the colon separated list of directories search the same
+ * way execvp() does and store the path of the executable in path. Names that
+ * contain a slash are copied as is. */
+int pipes_find_executable(char const* name, char const* search, char* path, size_t size);
+
+/* Like pipes_find_executable() with the PATH of envp, but results are
+ * cached. A cached path is used as long as the file's inode and ctime don't
+ * change or until pipes_path_cache_flush() is called. */
+int pipes_resolve_executable(char const* name, char const *const envp[], char* path, size_t size);
+
+/* Open the first count stages of chain like pipes_open_chain_attr(), but
+ * without validating them. paths[index] is the executable of stage index
+ * (see pipes_spawn()) or paths is NULL. fds needs room for count elements. */
+int pipes_open_stages(struct pipes_chain chain[], size_t count, struct pipes_attr const* attr,
+                      char const *const paths[], int fds[][3]);
+
+/* Extra file descriptors of one stage for pipes_open_nodes(). */
+struct pipes_stage_map {
+	struct pipes_fdmap const* map;
+	size_t count;
+};
+
+/* Like pipes_open_stages(), but the stages are the independent nodes of a
+ * graph: PIPES_PIPE as stdin is a pipe to the calling process, not to the
+ * previous stage. maps[index] are the extra file descriptors of node index,
+ * they are not closed. */
+int pipes_open_nodes(struct pipes_chain nodes[], size_t count, struct pipes_attr const* attr,
+                     struct pipes_stage_map const maps[], int fds[][3]);
+
+/* Limits of struct pipes_limits, so the spawn server can receive them in
+ * buffers of a fixed size. */
+#define PIPES_MAX_RLIMITS   64
+#define PIPES_MAX_CPUS_SIZE 8192
+
+/* Check limits for invalid or unsupported values in the parent. */
+int pipes_limits_check(struct pipes_limits const* limits);
+
+/* Apply limits to the calling process except for the cgroup, which is done
+ * by pipes_clone(). Called in the child between fork and exec. */
+int pipes_limits_apply(struct pipes_limits const* limits);
+
+/* fork() or, if flags aren't 0, clone() with flags. If cgroupfd isn't -1
+ * the new process is created in that cgroup v2 directory using clone3()
+ * with CLONE_INTO_CGROUP. If pidfd isn't NULL a pidfd of the child is
+ * stored there using CLONE_PIDFD, or -1 if clone3() isn't available. */
+pid_t pipes_clone(int flags, int cgroupfd, int *pidfd);
+
+/* Highest CPU number + 1 that is considered for placement. */
+#define PIPES_MAX_CPUS 1024
+
+/* Storage for the attributes of a placed stage. group is (size_t)-1 until
+ * the first stage of the chain is placed. */
+struct pipes_placement {
+	size_t group;
+	struct pipes_attr attr;
+	struct pipes_limits limits;
+	unsigned long cpus[PIPES_MAX_CPUS / (8 * sizeof(unsigned long))];
+};
+
+/* Returns the attributes for the next stage of a chain. If attr has
+ * PIPES_ATTR_PLACE this is attr with an affinity to the CPUs of the cache
+ * sharing group of the chain, which stays valid until the next call with the
+ * same placement. Otherwise, or if the topology is unknown or attr already
+ * has an affinity, attr itself is returned. */
+struct pipes_attr const* pipes_place_stage(struct pipes_placement* placement, struct pipes_attr const* attr);
+
+/* Spawn argv using the backend selected in attr. path is the executable to
+ * run or NULL to look argv[0] up with pipes_resolve_executable(). If that
+ * fails or executing path fails the child falls back to searching PATH
+ * itself. infd, outfd and errfd are
+ * the file descriptors the child gets as its standard streams or -1 to leave
+ * the stream unchanged. outfd may also be PIPES_TO_STDERR and errfd may be
+ * PIPES_TO_STDOUT. The nmap entries of map (may be NULL if nmap is 0) are
+ * additional file descriptors of the child, see pipes_fdmap_check(). The
+ * passed file descriptors are not closed in the parent.
+ * If attr has PIPES_ATTR_PIDFD set a pidfd of the child is stored in *pidfd,
+ * otherwise (or if pidfds aren't supported) *pidfd is set to -1. */
+pid_t pipes_spawn(char const* path, char const *const argv[], char const *const envp[],
+                  struct pipes_attr const* attr, int infd, int outfd, int errfd,
+                  struct pipes_fdmap const map[], size_t nmap, int *pidfd);
+
+/* Spawn argv through the spawn server started by pipes_spawner_start(). The
+ * arguments are the same as for pipes_spawn(), limits may be NULL. Fails with ENOTCONN if the
+ * server isn't running (anymore). */
+pid_t pipes_spawner_spawn(char const* path, char const *const argv[], char const *const envp[],
+                          struct pipes_limits const* limits, int infd, int outfd, int errfd,
+                          struct pipes_fdmap const map[], size_t nmap);
+
+struct pipes_proc {
+	pid_t *pid;
+	int   *pidfd;
+	int    function; /* *pidfd is the done fd of a function stage */
+};
+
+int pipes_pidfd_open(pid_t pid);
+int pipes_pidfd_kill(pid_t pid, int pidfd, int sig);
+
+/* Wait for the process *pid using waitpid() with options. Returns 1 if it
+ * was reaped, in which case *pid is set to -1 and *pidfd is closed, 0 if it is
+ * still running (WNOHANG) and -1 on error. */
+int pipes_reap(pid_t *pid, int *pidfd, int *status, int options);
+
+/* Like pipes_reap(), but uses wait4() to also return the resource usage of
+ * the process in *rusage. */
+int pipes_reap_rusage(pid_t *pid, int *pidfd, int *status, int options, struct rusage *rusage);
+
+/* Run fn(infd, outfd, ctx) on a worker thread of the library. fn gets
+ * duplicates of infd and outfd, which are closed when it returns. Returns a
+ * done fd that becomes readable when fn returned or -1 on error. */
+int pipes_function_start(int (*fn)(int infd, int outfd, void* ctx), void* ctx, int infd, int outfd);
+
+/* Like pipes_reap() for the done fd of a function stage. *status is the
+ * return value of the function encoded like an exit status. */
+int pipes_function_reap(int *donefd, int *status, int options);
+
+/* CLOCK_MONOTONIC in nanoseconds, as stored in struct pipes started. */
+long long pipes_clock(void);
+
+/* Reap every exited process in procs. If processes are still running and
+ * timeout isn't 0 wait up to timeout milliseconds (-1 means forever) for one
+ * of them to exit using their pidfds (which are opened if needed) and reap
+ * again. Without pidfds it polls with waitpid() and a growing delay.
+ * Returns the number of processes still running or -1 on error. */
+int pipes_poll_procs(struct pipes_proc procs[], size_t count, int status[], int timeout);
+
+/* Tracing. The PIPES_TRACEPOINT_* macros call the callbacks set with
+ * pipes_trace_set(), which costs a test of a function pointer while none is
+ * set. Built with -DPIPES_USDT they are also USDT probes of the provider
+ * "pipes" for perf and bpftrace. */
+struct pipes_tracer {
+	struct pipes_trace_callbacks callbacks;
+	void *ctx;
+};
+
+extern struct pipes_tracer pipes_tracer;
+
+void pipes_trace_spawn(char const *const argv[]);
+void pipes_trace_exec(pid_t pid, int error);
+void pipes_trace_exit(pid_t pid, int status);
+void pipes_trace_io(int fd, int direction, size_t size);
+void pipes_trace_chain(struct pipes_chain const chain[], int event);
+
+#ifdef PIPES_USDT
+/* With semaphores every probe has a counter that perf and bpftrace increment
+ * while they are attached to it. They are defined in trace.c. */
+#	define _SDT_HAS_SEMAPHORES 1
+#	include <sys/sdt.h>
+#	define PIPES_USDT_SEMAPHORE(NAME) \
+		extern unsigned short pipes_##NAME##_semaphore __attribute__((unused)) __attribute__((section(".probes")))
+PIPES_USDT_SEMAPHORE(spawn);
+PIPES_USDT_SEMAPHORE(exec);
+PIPES_USDT_SEMAPHORE(exit);
+PIPES_USDT_SEMAPHORE(read);
+PIPES_USDT_SEMAPHORE(write);
+PIPES_USDT_SEMAPHORE(open_chain);
+PIPES_USDT_SEMAPHORE(chain_opened);
+PIPES_USDT_SEMAPHORE(close_chain);
+#	define PIPES_USDT_PROBE1(NAME, A)       DTRACE_PROBE1(pipes, NAME, A)
+#	define PIPES_USDT_PROBE2(NAME, A, B)    DTRACE_PROBE2(pipes, NAME, A, B)
+/* Only wait for the exec while it is observed, by a callback or a probe. */
+#	define PIPES_TRACING_EXEC \
+		(__atomic_load_n(&pipes_exec_semaphore, __ATOMIC_RELAXED) != 0 || pipes_tracer.callbacks.exec != NULL)
+#else
+#	define PIPES_USDT_PROBE1(NAME, A)       ((void)0)
+#	define PIPES_USDT_PROBE2(NAME, A, B)    ((void)0)
+#	define PIPES_TRACING_EXEC (pipes_tracer.callbacks.exec != NULL)
+#endif
+
+#define PIPES_TRACEPOINT_SPAWN(ARGV) do { \
+		PIPES_USDT_PROBE1(spawn, (ARGV)[0]); \
+		if (pipes_tracer.callbacks.spawn) pipes_trace_spawn(ARGV); \
+	} while (0)
+
+#define PIPES_TRACEPOINT_EXEC(PID, ERROR) do { \
+		PIPES_USDT_PROBE2(exec, (PID), (ERROR)); \
+		if (pipes_tracer.callbacks.exec) pipes_trace_exec((PID), (ERROR)); \
+	} while (0)
+
+#define PIPES_TRACEPOINT_EXIT(PID, STATUS) do { \
+		PIPES_USDT_PROBE2(exit, (PID), (STATUS)); \
+		if (pipes_tracer.callbacks.exit) pipes_trace_exit((PID), (STATUS)); \
+	} while (0)
+
+#define PIPES_TRACEPOINT_READ(FD, SIZE) do { \
+		PIPES_USDT_PROBE2(read, (FD), (SIZE)); \
+		if (pipes_tracer.callbacks.io) pipes_trace_io((FD), PIPES_TRACE_READ, (SIZE)); \
+	} while (0)
+
+#define PIPES_TRACEPOINT_WRITE(FD, SIZE) do { \
+		PIPES_USDT_PROBE2(write, (FD), (SIZE)); \
+		if (pipes_tracer.callbacks.io) pipes_trace_io((FD), PIPES_TRACE_WRITE, (SIZE)); \
+	} while (0)
+
+/* NAME is the probe name, e.g. open_chain. */
+#define PIPES_TRACEPOINT_CHAIN(NAME, EVENT, CHAIN) do { \
+		PIPES_USDT_PROBE1(NAME, (CHAIN)); \
+		if (pipes_tracer.callbacks.chain) pipes_trace_chain((CHAIN), (EVENT)); \
+	} while (0)
+
+/* Minimal io_uring wrapper used by the event loop. pipes_uring_new() returns
+ * NULL if io_uring is not available, so callers can fall back to epoll. The
+ * read, write and poll functions only queue a request, it is submitted by the
+ * next pipes_uring_submit() or pipes_uring_wait() call. data is returned in
+ * the completion event. */
+struct pipes_uring;
+
+struct pipes_uring_event {
+	void *data;
+	int   res;
+};
+
+struct pipes_uring* pipes_uring_new(unsigned entries);
+void pipes_uring_free(struct pipes_uring *ring);
+int pipes_uring_read(struct pipes_uring *ring, int fd, void *buf, size_t size, void *data);
+int pipes_uring_write(struct pipes_uring *ring, int fd, void const *buf, size_t size, void *data);
+int pipes_uring_poll(struct pipes_uring *ring, int fd, void *data);
+int pipes_uring_submit(struct pipes_uring *ring);
+
+/* Submit pending requests and wait up to timeout milliseconds for at least
+ * one completion. Returns the number of events stored in events. */
+int pipes_uring_wait(struct pipes_uring *ring, struct pipes_uring_event events[], size_t count, int timeout);
+
+#endif
@@ -0,0 +1,140 @@
+#define _POSIX_SOURCE
+#define _GNU_SOURCE
+
+#include "internal.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#ifdef __linux__
+#	include <sched.h>
+#	include <sys/syscall.h>
+#	ifndef SYS_clone3
+#		define SYS_clone3 435
+#	endif
+#	ifndef CLONE_INTO_CGROUP
+#		define CLONE_INTO_CGROUP 0x200000000ULL
+#	endif
+#	ifndef CLONE_PIDFD
+#		define CLONE_PIDFD 0x1000
+#	endif
+#	ifndef IOPRIO_WHO_PROCESS
+#		define IOPRIO_WHO_PROCESS 1
+#	endif
+
+// struct clone_args of linux/sched.h, which can't be included together
+// with sched.h
+struct pipes_clone_args {
+	uint64_t flags;
+	uint64_t pidfd;
+	uint64_t child_tid;
+	uint64_t parent_tid;
+	uint64_t exit_signal;
+	uint64_t stack;
+	uint64_t stack_size;
+	uint64_t tls;
+	uint64_t set_tid;
+	uint64_t set_tid_size;
+	uint64_t cgroup;
+};
+#endif
+
+int pipes_limits_check(struct pipes_limits const* limits) {
+	if ((limits->nrlimits > 0 && limits->rlimits == NULL) || limits->nrlimits > PIPES_MAX_RLIMITS ||
+	    (limits->cpus && (limits->cpus_size == 0 || limits->cpus_size > PIPES_MAX_CPUS_SIZE)) ||
+	    ((limits->flags & PIPES_LIMITS_CGROUP) && limits->cgroupfd < 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+#ifndef __linux__
+	if (limits->cpus || (limits->flags & (PIPES_LIMITS_IOPRIO | PIPES_LIMITS_CGROUP))) {
+		errno = ENOTSUP;
+		return -1;
+	}
+#endif
+
+	return 0;
+}
+
+int pipes_limits_apply(struct pipes_limits const* limits) {
+#ifdef __linux__
+	if (limits->cpus && sched_setaffinity(0, limits->cpus_size, (cpu_set_t const*)limits->cpus) == -1) {
+		return -1;
+	}
+
+	if ((limits->flags & PIPES_LIMITS_IOPRIO) &&
+	    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, limits->ioprio) == -1) {
+		return -1;
+	}
+#endif
+
+	if ((limits->flags & PIPES_LIMITS_NICE) && setpriority(PRIO_PROCESS, 0, limits->nice) == -1) {
+		return -1;
+	}
+
+	for (size_t index = 0; index < limits->nrlimits; ++ index) {
+		if (setrlimit(limits->rlimits[index].resource, &limits->rlimits[index].limit) == -1) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+pid_t pipes_clone(int flags, int cgroupfd, int *pidfd) {
+#ifdef __linux__
+	if (pidfd) {
+		*pidfd = -1;
+	}
+
+	if (cgroupfd > -1 || pidfd) {
+		// The process starts out in the cgroup, so it never runs (or
+		// allocates memory) outside of it. Moving it there after the fork
+		// would need a write to cgroup.procs by someone. The pidfd refers
+		// to the child from the start, unlike one opened from its pid
+		// later, when someone else might have reaped it already.
+		struct pipes_clone_args args;
+		int fd = -1;
+
+		memset(&args, 0, sizeof(args));
+		args.flags       = (uint64_t)flags | (cgroupfd > -1 ? CLONE_INTO_CGROUP : 0) | (pidfd ? CLONE_PIDFD : 0);
+		args.pidfd       = (uint64_t)(uintptr_t)&fd;
+		// with CLONE_PARENT the child inherits the exit signal of the
+		// calling process and clone3() rejects any other
+		args.exit_signal = flags & CLONE_PARENT ? 0 : SIGCHLD;
+		args.cgroup      = cgroupfd > -1 ? (uint64_t)cgroupfd : 0;
+
+		const pid_t pid = (pid_t)syscall(SYS_clone3, &args, sizeof(args));
+
+		if (pid > 0 && pidfd) {
+			*pidfd = fd;
+		}
+
+		// Without clone3() (before Linux 5.3 or blocked by seccomp) a pidfd
+		// is only nice to have, a cgroup is not.
+		if (pid != -1 || cgroupfd > -1 || (errno != ENOSYS && errno != EPERM)) {
+			return pid;
+		}
+	}
+
+	if (flags != 0) {
+		return (pid_t)syscall(SYS_clone, flags | SIGCHLD, 0, NULL, NULL, 0);
+	}
+#else
+	if (pidfd) {
+		*pidfd = -1;
+	}
+
+	if (flags != 0 || cgroupfd > -1) {
+		errno = ENOTSUP;
+		return -1;
+	}
+#endif
+
+	return fork();
+}
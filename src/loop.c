@@ -0,0 +1,682 @@
+#define _POSIX_SOURCE
+#define _GNU_SOURCE
+
+#include "loop.h"
+#include "internal.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+
+#define PIPES_LOOP_BUFSIZ (64 * 1024)
+#define PIPES_LOOP_EVENTS 64
+#define PIPES_LOOP_READS  4
+
+// With io_uring every output stream needs its own buffer for the read that
+// is in flight, so keep it smaller than the shared one used with epoll.
+#define PIPES_LOOP_URING_BUFSIZ  (16 * 1024)
+#define PIPES_LOOP_URING_ENTRIES 256
+
+// kinds of watches that are not one of the standard streams
+#define PIPES_WATCH_PROC     3
+#define PIPES_WATCH_FUNCTION 4
+
+struct pipes_watch {
+	struct pipes_task *task;
+	int    kind;
+	int    fd;
+	pid_t  pid;
+	size_t index;
+	char  *buf;
+};
+
+struct pipes_task {
+	struct pipes_loop *loop;
+	struct pipes_task *prev;
+	struct pipes_task *next;
+	pthread_mutex_t lock;
+	struct pipes_loop_callbacks callbacks;
+	void  *ctx;
+	char const *input;
+	size_t insize;
+	size_t written;
+	size_t active;
+	int    error;
+	size_t count;
+	struct pipes_watch streams[3];
+	struct pipes_watch procs[];
+};
+
+struct pipes_loop {
+	int epfd;
+	int count;
+	pthread_mutex_t lock;
+	struct pipes_task *tasks;
+	struct pipes_uring *uring;
+};
+
+struct pipes_loop* pipes_loop_new(void) {
+	return pipes_loop_new_backend(PIPES_LOOP_DEFAULT);
+}
+
+struct pipes_loop* pipes_loop_new_backend(int backend) {
+	if (backend != PIPES_LOOP_DEFAULT && backend != PIPES_LOOP_EPOLL && backend != PIPES_LOOP_URING) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	struct pipes_loop *loop = calloc(1, sizeof(struct pipes_loop));
+
+	if (loop == NULL) {
+		return NULL;
+	}
+
+	loop->epfd = -1;
+
+	if (backend != PIPES_LOOP_EPOLL) {
+		loop->uring = pipes_uring_new(PIPES_LOOP_URING_ENTRIES);
+
+		if (loop->uring == NULL && backend == PIPES_LOOP_URING) {
+			int errnum = errno;
+			free(loop);
+			errno = errnum;
+			return NULL;
+		}
+	}
+
+	if (loop->uring == NULL) {
+		loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+		if (loop->epfd == -1) {
+			free(loop);
+			return NULL;
+		}
+	}
+
+	int errnum = pthread_mutex_init(&loop->lock, NULL);
+	if (errnum != 0) {
+		pipes_uring_free(loop->uring);
+		if (loop->epfd > -1) {
+			close(loop->epfd);
+		}
+		free(loop);
+		errno = errnum;
+		return NULL;
+	}
+
+	return loop;
+}
+
+int pipes_loop_backend(struct pipes_loop* loop) {
+	return loop->uring ? PIPES_LOOP_URING : PIPES_LOOP_EPOLL;
+}
+
+static void pipes_task_free(struct pipes_task *task) {
+	for (int index = 0; index < 3; ++ index) {
+		if (task->streams[index].fd > -1) {
+			close(task->streams[index].fd);
+		}
+		free(task->streams[index].buf);
+	}
+
+	for (size_t index = 0; index < task->count; ++ index) {
+		if (task->procs[index].fd > -1) {
+			close(task->procs[index].fd);
+		}
+	}
+
+	pthread_mutex_destroy(&task->lock);
+	free(task);
+}
+
+void pipes_loop_free(struct pipes_loop* loop) {
+	if (loop == NULL) {
+		return;
+	}
+
+	// Closing the ring first cancels all requests that are still in flight
+	// and might refer to the buffers of the tasks.
+	pipes_uring_free(loop->uring);
+
+	struct pipes_task *task = loop->tasks;
+	while (task) {
+		struct pipes_task *next = task->next;
+		pipes_task_free(task);
+		task = next;
+	}
+
+	if (loop->epfd > -1) {
+		close(loop->epfd);
+	}
+	pthread_mutex_destroy(&loop->lock);
+	free(loop);
+}
+
+int pipes_loop_count(struct pipes_loop* loop) {
+	pthread_mutex_lock(&loop->lock);
+	int count = loop->count;
+	pthread_mutex_unlock(&loop->lock);
+
+	return count;
+}
+
+static int pipes_watch_ctl(struct pipes_watch *watch, int op, uint32_t events) {
+	struct epoll_event event = {
+		.events   = events | EPOLLONESHOT,
+		.data.ptr = watch
+	};
+
+	return epoll_ctl(watch->task->loop->epfd, op, watch->fd, &event);
+}
+
+// (Re-)arm watch, op is only used with epoll. With io_uring this queues the
+// read, write or poll request that matches the kind of the watch.
+static int pipes_watch_arm(struct pipes_watch *watch, int op) {
+	struct pipes_task *task = watch->task;
+	struct pipes_uring *uring = task->loop->uring;
+
+	if (uring == NULL) {
+		return pipes_watch_ctl(watch, op, watch->kind == PIPES_STDIN ? EPOLLOUT : EPOLLIN);
+	}
+
+	switch (watch->kind) {
+		case PIPES_STDIN:
+			return pipes_uring_write(uring, watch->fd, task->input + task->written,
+				task->insize - task->written, watch);
+
+		case PIPES_STDOUT:
+		case PIPES_STDERR:
+			return pipes_uring_read(uring, watch->fd, watch->buf, PIPES_LOOP_URING_BUFSIZ, watch);
+
+		default:
+			return pipes_uring_poll(uring, watch->fd, watch);
+	}
+}
+
+static void pipes_task_error(struct pipes_task *task, int errnum) {
+	if (task->error == 0) {
+		task->error = errnum;
+	}
+}
+
+static void pipes_watch_close(struct pipes_watch *watch) {
+	if (watch->task->loop->uring == NULL) {
+		epoll_ctl(watch->task->loop->epfd, EPOLL_CTL_DEL, watch->fd, NULL);
+	}
+	close(watch->fd);
+	watch->fd = -1;
+	-- watch->task->active;
+}
+
+static void pipes_task_write(struct pipes_watch *watch) {
+	struct pipes_task *task = watch->task;
+
+	while (task->written < task->insize) {
+		ssize_t size = write(watch->fd, task->input + task->written, task->insize - task->written);
+
+		if (size == -1) {
+			if (errno == EINTR) continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (pipes_watch_arm(watch, EPOLL_CTL_MOD) == 0) {
+					return;
+				}
+			}
+
+			// EPIPE just means the process doesn't want any more input
+			if (errno != EPIPE) {
+				pipes_task_error(task, errno);
+			}
+			break;
+		}
+
+		task->written += (size_t)size;
+		PIPES_TRACEPOINT_WRITE(watch->fd, (size_t)size);
+	}
+
+	pipes_watch_close(watch);
+}
+
+static void pipes_task_read(struct pipes_watch *watch) {
+	struct pipes_task *task = watch->task;
+	char buf[PIPES_LOOP_BUFSIZ];
+
+	for (int reads = 0; reads < PIPES_LOOP_READS; ++ reads) {
+		ssize_t size = read(watch->fd, buf, sizeof(buf));
+
+		if (size == -1) {
+			if (errno == EINTR) continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+
+			pipes_task_error(task, errno);
+			pipes_watch_close(watch);
+			return;
+		}
+
+		if (size > 0) {
+			PIPES_TRACEPOINT_READ(watch->fd, (size_t)size);
+		}
+
+		if (task->callbacks.data) {
+			task->callbacks.data(task, watch->kind, buf, (size_t)size, task->ctx);
+		}
+
+		if (size == 0) {
+			pipes_watch_close(watch);
+			return;
+		}
+	}
+
+	if (pipes_watch_arm(watch, EPOLL_CTL_MOD) != 0) {
+		pipes_task_error(task, errno);
+		pipes_watch_close(watch);
+	}
+}
+
+// io_uring completion of a write to stdin
+static void pipes_task_write_done(struct pipes_watch *watch, int res) {
+	struct pipes_task *task = watch->task;
+
+	if (res > 0) {
+		task->written += (size_t)res;
+		PIPES_TRACEPOINT_WRITE(watch->fd, (size_t)res);
+	}
+	else if (res < 0 && res != -EINTR && res != -EAGAIN) {
+		// EPIPE just means the process doesn't want any more input
+		if (res != -EPIPE) {
+			pipes_task_error(task, -res);
+		}
+		pipes_watch_close(watch);
+		return;
+	}
+
+	if (task->written < task->insize) {
+		if (pipes_watch_arm(watch, EPOLL_CTL_MOD) == 0) {
+			return;
+		}
+		pipes_task_error(task, errno);
+	}
+
+	pipes_watch_close(watch);
+}
+
+// io_uring completion of a read from stdout or stderr
+static void pipes_task_read_done(struct pipes_watch *watch, int res) {
+	struct pipes_task *task = watch->task;
+
+	if (res < 0 && res != -EINTR && res != -EAGAIN) {
+		pipes_task_error(task, -res);
+		pipes_watch_close(watch);
+		return;
+	}
+
+	if (res >= 0) {
+		if (res > 0) {
+			PIPES_TRACEPOINT_READ(watch->fd, (size_t)res);
+		}
+
+		if (task->callbacks.data) {
+			task->callbacks.data(task, watch->kind, watch->buf, (size_t)res, task->ctx);
+		}
+
+		if (res == 0) {
+			pipes_watch_close(watch);
+			return;
+		}
+	}
+
+	if (pipes_watch_arm(watch, EPOLL_CTL_MOD) != 0) {
+		pipes_task_error(task, errno);
+		pipes_watch_close(watch);
+	}
+}
+
+// pipes_reap() for the process or function stage of watch
+static int pipes_watch_reap(struct pipes_watch *watch, int *status, int options) {
+	if (watch->kind == PIPES_WATCH_FUNCTION) {
+		return pipes_function_reap(&watch->fd, status, options);
+	}
+
+	return pipes_reap(&watch->pid, &watch->fd, status, options);
+}
+
+static void pipes_task_reap(struct pipes_watch *watch, int res) {
+	struct pipes_task *task = watch->task;
+	int status = 0;
+
+	if (task->loop->uring == NULL) {
+		epoll_ctl(task->loop->epfd, EPOLL_CTL_DEL, watch->fd, NULL);
+	}
+
+	int result = pipes_watch_reap(watch, &status, WNOHANG);
+
+	if (result == 0) {
+		// spurious wakeup (or a failed poll request, see below)
+		if (res >= 0 || res == -EINTR) {
+			if (pipes_watch_arm(watch, EPOLL_CTL_ADD) == 0) {
+				return;
+			}
+			res = -errno;
+		}
+
+		// can't wait for the process asynchronously anymore
+		pipes_task_error(task, -res);
+		result = pipes_watch_reap(watch, &status, 0);
+	}
+
+	if (result == -1) {
+		pipes_task_error(task, errno);
+	}
+	else if (task->callbacks.exit) {
+		task->callbacks.exit(task, watch->index, status, task->ctx);
+	}
+
+	-- task->active;
+}
+
+static void pipes_task_finish(struct pipes_task *task) {
+	struct pipes_loop *loop = task->loop;
+
+	pthread_mutex_lock(&loop->lock);
+	if (task->prev) {
+		task->prev->next = task->next;
+	}
+	else {
+		loop->tasks = task->next;
+	}
+
+	if (task->next) {
+		task->next->prev = task->prev;
+	}
+	-- loop->count;
+	pthread_mutex_unlock(&loop->lock);
+
+	if (task->callbacks.done) {
+		task->callbacks.done(task, task->error, task->ctx);
+	}
+
+	pipes_task_free(task);
+}
+
+// res is the result of the io_uring request, with epoll it is unused.
+static void pipes_watch_handle(struct pipes_watch *watch, int res) {
+	struct pipes_task *task = watch->task;
+	const int uring = task->loop->uring != NULL;
+
+	pthread_mutex_lock(&task->lock);
+
+	switch (watch->kind) {
+		case PIPES_STDIN:
+			if (uring) {
+				pipes_task_write_done(watch, res);
+			}
+			else {
+				pipes_task_write(watch);
+			}
+			break;
+
+		case PIPES_STDOUT:
+		case PIPES_STDERR:
+			if (uring) {
+				pipes_task_read_done(watch, res);
+			}
+			else {
+				pipes_task_read(watch);
+			}
+			break;
+
+		case PIPES_WATCH_PROC:
+		case PIPES_WATCH_FUNCTION:
+			pipes_task_reap(watch, uring ? res : 0);
+			break;
+	}
+
+	const int finished = task->active == 0;
+
+	pthread_mutex_unlock(&task->lock);
+
+	// Once no watch is active no other thread can refer to this task.
+	if (finished) {
+		pipes_task_finish(task);
+	}
+}
+
+static int pipes_loop_run_uring(struct pipes_loop* loop, int timeout) {
+	struct pipes_uring_event events[PIPES_LOOP_EVENTS];
+
+	// Requests queued by the handlers are submitted together with the next
+	// wait, so a busy loop needs only one system call per batch.
+	int count = pipes_uring_wait(loop->uring, events, PIPES_LOOP_EVENTS, timeout);
+
+	if (count == -1) {
+		return -1;
+	}
+
+	for (int index = 0; index < count; ++ index) {
+		pipes_watch_handle(events[index].data, events[index].res);
+	}
+
+	return pipes_loop_count(loop);
+}
+
+int pipes_loop_run(struct pipes_loop* loop, int timeout) {
+	if (loop->uring) {
+		return pipes_loop_run_uring(loop, timeout);
+	}
+
+	struct epoll_event events[PIPES_LOOP_EVENTS];
+
+	int count = epoll_wait(loop->epfd, events, PIPES_LOOP_EVENTS, timeout);
+
+	if (count == -1) {
+		if (errno != EINTR) {
+			return -1;
+		}
+		count = 0;
+	}
+
+	for (int index = 0; index < count; ++ index) {
+		pipes_watch_handle(events[index].data.ptr, 0);
+	}
+
+	return pipes_loop_count(loop);
+}
+
+int pipes_loop_add(struct pipes_loop* loop, struct pipes_chain chain[],
+                   void const* input, size_t size,
+                   struct pipes_loop_callbacks const* callbacks, void* ctx) {
+	size_t count = 0;
+	while (chain[count].argv) ++ count;
+
+	if (count == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct pipes_task *task = calloc(1, sizeof(struct pipes_task) + count * sizeof(struct pipes_watch));
+
+	if (task == NULL) {
+		return -1;
+	}
+
+	int errnum = pthread_mutex_init(&task->lock, NULL);
+	if (errnum != 0) {
+		free(task);
+		errno = errnum;
+		return -1;
+	}
+
+	struct pipes* first = &chain[0].pipes;
+	struct pipes* last  = &chain[count - 1].pipes;
+
+	task->loop   = loop;
+	task->ctx    = ctx;
+	task->input  = input;
+	task->insize = input ? size : 0;
+	task->count  = count;
+
+	if (callbacks) {
+		task->callbacks = *callbacks;
+	}
+
+	const int fds[] = {first->infd, last->outfd, last->errfd};
+	for (int index = 0; index < 3; ++ index) {
+		task->streams[index].task = task;
+		task->streams[index].kind = index;
+		task->streams[index].fd   = fds[index];
+		task->streams[index].pid  = -1;
+	}
+
+	for (size_t index = 0; index < count; ++ index) {
+		struct pipes_watch *watch = &task->procs[index];
+
+		watch->task  = task;
+		watch->kind  = chain[index].fn ? PIPES_WATCH_FUNCTION : PIPES_WATCH_PROC;
+		watch->index = index;
+		watch->pid   = chain[index].pipes.pid;
+		watch->fd    = chain[index].pipes.pidfd;
+
+		if (watch->pid > -1 && watch->fd < 0) {
+			watch->fd = pipes_pidfd_open(watch->pid);
+
+			if (watch->fd < 0) {
+				errnum = errno;
+				for (size_t other = 0; other < index; ++ other) {
+					if (task->procs[other].fd != chain[other].pipes.pidfd) {
+						close(task->procs[other].fd);
+					}
+				}
+				pthread_mutex_destroy(&task->lock);
+				free(task);
+				errno = errnum;
+				return -1;
+			}
+		}
+	}
+
+	// From here on the task owns the file descriptors and processes.
+	first->infd  = -1;
+	last->outfd  = -1;
+	last->errfd  = -1;
+
+	for (size_t index = 0; index < count; ++ index) {
+		chain[index].pipes.pid   = -1;
+		chain[index].pipes.pidfd = -1;
+	}
+
+	pthread_mutex_lock(&task->lock);
+
+	pthread_mutex_lock(&loop->lock);
+	task->next = loop->tasks;
+	if (loop->tasks) {
+		loop->tasks->prev = task;
+	}
+	loop->tasks = task;
+	++ loop->count;
+	pthread_mutex_unlock(&loop->lock);
+
+	if (task->streams[PIPES_STDIN].fd > -1 && task->insize == 0) {
+		close(task->streams[PIPES_STDIN].fd);
+		task->streams[PIPES_STDIN].fd = -1;
+	}
+
+	// Events may arrive on other threads right after registering, but they
+	// block on the task lock until the task is complete.
+	for (int index = 0; index < 3; ++ index) {
+		struct pipes_watch *watch = &task->streams[index];
+
+		if (watch->fd < 0) continue;
+
+		// File descriptors are only made non-blocking for epoll. io_uring
+		// would just complete requests with EAGAIN instead of waiting.
+		int status;
+		if (loop->uring) {
+			if (index != PIPES_STDIN) {
+				watch->buf = malloc(PIPES_LOOP_URING_BUFSIZ);
+			}
+			status = index != PIPES_STDIN && watch->buf == NULL ? -1 :
+			         pipes_watch_arm(watch, EPOLL_CTL_ADD);
+		}
+		else {
+			const int flags = fcntl(watch->fd, F_GETFL);
+			status = flags == -1 || fcntl(watch->fd, F_SETFL, flags | O_NONBLOCK) == -1 ? -1 :
+			         pipes_watch_arm(watch, EPOLL_CTL_ADD);
+		}
+
+		if (status == -1) {
+			pipes_task_error(task, errno);
+			close(watch->fd);
+			watch->fd = -1;
+			continue;
+		}
+
+		++ task->active;
+	}
+
+	for (size_t index = 0; index < count; ++ index) {
+		struct pipes_watch *watch = &task->procs[index];
+
+		if (watch->kind == PIPES_WATCH_FUNCTION ? watch->fd < 0 : watch->pid < 0) continue;
+
+		if (pipes_watch_arm(watch, EPOLL_CTL_ADD) == -1) {
+			// can't supervise this process, so at least don't leak it
+			pipes_task_error(task, errno);
+			if (watch->pid > -1) {
+				pipes_pidfd_kill(watch->pid, watch->fd, SIGKILL);
+			}
+			pipes_watch_reap(watch, NULL, 0);
+			continue;
+		}
+
+		++ task->active;
+	}
+
+	const int finished = task->active == 0;
+	errnum = task->error;
+
+	if (loop->uring && !finished) {
+		// If this fails the requests are still submitted by the next
+		// pipes_loop_run() call.
+		pipes_uring_submit(loop->uring);
+	}
+
+	pthread_mutex_unlock(&task->lock);
+
+	if (finished) {
+		if (errnum != 0) {
+			// nothing could be registered
+			task->callbacks.done = NULL;
+		}
+
+		pipes_task_finish(task);
+
+		if (errnum != 0) {
+			errno = errnum;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int pipes_task_kill(struct pipes_task* task, int sig) {
+	int status = 0;
+
+	for (size_t index = 0; index < task->count; ++ index) {
+		if (task->procs[index].pid > -1) {
+			if (pipes_pidfd_kill(task->procs[index].pid, task->procs[index].fd, sig) != 0) {
+				status = -1;
+			}
+		}
+	}
+
+	return status;
+}
@@ -0,0 +1,56 @@
+#ifndef PIPES_LOOP_H
+#define PIPES_LOOP_H
+#pragma once
+
+#include <sys/types.h>
+
+#include "export.h"
+#include "pipes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PIPES_STDIN  0
+#define PIPES_STDOUT 1
+#define PIPES_STDERR 2
+
+#define PIPES_LOOP_DEFAULT 0
+#define PIPES_LOOP_EPOLL   1
+#define PIPES_LOOP_URING   2
+
+struct pipes_loop;
+struct pipes_task;
+
+struct pipes_loop_callbacks {
+	/* Data read from PIPES_STDOUT or PIPES_STDERR of the last process.
+	 * size is 0 on end of file. May be NULL. */
+	void (*data)(struct pipes_task* task, int stream, char const* data, size_t size, void* ctx);
+
+	/* The process at index in the chain exited. May be NULL. */
+	void (*exit)(struct pipes_task* task, size_t index, int status, void* ctx);
+
+	/* All streams are closed and all processes are reaped. error is 0 or
+	 * the errno of the first error. The task is freed after this returns.
+	 * May be NULL. */
+	void (*done)(struct pipes_task* task, int error, void* ctx);
+};
+
+PIPES_EXPORT struct pipes_loop* pipes_loop_new(void);
+PIPES_EXPORT struct pipes_loop* pipes_loop_new_backend(int backend);
+PIPES_EXPORT int pipes_loop_backend(struct pipes_loop* loop);
+PIPES_EXPORT void pipes_loop_free(struct pipes_loop* loop);
+
+PIPES_EXPORT int pipes_loop_add(struct pipes_loop* loop, struct pipes_chain chain[],
+                                void const* input, size_t size,
+                                struct pipes_loop_callbacks const* callbacks, void* ctx);
+PIPES_EXPORT int pipes_loop_run(struct pipes_loop* loop, int timeout);
+PIPES_EXPORT int pipes_loop_count(struct pipes_loop* loop);
+
+PIPES_EXPORT int pipes_task_kill(struct pipes_task* task, int sig);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
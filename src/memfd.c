@@ -0,0 +1,138 @@
+#define _POSIX_SOURCE
+#define _GNU_SOURCE
+
+#include "pipes.h"
+#include "internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifndef P_tmpdir
+#	define P_tmpdir "/tmp"
+#endif
+
+static int pipes_temp_fd_fallback(void) {
+	char name[] = P_tmpdir "/pipesXXXXXX";
+	const int fd = mkstemp(name);
+
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (unlink(name) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+#if defined(O_TMPFILE) || defined(__linux__)
+#	ifndef O_TMPFILE
+#		define O_TMPFILE (020000000 | O_DIRECTORY)
+#	endif
+int pipes_temp_fd(void) {
+	int fd = open(P_tmpdir, O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR);
+	if (fd < 0 && (
+		errno == EOPNOTSUPP || // no filesystem support for O_TMPFILE
+		errno == EISDIR     || // no kernel support for O_TMPFILE
+		errno == ENOENT)) {    // no kernel support for O_TMPFILE and path does not exist
+		return pipes_temp_fd_fallback();
+	}
+	return fd;
+}
+#else
+int pipes_temp_fd(void) {
+	return pipes_temp_fd_fallback();
+}
+#endif
+
+#ifndef MFD_NOEXEC_SEAL
+#	define MFD_NOEXEC_SEAL 0x0008U
+#endif
+
+int pipes_memfd(void) {
+#ifdef MFD_ALLOW_SEALING
+	int fd = memfd_create("pipes", MFD_CLOEXEC | MFD_ALLOW_SEALING | MFD_NOEXEC_SEAL);
+
+	if (fd < 0 && errno == EINVAL) {
+		// kernel older than 6.3 doesn't know MFD_NOEXEC_SEAL
+		fd = memfd_create("pipes", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	}
+
+	if (fd < 0 && errno == ENOSYS) {
+		return pipes_temp_fd();
+	}
+
+	return fd;
+#else
+	return pipes_temp_fd();
+#endif
+}
+
+int pipes_map(int fd, struct pipes_view* view) {
+	view->data = NULL;
+	view->size = 0;
+
+#ifdef F_ADD_SEALS
+	// Freeze the contents so the mapping can't change or shrink under the
+	// caller (e.g. because of a grandchild that still holds the file). Files
+	// that aren't memfds don't support sealing, and an already sealed memfd
+	// fails with EPERM. Both are fine.
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE) == -1 &&
+		errno != EINVAL && errno != EPERM) {
+		return -1;
+	}
+#endif
+
+	struct stat meta;
+	if (fstat(fd, &meta) == -1) {
+		return -1;
+	}
+
+	if (!S_ISREG(meta.st_mode)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((uintmax_t)meta.st_size > SIZE_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	// mmap() doesn't support empty mappings
+	if (meta.st_size == 0) {
+		return 0;
+	}
+
+	void *data = mmap(NULL, (size_t)meta.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (data == MAP_FAILED) {
+		return -1;
+	}
+
+	view->data = data;
+	view->size = (size_t)meta.st_size;
+
+	return 0;
+}
+
+int pipes_unmap(struct pipes_view* view) {
+	int status = 0;
+
+	if (view->data != NULL && munmap((void*)view->data, view->size) == -1) {
+		status = -1;
+	}
+
+	view->data = NULL;
+	view->size = 0;
+
+	return status;
+}
@@ -0,0 +1,298 @@
+#define _POSIX_SOURCE
+#define _GNU_SOURCE
+
+#include "pipes.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+struct pipes_monitor {
+	pthread_t thread;
+	int    stopfd[2];
+	int    interval;
+	size_t count;
+	pid_t *pids;
+	unsigned long long *starttimes;
+	struct pipes_sample *samples;
+	void (*callback)(struct pipes_sample const samples[], size_t count, void* ctx);
+	void  *ctx;
+};
+
+#ifdef __linux__
+static int pipes_read_proc(pid_t pid, char const* name, char* buf, size_t size) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/%s", (int)pid, name);
+
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd == -1) {
+		return -1;
+	}
+
+	ssize_t count;
+	do {
+		count = read(fd, buf, size - 1);
+	} while (count == -1 && errno == EINTR);
+
+	close(fd);
+
+	if (count < 0) {
+		return -1;
+	}
+
+	buf[count] = 0;
+
+	return 0;
+}
+
+// How much is queued in the pipe at stdin of pid. The pipe is opened again
+// through /proc only for as long as it takes to ask, so the process still
+// sees end of file or EPIPE as usual.
+static void pipes_sample_pipe(pid_t pid, struct pipes_sample* sample) {
+	char path[64];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "/proc/%d/fd/0", (int)pid);
+
+	if (stat(path, &st) == -1 || !S_ISFIFO(st.st_mode)) {
+		return;
+	}
+
+	const int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+	if (fd == -1) {
+		return;
+	}
+
+	int fill = 0;
+	if (ioctl(fd, FIONREAD, &fill) == 0) {
+		sample->fill = fill;
+	}
+
+#ifdef F_GETPIPE_SZ
+	sample->capacity = fcntl(fd, F_GETPIPE_SZ);
+#endif
+
+	close(fd);
+}
+#endif
+
+// Sample one process. *starttime is the start time of the process seen the
+// first time (or 0), so a reused process ID isn't mistaken for the stage.
+static void pipes_sample_stage(pid_t pid, unsigned long long* starttime, struct pipes_sample* sample) {
+	sample->pid      = pid;
+	sample->state    = 0;
+	sample->blocked  = PIPES_BLOCKED_NONE;
+	sample->cpu      = 0;
+	sample->fill     = -1;
+	sample->capacity = -1;
+
+#ifdef __linux__
+	char buf[1024];
+
+	if (pid < 0 || pipes_read_proc(pid, "stat", buf, sizeof(buf)) == -1) {
+		return;
+	}
+
+	// the command name may contain anything, so start after its last ')'
+	char *ptr = strrchr(buf, ')');
+
+	if (ptr == NULL || ptr[1] != ' ' || ptr[2] == 0) {
+		return;
+	}
+
+	const char state = ptr[2];
+	unsigned long long utime = 0;
+	unsigned long long stime = 0;
+	unsigned long long start = 0;
+
+	ptr += 3;
+	for (int field = 4; field <= 22; ++ field) {
+		char *end = NULL;
+		const unsigned long long value = strtoull(ptr, &end, 10);
+
+		if (end == ptr) {
+			return;
+		}
+		ptr = end;
+
+		if      (field == 14) utime = value;
+		else if (field == 15) stime = value;
+		else if (field == 22) start = value;
+	}
+
+	if (*starttime != 0 && *starttime != start) {
+		return;
+	}
+	*starttime = start;
+
+	sample->state = state;
+	sample->cpu   = utime + stime;
+
+	if (state == 'S' && pipes_read_proc(pid, "wchan", buf, sizeof(buf)) == 0) {
+		// pipe_read/pipe_write, anon_pipe_read/anon_pipe_write on newer
+		// kernels and pipe_wait_readable/pipe_wait_writable for splice()
+		if (strstr(buf, "pipe_read") || strstr(buf, "pipe_wait_readable")) {
+			sample->blocked = PIPES_BLOCKED_READ;
+		}
+		else if (strstr(buf, "pipe_write") || strstr(buf, "pipe_wait_writable")) {
+			sample->blocked = PIPES_BLOCKED_WRITE;
+		}
+	}
+
+	pipes_sample_pipe(pid, sample);
+#else
+	(void)starttime;
+#endif
+}
+
+int pipes_sample_chain(struct pipes_chain const chain[], struct pipes_sample samples[]) {
+	if (chain == NULL || chain[0].argv == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (size_t index = 0; chain[index].argv; ++ index) {
+		unsigned long long starttime = 0;
+		pipes_sample_stage(chain[index].pipes.pid, &starttime, &samples[index]);
+	}
+
+	return 0;
+}
+
+static void *pipes_monitor_run(void *ptr) {
+	struct pipes_monitor *monitor = ptr;
+	struct pollfd stop = { monitor->stopfd[0], POLLIN, 0 };
+
+	for (;;) {
+		for (size_t index = 0; index < monitor->count; ++ index) {
+			pipes_sample_stage(monitor->pids[index], &monitor->starttimes[index], &monitor->samples[index]);
+		}
+
+		monitor->callback(monitor->samples, monitor->count, monitor->ctx);
+
+		int ready;
+		do {
+			ready = poll(&stop, 1, monitor->interval);
+		} while (ready == -1 && errno == EINTR);
+
+		if (ready != 0) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static void pipes_monitor_free(struct pipes_monitor* monitor) {
+	if (monitor->stopfd[0] > -1) close(monitor->stopfd[0]);
+	if (monitor->stopfd[1] > -1) close(monitor->stopfd[1]);
+
+	free(monitor->pids);
+	free(monitor->starttimes);
+	free(monitor->samples);
+	free(monitor);
+}
+
+struct pipes_monitor* pipes_monitor_start(struct pipes_chain const chain[], int interval,
+                                          void (*callback)(struct pipes_sample const samples[], size_t count, void* ctx),
+                                          void* ctx) {
+	if (chain == NULL || chain[0].argv == NULL || interval <= 0 || callback == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	size_t count = 0;
+	while (chain[count].argv) ++ count;
+
+	struct pipes_monitor *monitor = calloc(1, sizeof(struct pipes_monitor));
+
+	if (monitor == NULL) {
+		return NULL;
+	}
+
+	monitor->stopfd[0] = monitor->stopfd[1] = -1;
+	monitor->interval  = interval;
+	monitor->count     = count;
+	monitor->callback  = callback;
+	monitor->ctx       = ctx;
+
+	monitor->pids       = calloc(count, sizeof(pid_t));
+	monitor->starttimes = calloc(count, sizeof(unsigned long long));
+	monitor->samples    = calloc(count, sizeof(struct pipes_sample));
+
+	int errnum = 0;
+
+	if (monitor->pids == NULL || monitor->starttimes == NULL || monitor->samples == NULL ||
+	    pipe2(monitor->stopfd, O_CLOEXEC) == -1) {
+		errnum = errno;
+		pipes_monitor_free(monitor);
+		errno = errnum;
+		return NULL;
+	}
+
+	// The process IDs are copied, so the monitor doesn't race with the
+	// wait functions resetting them.
+	for (size_t index = 0; index < count; ++ index) {
+		monitor->pids[index] = chain[index].pipes.pid;
+	}
+
+	// signals are for the threads of the application, not for the monitor
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	errnum = pthread_create(&monitor->thread, NULL, pipes_monitor_run, monitor);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (errnum != 0) {
+		pipes_monitor_free(monitor);
+		errno = errnum;
+		return NULL;
+	}
+
+	return monitor;
+}
+
+int pipes_monitor_stop(struct pipes_monitor* monitor) {
+	if (monitor == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	int status = 0;
+	int errnum = 0;
+	ssize_t written;
+
+	do {
+		written = write(monitor->stopfd[1], "", 1);
+	} while (written == -1 && errno == EINTR);
+
+	if (written == -1) {
+		// without the wakeup the thread would never end
+		return -1;
+	}
+
+	errnum = pthread_join(monitor->thread, NULL);
+	if (errnum != 0) {
+		status = -1;
+	}
+
+	pipes_monitor_free(monitor);
+
+	if (status == -1) {
+		errno = errnum;
+	}
+
+	return status;
+}
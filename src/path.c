@@ -0,0 +1,229 @@
+#define _POSIX_SOURCE
+#define _GNU_SOURCE
+
+#include "internal.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// execvp() uses the same default if PATH is not set
+#define PIPES_DEFAULT_PATH "/bin:/usr/bin"
+
+#define PIPES_PATH_CACHE_SIZE 64
+
+struct pipes_path_entry {
+	char *name;  // NULL if the entry is unused
+	char *search;
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	struct timespec ctime;
+};
+
+static struct pipes_path_entry pipes_path_cache[PIPES_PATH_CACHE_SIZE];
+static pthread_mutex_t pipes_path_lock = PTHREAD_MUTEX_INITIALIZER;
+
+char const* pipes_search_path(char const *const envp[]) {
+	if (envp == NULL) {
+		char const* path = getenv("PATH");
+		return path ? path : PIPES_DEFAULT_PATH;
+	}
+
+	for (char const *const* var = envp; *var; ++ var) {
+		if (strncmp(*var, "PATH=", 5) == 0) {
+			return *var + 5;
+		}
+	}
+
+	return PIPES_DEFAULT_PATH;
+}
+
+static int pipes_is_executable(char const* path, struct stat* meta) {
+	if (stat(path, meta) == -1) {
+		return 0;
+	}
+
+	if (!S_ISREG(meta->st_mode)) {
+		// what execve() reports for directories and the like
+		errno = EACCES;
+		return 0;
+	}
+
+	return access(path, X_OK) == 0;
+}
+
+static int pipes_search_executable(char const* name, char const* search, char* path, size_t size,
+                                   struct stat* meta) {
+	const size_t namelen = strlen(name);
+
+	if (namelen == 0) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	// like execvp(): names with a slash aren't searched
+	if (strchr(name, '/')) {
+		if (namelen >= size) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memcpy(path, name, namelen + 1);
+		return 0;
+	}
+
+	int errnum = ENOENT;
+	char const* dir = search;
+
+	for (;;) {
+		char const* end = strchr(dir, ':');
+		size_t dirlen = end ? (size_t)(end - dir) : strlen(dir);
+
+		// an empty entry means the current directory
+		if (dirlen == 0) {
+			dir    = ".";
+			dirlen = 1;
+		}
+
+		if (dirlen + 1 + namelen < size) {
+			memcpy(path, dir, dirlen);
+			path[dirlen] = '/';
+			memcpy(path + dirlen + 1, name, namelen + 1);
+
+			if (pipes_is_executable(path, meta)) {
+				return 0;
+			}
+
+			if (errno == EACCES) {
+				errnum = EACCES;
+			}
+		}
+		else {
+			errnum = ENAMETOOLONG;
+		}
+
+		if (end == NULL) {
+			break;
+		}
+		dir = end + 1;
+	}
+
+	errno = errnum;
+	return -1;
+}
+
+int pipes_find_executable(char const* name, char const* search, char* path, size_t size) {
+	struct stat meta;
+	return pipes_search_executable(name, search, path, size, &meta);
+}
+
+static void pipes_path_entry_clear(struct pipes_path_entry* entry) {
+	free(entry->name);
+	free(entry->search);
+	free(entry->path);
+
+	entry->name   = NULL;
+	entry->search = NULL;
+	entry->path   = NULL;
+}
+
+static int pipes_path_entry_matches(struct pipes_path_entry const* entry, struct stat const* meta) {
+	// The ctime also changes when the file is written to or its permissions
+	// change, so it is checked instead of the mtime.
+	return entry->dev == meta->st_dev && entry->ino == meta->st_ino &&
+	       entry->ctime.tv_sec  == meta->st_ctim.tv_sec &&
+	       entry->ctime.tv_nsec == meta->st_ctim.tv_nsec;
+}
+
+static struct pipes_path_entry* pipes_path_slot(char const* name, char const* search) {
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+
+	for (char const* ptr = name; *ptr; ++ ptr) {
+		hash = (hash ^ (unsigned char)*ptr) * 16777619u;
+	}
+
+	hash = (hash ^ ':') * 16777619u;
+
+	for (char const* ptr = search; *ptr; ++ ptr) {
+		hash = (hash ^ (unsigned char)*ptr) * 16777619u;
+	}
+
+	return &pipes_path_cache[hash % PIPES_PATH_CACHE_SIZE];
+}
+
+int pipes_resolve_executable(char const* name, char const *const envp[], char* path, size_t size) {
+	if (strchr(name, '/')) {
+		return pipes_find_executable(name, NULL, path, size);
+	}
+
+	char const* search = pipes_search_path(envp);
+	struct pipes_path_entry* entry = pipes_path_slot(name, search);
+	struct pipes_path_entry cached = { NULL, NULL, NULL, 0, 0, { 0, 0 } };
+	struct stat meta;
+	int hit = 0;
+
+	pthread_mutex_lock(&pipes_path_lock);
+
+	if (entry->name && strcmp(entry->name, name) == 0 && strcmp(entry->search, search) == 0 &&
+	    strlen(entry->path) < size) {
+		strcpy(path, entry->path);
+		cached = *entry;
+		hit = 1;
+	}
+
+	pthread_mutex_unlock(&pipes_path_lock);
+
+	// One stat() instead of walking PATH. A new executable of the same name
+	// in an earlier directory is not noticed, just like with the hash table
+	// of a shell. pipes_path_cache_flush() is the equivalent of hash -r.
+	if (hit && stat(path, &meta) == 0 && pipes_path_entry_matches(&cached, &meta)) {
+		return 0;
+	}
+
+	if (pipes_search_executable(name, search, path, size, &meta) == -1) {
+		return -1;
+	}
+
+	// relative PATH entries depend on the working directory
+	if (path[0] != '/') {
+		return 0;
+	}
+
+	struct pipes_path_entry update = {
+		strdup(name), strdup(search), strdup(path),
+		meta.st_dev, meta.st_ino, meta.st_ctim
+	};
+
+	if (update.name == NULL || update.search == NULL || update.path == NULL) {
+		// not being able to cache the result is not an error
+		pipes_path_entry_clear(&update);
+		return 0;
+	}
+
+	pthread_mutex_lock(&pipes_path_lock);
+	cached = *entry;
+	*entry = update;
+	pthread_mutex_unlock(&pipes_path_lock);
+
+	pipes_path_entry_clear(&cached);
+
+	return 0;
+}
+
+void pipes_path_cache_flush(void) {
+	struct pipes_path_entry entries[PIPES_PATH_CACHE_SIZE];
+
+	pthread_mutex_lock(&pipes_path_lock);
+	memcpy(entries, pipes_path_cache, sizeof(entries));
+	memset(pipes_path_cache, 0, sizeof(pipes_path_cache));
+	pthread_mutex_unlock(&pipes_path_lock);
+
+	for (size_t index = 0; index < PIPES_PATH_CACHE_SIZE; ++ index) {
+		pipes_path_entry_clear(&entries[index]);
+	}
+}
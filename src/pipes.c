@@ -2,6 +2,7 @@
 #define _GNU_SOURCE
 
 #include "pipes.h"
+#include "internal.h"
 
 #include <signal.h>
 #include <errno.h>
@@ -10,54 +11,90 @@
 #include <stdlib.h>
 #include <fcntl.h>
 
-#ifdef __APPLE__
-#	include <crt_externs.h>
-#	define environ (*_NSGetEnviron())
-#else
-	extern char **environ;
-#endif
-
-void pipes_redirect_fd(int oldfd, int newfd, const char *msg);
+int pipes_open(char const *const argv[], char const *const envp[], struct pipes* pipes) {
+	return pipes_open_attr(argv, envp, NULL, pipes);
+}
 
-#ifndef P_tmpdir
-#	define P_tmpdir "/tmp"
-#endif
+// Close the file descriptors in fds and extra that were meant for the child
+// process. PIPES_TEMP and PIPES_MEMFD file descriptors are also stored in
+// pipes and thus closed by pipes_close() instead. extra has room for the
+// pipes->nfds extra file descriptors or is NULL if there are none.
+static void pipes_release(struct pipes const* pipes, int fds[3], struct pipes_fdmap extra[]) {
+	if (fds[0] > -1 && fds[0] != pipes->infd)  close(fds[0]);
+	if (fds[1] > -1 && fds[1] != pipes->outfd) close(fds[1]);
+	if (fds[2] > -1 && fds[2] != pipes->errfd) close(fds[2]);
 
-static int pipes_temp_fd_fallback() {
-	char name[] = P_tmpdir "/pipesXXXXXX";
-	const int fd = mkstemp(name);
+	fds[0] = fds[1] = fds[2] = -1;
 
-	if (fd < 0) {
-		return -1;
+	for (size_t index = 0; extra && index < pipes->nfds; ++ index) {
+		if (extra[index].fd > -1 && extra[index].fd != pipes->fds[index].fd) {
+			close(extra[index].fd);
+		}
+		extra[index].fd = -1;
 	}
+}
 
-	if (unlink(name) != 0) {
-		close(fd);
-		return -1;
-	}
+// Like the standard streams in pipes_prepare(), for the extra file
+// descriptors. The ends for the child process are stored in extra.
+static int pipes_prepare_extra(struct pipes* pipes, int pipe_size, struct pipes_fdmap extra[]) {
+	for (size_t index = 0; index < pipes->nfds; ++ index) {
+		struct pipes_fd *ptr = &pipes->fds[index];
+		const int action = ptr->fd;
 
-	return fd;
-}
+		if (ptr->target <= STDERR_FILENO || (ptr->mode != PIPES_FD_IN && ptr->mode != PIPES_FD_OUT)) {
+			errno = EINVAL;
+			return -1;
+		}
 
-#if defined(O_TMPFILE) || defined(__linux__)
-#	ifndef O_TMPFILE
-#		define O_TMPFILE (020000000 | O_DIRECTORY)
-#	endif
-static int pipes_temp_fd() {
-	int fd = open(P_tmpdir, O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR);
-	if (fd < 0 && (
-		errno == EOPNOTSUPP || // no filesystem support for O_TMPFILE
-		errno == EISDIR     || // no kernel support for O_TMPFILE
-		errno == ENOENT)) {    // no kernel support for O_TMPFILE and path does not exist
-		return pipes_temp_fd_fallback();
-	}
-	return fd;
+		if (action == PIPES_PIPE) {
+			int pair[] = {-1, -1};
+			if (pipe2(pair, O_CLOEXEC) == -1) {
+				return -1;
+			}
+
+			pipes_resize_pipe(pair[0], pipe_size, &pipes->pipe_size);
+
+			const int child = ptr->mode == PIPES_FD_IN ? 0 : 1;
+			extra[index].fd = pair[child];
+			ptr->fd = pair[1 - child];
+		}
+		else if (action == PIPES_NULL) {
+			extra[index].fd = open("/dev/null", (ptr->mode == PIPES_FD_IN ? O_RDONLY : O_WRONLY) | O_CLOEXEC);
+
+			if (extra[index].fd < 0) {
+				return -1;
+			}
+			ptr->fd = -1;
+		}
+		else if (action > -1) {
+			extra[index].fd = action;
+			ptr->fd = -1;
+		}
+		else if (action == PIPES_TEMP || action == PIPES_MEMFD) {
+			ptr->fd = extra[index].fd = action == PIPES_TEMP ? pipes_temp_fd() : pipes_memfd();
+
+			if (ptr->fd < 0) {
+				return -1;
+			}
+		}
+		else if (action == PIPES_LEAVE) {
+			ptr->fd = -1;
+		}
+		else {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	return 0;
 }
-#else
-#	define pipes_temp_fd() pipes_temp_fd_fallback()
-#endif
 
-int pipes_open(char const *const argv[], char const *const envp[], struct pipes* pipes) {
+// Create the file descriptors for the standard streams of the child process
+// as requested in pipes. The ends for the child process are stored in fds
+// (or PIPES_TO_STDERR/PIPES_TO_STDOUT) and extra, the ends for the parent
+// process in pipes. On error everything is closed again.
+static int pipes_prepare(struct pipes* pipes, struct pipes_attr const* attr, int fds[3],
+                         struct pipes_fdmap extra[]) {
 	int infd  = -1;
 	int outfd = -1;
 	int errfd = -1;
@@ -65,6 +102,25 @@ int pipes_open(char const *const argv[], char const *const envp[], struct pipes*
 	const int inaction  = pipes->infd;
 	const int outaction = pipes->outfd;
 	const int erraction = pipes->errfd;
+	const int pipe_size = attr ? attr->pipe_size : 0;
+
+	pipes->pid       = -1;
+	pipes->pipe_size = 0;
+	pipes->pidfd     = -1;
+	pipes->started   = 0;
+	pipes->bytes_in  = 0;
+	pipes->bytes_out = 0;
+	pipes->bytes_err = 0;
+
+	if (pipes->nfds > PIPES_MAX_FDMAP || (pipes->nfds > 0 && (pipes->fds == NULL || extra == NULL))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (size_t index = 0; index < pipes->nfds; ++ index) {
+		extra[index].fd     = -1;
+		extra[index].target = pipes->fds[index].target;
+	}
 
 	// stdin
 	if (inaction == PIPES_PIPE) {
@@ -73,6 +129,8 @@ int pipes_open(char const *const argv[], char const *const envp[], struct pipes*
 			goto error;
 		}
 
+		pipes_resize_pipe(pair[0], pipe_size, &pipes->pipe_size);
+
 		infd = pair[0];
 		pipes->infd = pair[1];
 	}
@@ -95,6 +153,14 @@ int pipes_open(char const *const argv[], char const *const envp[], struct pipes*
 			goto error;
 		}
 	}
+	else if (inaction == PIPES_MEMFD) {
+		infd = pipes_memfd();
+		pipes->infd = infd;
+
+		if (infd < 0) {
+			goto error;
+		}
+	}
 	else if (inaction != PIPES_LEAVE) {
 		errno = EINVAL;
 		goto error;
@@ -107,6 +173,8 @@ int pipes_open(char const *const argv[], char const *const envp[], struct pipes*
 			goto error;
 		}
 
+		pipes_resize_pipe(pair[0], pipe_size, &pipes->pipe_size);
+
 		pipes->outfd = pair[0];
 		outfd = pair[1];
 	}
@@ -132,6 +200,14 @@ int pipes_open(char const *const argv[], char const *const envp[], struct pipes*
 			goto error;
 		}
 	}
+	else if (outaction == PIPES_MEMFD) {
+		outfd = pipes_memfd();
+		pipes->outfd = outfd;
+
+		if (outfd < 0) {
+			goto error;
+		}
+	}
 	else if (outaction != PIPES_LEAVE) {
 		errno = EINVAL;
 		goto error;
@@ -144,6 +220,8 @@ int pipes_open(char const *const argv[], char const *const envp[], struct pipes*
 			goto error;
 		}
 
+		pipes_resize_pipe(pair[0], pipe_size, &pipes->pipe_size);
+
 		pipes->errfd = pair[0];
 		errfd = pair[1];
 	}
@@ -169,94 +247,125 @@ int pipes_open(char const *const argv[], char const *const envp[], struct pipes*
 			goto error;
 		}
 	}
+	else if (erraction == PIPES_MEMFD) {
+		errfd = pipes_memfd();
+		pipes->errfd = errfd;
+
+		if (errfd < 0) {
+			goto error;
+		}
+	}
 	else if (erraction != PIPES_LEAVE) {
 		errno = EINVAL;
 		goto error;
 	}
 
-	pid_t pid = fork();
-
-	if (pid == -1) {
+	if (pipes_prepare_extra(pipes, pipe_size, extra) == -1) {
 		goto error;
 	}
 
-	if (pid == 0) {
-		// child
+	fds[0] = infd;
+	fds[1] = outaction == PIPES_TO_STDERR ? PIPES_TO_STDERR : outfd;
+	fds[2] = erraction == PIPES_TO_STDOUT ? PIPES_TO_STDOUT : errfd;
 
-		// close unused ends
-		if (pipes->infd > -1 && pipes->infd != infd) {
-			close(pipes->infd);
-			pipes->infd = -1;
-		}
+	return 0;
 
-		if (pipes->outfd > -1 && pipes->outfd != outfd) {
-			close(pipes->outfd);
-			pipes->outfd = -1;
-		}
+error:
+	(void)0;
 
-		if (pipes->errfd > -1 && pipes->errfd != errfd) {
-			close(pipes->errfd);
-			pipes->errfd = -1;
-		}
+	int errnum = errno;
 
-		pipes_redirect_fd(infd, STDIN_FILENO, "redirecting stdin");
+	int created[] = {infd, outfd, errfd};
+	pipes_release(pipes, created, extra);
+	pipes_close(pipes);
 
-		if (outaction == PIPES_TO_STDERR) {
-			if (dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
-				perror("redirecting stdout");
-				exit(EXIT_FAILURE);
-			}
-		}
-		else {
-			pipes_redirect_fd(outfd, STDOUT_FILENO, "redirecting stdout");
-		}
+	if (errnum != 0) {
+		errno = errnum;
+	}
 
-		if (erraction == PIPES_TO_STDOUT) {
-			if (dup2(STDOUT_FILENO, STDERR_FILENO) == -1) {
-				perror("redirecting stderr");
-				exit(EXIT_FAILURE);
-			}
-		}
-		else {
-			pipes_redirect_fd(errfd, STDERR_FILENO, "redirecting stderr");
-		}
+	return -1;
+}
 
-		if (envp) {
-			environ = (char**)envp;
+// Spawn the child process with the file descriptors created by
+// pipes_prepare(). On success they are closed, on error the caller has to
+// call pipes_release(). The file descriptors of map are passed on as well,
+// but not closed.
+static int pipes_start(char const* path, char const *const argv[], char const *const envp[],
+                       struct pipes_attr const* attr, struct pipes_stage_map const* map,
+                       struct pipes* pipes, int fds[3], struct pipes_fdmap extra[]) {
+	struct pipes_fdmap merged[PIPES_MAX_FDMAP];
+	size_t nmap = 0;
+
+	for (size_t index = 0; index < pipes->nfds; ++ index) {
+		if (extra[index].fd > -1) {
+			merged[nmap ++] = extra[index];
 		}
+	}
 
-		if (execvp(argv[0], (char * const*)argv) == -1) {
-			perror(argv[0]);
-		}
-		exit(EXIT_FAILURE);
+	if (map && map->count > PIPES_MAX_FDMAP - nmap) {
+		errno = EINVAL;
+		return -1;
 	}
-	else {
-		// parent
-		pipes->pid = pid;
 
-		if (inaction  != PIPES_TEMP && infd  > -1) close(infd);
-		if (outaction != PIPES_TEMP && outfd > -1) close(outfd);
-		if (erraction != PIPES_TEMP && errfd > -1) close(errfd);
+	for (size_t index = 0; map && index < map->count; ++ index) {
+		merged[nmap ++] = map->map[index];
+	}
+
+	const long long started = pipes_clock();
+	const pid_t pid = pipes_spawn(path, argv, envp, attr, fds[0], fds[1], fds[2],
+	                              nmap > 0 ? merged : NULL, nmap, &pipes->pidfd);
+
+	if (pid == -1) {
+		return -1;
 	}
 
+	pipes->pid     = pid;
+	pipes->started = started;
+	pipes_release(pipes, fds, extra);
+
 	return 0;
+}
 
-error:
-	pipes->pid = -1;
+// Start a function stage instead of a process. Left streams are the ones of
+// this process and the function gets no stderr.
+static int pipes_start_function(struct pipes_chain* stage, int fds[3]) {
+	const int infd  = fds[0] > -1 ? fds[0] : STDIN_FILENO;
+	const int outfd = fds[1] > -1 ? fds[1] : fds[1] == PIPES_TO_STDERR ? STDERR_FILENO : STDOUT_FILENO;
 
-	int errnum = errno;
+	const long long started = pipes_clock();
+	const int donefd = pipes_function_start(stage->fn, stage->ctx, infd, outfd);
 
-	if (infd  > -1) close(infd);
-	if (outfd > -1) close(outfd);
-	if (errfd > -1) close(errfd);
+	if (donefd == -1) {
+		return -1;
+	}
 
-	pipes_close(pipes);
+	stage->pipes.pidfd   = donefd;
+	stage->pipes.started = started;
+	pipes_release(&stage->pipes, fds, NULL);
+
+	return 0;
+}
+
+int pipes_open_attr(char const *const argv[], char const *const envp[],
+                    struct pipes_attr const* attr, struct pipes* pipes) {
+	int fds[3];
+	struct pipes_fdmap extra[PIPES_MAX_FDMAP];
+
+	if (pipes_prepare(pipes, attr, fds, extra) == -1) {
+		return -1;
+	}
+
+	if (pipes_start(NULL, argv, envp, attr, NULL, pipes, fds, extra) == -1) {
+		int errnum = errno;
+
+		pipes_release(pipes, fds, extra);
+		pipes_close(pipes);
 
-	if (errnum != 0) {
 		errno = errnum;
+		return -1;
 	}
 
-	return -1;
+	return 0;
 }
 
 int pipes_close(struct pipes* pipes) {
@@ -283,52 +392,143 @@ int pipes_close(struct pipes* pipes) {
 		pipes->errfd = -1;
 	}
 
+	if (pipes->pidfd > -1) {
+		if (close(pipes->pidfd) != 0) {
+			status = -1;
+		}
+		pipes->pidfd = -1;
+	}
+
+	for (size_t index = 0; pipes->fds && index < pipes->nfds; ++ index) {
+		if (pipes->fds[index].fd > -1) {
+			if (close(pipes->fds[index].fd) != 0) {
+				status = -1;
+			}
+			pipes->fds[index].fd = -1;
+		}
+	}
+
 	return status;
 }
 
 int pipes_open_chain(struct pipes_chain chain[]) {
-	struct pipes_chain *ptr  = chain;
-	struct pipes_chain *prev = chain;
+	return pipes_open_chain_attr(chain, NULL);
+}
 
-	for (; ptr->argv; ++ ptr) {
-		ptr->pipes.pid = -1;
-	}
+int pipes_open_chain_attr(struct pipes_chain chain[], struct pipes_attr const* attr) {
+	size_t count = 0;
 
 	if (chain == NULL || chain[0].argv == NULL) {
 		errno = EINVAL;
-		goto error;
+		return -1;
 	}
 
-	ptr = chain;
+	for (; chain[count].argv; ++ count) {
+		chain[count].pipes.pid   = -1;
+		chain[count].pipes.pidfd = -1;
 
-	for (++ ptr; ptr->argv; ++ ptr) {
-		if (ptr->pipes.infd == PIPES_PIPE && prev->pipes.outfd != PIPES_PIPE) {
+		// a function stage has no file descriptors besides stdin and stdout
+		if (chain[count].fn && chain[count].pipes.nfds > 0) {
 			errno = EINVAL;
-			goto error;
+			pipes_close_chain(chain);
+			return -1;
 		}
-		prev = ptr;
 	}
 
-	ptr  = chain;
-	prev = chain;
+	for (size_t index = 1; index < count; ++ index) {
+		if (chain[index].pipes.infd == PIPES_PIPE && chain[index - 1].pipes.outfd != PIPES_PIPE) {
+			errno = EINVAL;
+			pipes_close_chain(chain);
+			return -1;
+		}
+	}
 
-	if (pipes_open(ptr->argv, ptr->envp, &ptr->pipes) == -1) {
-		goto error;
+	int (*fds)[3] = calloc(count, sizeof(*fds));
+
+	if (fds == NULL) {
+		pipes_close_chain(chain);
+		return -1;
 	}
 
-	for (++ ptr; ptr->argv; ++ ptr) {
-		if (ptr->pipes.infd == PIPES_PIPE) {
-			ptr->pipes.infd   = prev->pipes.outfd;
-			prev->pipes.outfd = -1;
+	const int status = pipes_open_stages(chain, count, attr, NULL, fds);
+
+	free(fds);
+
+	return status;
+}
+
+// Shared by chains and graphs. Only chains are linked, i.e. PIPES_PIPE as
+// stdin of a stage is the stdout of the previous stage.
+static int pipes_open_range(struct pipes_chain chain[], size_t count, struct pipes_attr const* attr,
+                            char const *const paths[], struct pipes_stage_map const maps[], int linked,
+                            int fds[][3]) {
+	size_t prepared = 0;
+	size_t started  = 0;
+	size_t nextra   = 0;
+
+	for (size_t index = 0; index < count; ++ index) {
+		nextra += chain[index].pipes.nfds;
+	}
+
+	// the child ends of the extra file descriptors of all stages, stage
+	// index starting at the sum of the nfds of the stages before it
+	struct pipes_fdmap *extra = NULL;
+	size_t offset = 0;
+
+	if (nextra > 0 && (extra = calloc(nextra, sizeof(struct pipes_fdmap))) == NULL) {
+		pipes_close_chain(chain);
+		return -1;
+	}
+
+	PIPES_TRACEPOINT_CHAIN(open_chain, PIPES_TRACE_OPEN, chain);
+
+	// First create all pipes and files of the whole chain, then spawn all
+	// processes in one go. This way the spawning isn't interleaved with the
+	// setup of the next stage.
+	for (; prepared < count; ++ prepared) {
+		struct pipes_chain *ptr = &chain[prepared];
+
+		if (linked && prepared > 0 && ptr->pipes.infd == PIPES_PIPE) {
+			ptr->pipes.infd = chain[prepared - 1].pipes.outfd;
+			chain[prepared - 1].pipes.outfd = -1;
 		}
 
-		if (pipes_open(ptr->argv, ptr->envp, &ptr->pipes) == -1) {
+		if (pipes_prepare(&ptr->pipes, ptr->attr ? ptr->attr : attr, fds[prepared], extra ? extra + offset : NULL) == -1) {
 			goto error;
 		}
+		offset += ptr->pipes.nfds;
+	}
 
-		prev = ptr;
+	offset = 0;
+
+	struct pipes_placement placement;
+	placement.group = (size_t)-1;
+
+	for (; started < count; ++ started) {
+		struct pipes_chain *ptr = &chain[started];
+
+		if (ptr->fn) {
+			if (pipes_start_function(ptr, fds[started]) == -1) {
+				goto error;
+			}
+			offset += ptr->pipes.nfds;
+			continue;
+		}
+
+		struct pipes_attr const* stage_attr = pipes_place_stage(&placement, ptr->attr ? ptr->attr : attr);
+
+		if (pipes_start(paths ? paths[started] : NULL, ptr->argv, ptr->envp,
+		                stage_attr, maps ? &maps[started] : NULL, &ptr->pipes, fds[started],
+		                extra ? extra + offset : NULL) == -1) {
+			goto error;
+		}
+		offset += ptr->pipes.nfds;
 	}
 
+	PIPES_TRACEPOINT_CHAIN(chain_opened, PIPES_TRACE_OPENED, chain);
+
+	free(extra);
+
 	return 0;
 
 error:
@@ -337,9 +537,29 @@ error:
 
 	int errnum = errno;
 
+	offset = 0;
+	for (size_t index = 0; index < started; ++ index) {
+		offset += chain[index].pipes.nfds;
+	}
+
+	for (size_t index = started; index < prepared; ++ index) {
+		pipes_release(&chain[index].pipes, fds[index], extra ? extra + offset : NULL);
+		offset += chain[index].pipes.nfds;
+	}
+
+	free(extra);
+
 	pipes_close_chain(chain);
 	pipes_kill_chain(chain, SIGTERM);
 
+	// Started functions end with their closed pipes, nobody waits for them.
+	for (size_t index = 0; index < started; ++ index) {
+		if (chain[index].fn && chain[index].pipes.pidfd > -1) {
+			close(chain[index].pipes.pidfd);
+			chain[index].pipes.pidfd = -1;
+		}
+	}
+
 	if (errnum != 0) {
 		errno = errnum;
 	}
@@ -347,13 +567,36 @@ error:
 	return -1;
 }
 
+int pipes_open_stages(struct pipes_chain chain[], size_t count, struct pipes_attr const* attr,
+                      char const *const paths[], int fds[][3]) {
+	return pipes_open_range(chain, count, attr, paths, NULL, 1, fds);
+}
+
+int pipes_open_nodes(struct pipes_chain nodes[], size_t count, struct pipes_attr const* attr,
+                     struct pipes_stage_map const maps[], int fds[][3]) {
+	return pipes_open_range(nodes, count, attr, NULL, maps, 0, fds);
+}
+
 int pipes_close_chain(struct pipes_chain chain[]) {
 	int status = 0;
 
+	PIPES_TRACEPOINT_CHAIN(close_chain, PIPES_TRACE_CLOSE, chain);
+
 	for (struct pipes_chain *ptr = chain; ptr->argv; ++ ptr) {
+		// the done fd of a function stage is still needed for waiting
+		const int donefd = ptr->pipes.pidfd;
+
+		if (ptr->fn) {
+			ptr->pipes.pidfd = -1;
+		}
+
 		if (pipes_close(&ptr->pipes) != 0) {
 			status = -1;
 		}
+
+		if (ptr->fn) {
+			ptr->pipes.pidfd = donefd;
+		}
 	}
 
 	return status;
@@ -364,7 +607,7 @@ int pipes_kill_chain(struct pipes_chain chain[], int sig) {
 
 	for (struct pipes_chain *ptr = chain; ptr->argv; ++ ptr) {
 		if (ptr->pipes.pid > -1) {
-			if (kill(ptr->pipes.pid, sig) != 0) {
+			if (pipes_pidfd_kill(ptr->pipes.pid, ptr->pipes.pidfd, sig) != 0) {
 				status = -1;
 			}
 		}
@@ -3,6 +3,9 @@
 #pragma once
 
 #include <sys/types.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
 
 #include "export.h"
 
@@ -18,43 +21,257 @@ extern "C" {
 #define PIPES_TO_STDOUT  -5
 #define PIPES_TO_STDERR  -6
 #define PIPES_TEMP       -7
+#define PIPES_MEMFD      -8
 
-#define PIPES_PASS     {-1, PIPES_PIPE,  PIPES_PIPE,  PIPES_LEAVE}
-#define PIPES_IN(IN)   {-1, (IN),        PIPES_PIPE,  PIPES_LEAVE}
-#define PIPES_OUT(OUT) {-1, PIPES_PIPE,  (OUT),       PIPES_LEAVE}
-#define PIPES_ERR(ERR) {-1, PIPES_PIPE,  PIPES_LEAVE, (ERR)}
-#define PIPES_FIRST    {-1, PIPES_LEAVE, PIPES_PIPE,  PIPES_LEAVE}
-#define PIPES_LAST     {-1, PIPES_PIPE,  PIPES_LEAVE, PIPES_LEAVE}
+/* Spawn backends for struct pipes_attr. */
+#define PIPES_SPAWN_DEFAULT 0
+#define PIPES_SPAWN_FORK    1
+#define PIPES_SPAWN_POSIX   2
+#define PIPES_SPAWN_SERVER  3
+
+/* Flags for struct pipes_buffer. */
+#define PIPES_BUFFER_FIXED 0x1
+
+/* Flags for pipes_feed(). */
+#define PIPES_FEED_GIFT 0x1
+
+/* Flags for struct pipes_attr. */
+#define PIPES_ATTR_PIDFD     0x1
+#define PIPES_ATTR_CLOSE_FDS 0x2
+#define PIPES_ATTR_PLACE     0x4
+
+/* Flags for struct pipes_limits. */
+#define PIPES_LIMITS_NICE   0x1
+#define PIPES_LIMITS_IOPRIO 0x2
+#define PIPES_LIMITS_CGROUP 0x4
+
+/* I/O priorities for struct pipes_limits, see ioprio_set(2). */
+#define PIPES_IOPRIO_CLASS_RT   1
+#define PIPES_IOPRIO_CLASS_BE   2
+#define PIPES_IOPRIO_CLASS_IDLE 3
+#define PIPES_IOPRIO(CLASS, DATA) (((CLASS) << 13) | (DATA))
+
+/* What a process in struct pipes_sample is blocked on. */
+#define PIPES_BLOCKED_NONE  0
+#define PIPES_BLOCKED_READ  1
+#define PIPES_BLOCKED_WRITE 2
+
+/* Modes for struct pipes_fd. */
+#define PIPES_FD_IN  0
+#define PIPES_FD_OUT 1
+
+/* Directions for the io trace callback. */
+#define PIPES_TRACE_READ  0
+#define PIPES_TRACE_WRITE 1
+
+/* Events for the chain trace callback. */
+#define PIPES_TRACE_OPEN   0
+#define PIPES_TRACE_OPENED 1
+#define PIPES_TRACE_CLOSE  2
+
+#define PIPES_PASS     {-1, PIPES_PIPE,  PIPES_PIPE,  PIPES_LEAVE, 0, -1, 0, 0, 0, 0, NULL, 0}
+#define PIPES_IN(IN)   {-1, (IN),        PIPES_PIPE,  PIPES_LEAVE, 0, -1, 0, 0, 0, 0, NULL, 0}
+#define PIPES_OUT(OUT) {-1, PIPES_PIPE,  (OUT),       PIPES_LEAVE, 0, -1, 0, 0, 0, 0, NULL, 0}
+#define PIPES_ERR(ERR) {-1, PIPES_PIPE,  PIPES_LEAVE, (ERR),       0, -1, 0, 0, 0, 0, NULL, 0}
+#define PIPES_FIRST    {-1, PIPES_LEAVE, PIPES_PIPE,  PIPES_LEAVE, 0, -1, 0, 0, 0, 0, NULL, 0}
+#define PIPES_LAST     {-1, PIPES_PIPE,  PIPES_LEAVE, PIPES_LEAVE, 0, -1, 0, 0, 0, 0, NULL, 0}
+
+/* A process stage of a chain, PIPES_STAGE(PIPES_PASS, NULL) ends a chain.
+ * Unlike a positional initializer this doesn't break when struct
+ * pipes_chain grows. */
+#define PIPES_STAGE(PIPES, ARGV) {PIPES, (ARGV), NULL, NULL, NULL, NULL}
+
+#define PIPES_ATTR_INIT   {PIPES_SPAWN_DEFAULT, 0, 0, NULL}
+#define PIPES_LIMITS_INIT {NULL, 0, NULL, 0, 0, 0, -1, 0}
+#define PIPES_BUFFER_INIT {NULL, 0, 0, 0}
 
 #define PIPES_GET_LAST(CHAIN) ((CHAIN)[(sizeof(CHAIN) / sizeof(struct pipes_chain))-2].pipes)
 #define PIPES_GET_IN(CHAIN)   ((CHAIN)[0].pipes.infd)
 #define PIPES_GET_OUT(CHAIN)  (PIPES_GET_LAST(CHAIN).outfd)
 #define PIPES_GET_ERR(CHAIN)  (PIPES_GET_LAST(CHAIN).errfd)
 
+/* A file descriptor of the child process besides its standard streams. */
+struct pipes_fd {
+	int target; /* number of the file descriptor in the child, 3 or higher */
+	int fd;     /* like infd or outfd of struct pipes */
+	int mode;   /* PIPES_FD_IN if the child reads it, PIPES_FD_OUT if it writes it */
+};
+
 struct pipes {
 	pid_t pid;
 	int infd;
 	int outfd;
 	int errfd;
+	int pipe_size;
+	int pidfd;
+	long long started; /* CLOCK_MONOTONIC nanoseconds at spawn */
+	size_t bytes_in;   /* bytes the library wrote to infd */
+	size_t bytes_out;  /* bytes the library read from outfd */
+	size_t bytes_err;  /* bytes the library read from errfd */
+	/* nfds more file descriptors of the child or NULL */
+	struct pipes_fd* fds;
+	size_t nfds;
+};
+
+struct pipes_stats {
+	int status;
+	struct rusage rusage;
+	struct timeval wall;
+	size_t bytes_in;
+	size_t bytes_out;
+	size_t bytes_err;
+};
+
+struct pipes_sample {
+	pid_t pid;
+	char  state;                /* state from /proc/<pid>/stat or 0 if gone */
+	int   blocked;              /* PIPES_BLOCKED_* */
+	unsigned long long cpu;     /* user and system time in clock ticks */
+	int   fill;                 /* bytes queued in the stdin pipe or -1 */
+	int   capacity;             /* capacity of the stdin pipe or -1 */
+};
+
+struct pipes_rlimit {
+	int resource;
+	struct rlimit limit;
+};
+
+struct pipes_limits {
+	struct pipes_rlimit const* rlimits;
+	size_t nrlimits;
+	void const* cpus;
+	size_t cpus_size;
+	int nice;
+	int ioprio;
+	int cgroupfd;
+	int flags;
+};
+
+struct pipes_attr {
+	int spawn;
+	int pipe_size;
+	int flags;
+	struct pipes_limits const* limits;
+};
+
+struct pipes_view {
+	void const* data;
+	size_t size;
+};
+
+struct pipes_buffer {
+	char*  data;
+	size_t size;
+	size_t capacity;
+	int    flags;
 };
 
 struct pipes_chain {
 	struct pipes pipes;
 	char const* const* argv;
 	char const* const* envp;
+	struct pipes_attr const* attr;
+	/* If not NULL the stage is this function instead of a process. It runs
+	 * on a thread of the library and argv only names the stage. */
+	int (*fn)(int infd, int outfd, void* ctx);
+	void* ctx;
+};
+
+/* All times are CLOCK_MONOTONIC nanoseconds. Every callback may be NULL. */
+struct pipes_trace_callbacks {
+	/* A process for argv is about to be spawned. */
+	void (*spawn)(char const *const argv[], long long time, void* ctx);
+
+	/* The process pid executed its program (error is 0) or failed to with
+	 * error. pid is -1 if the process couldn't be spawned at all. */
+	void (*exec)(pid_t pid, int error, long long time, void* ctx);
+
+	/* The process pid was reaped. */
+	void (*exit)(pid_t pid, int status, long long time, void* ctx);
+
+	/* The library read (PIPES_TRACE_READ) or wrote (PIPES_TRACE_WRITE)
+	 * size bytes from or to fd. */
+	void (*io)(int fd, int direction, size_t size, long long time, void* ctx);
+
+	/* A chain is being opened (PIPES_TRACE_OPEN), was opened
+	 * (PIPES_TRACE_OPENED) or is being closed (PIPES_TRACE_CLOSE). */
+	void (*chain)(struct pipes_chain const chain[], int event, long long time, void* ctx);
 };
 
+struct pipes_template;
+struct pipes_monitor;
+struct pipes_graph;
+
 PIPES_EXPORT int pipes_open(char const *const argv[], char const *const envp[], struct pipes* pipes);
+PIPES_EXPORT int pipes_open_attr(char const *const argv[], char const *const envp[],
+                                 struct pipes_attr const* attr, struct pipes* pipes);
 PIPES_EXPORT int pipes_close(struct pipes* pipes);
+PIPES_EXPORT int pipes_wait( struct pipes* pipes, int* status);
+PIPES_EXPORT int pipes_wait_stats(struct pipes* pipes, struct pipes_stats* stats);
 
 PIPES_EXPORT int pipes_open_chain( struct pipes_chain chain[]);
+PIPES_EXPORT int pipes_open_chain_attr(struct pipes_chain chain[], struct pipes_attr const* attr);
 PIPES_EXPORT int pipes_close_chain(struct pipes_chain chain[]);
 PIPES_EXPORT int pipes_kill_chain( struct pipes_chain chain[], int sig);
+PIPES_EXPORT int pipes_wait_chain( struct pipes_chain chain[], int status[]);
+PIPES_EXPORT int pipes_poll_chain( struct pipes_chain chain[], int status[], int timeout);
+PIPES_EXPORT int pipes_wait_chain_stats(struct pipes_chain chain[], struct pipes_stats stats[]);
+
+PIPES_EXPORT int pipes_sample_chain(struct pipes_chain const chain[], struct pipes_sample samples[]);
+PIPES_EXPORT struct pipes_monitor* pipes_monitor_start(struct pipes_chain const chain[], int interval,
+                                                       void (*callback)(struct pipes_sample const samples[],
+                                                                        size_t count, void* ctx),
+                                                       void* ctx);
+PIPES_EXPORT int pipes_monitor_stop(struct pipes_monitor* monitor);
+
+PIPES_EXPORT struct pipes_template* pipes_template_new(struct pipes_chain const chain[], struct pipes_attr const* attr,
+                                                       size_t pool_size);
+PIPES_EXPORT void                   pipes_template_free(   struct pipes_template* tmpl);
+PIPES_EXPORT struct pipes_chain*    pipes_template_open(   struct pipes_template* tmpl);
+PIPES_EXPORT int                    pipes_template_release(struct pipes_template* tmpl, struct pipes_chain chain[]);
+
+PIPES_EXPORT struct pipes_graph* pipes_graph_new(    void);
+PIPES_EXPORT void                pipes_graph_free(   struct pipes_graph* graph);
+PIPES_EXPORT int                 pipes_graph_add(    struct pipes_graph* graph, struct pipes_chain const* node);
+PIPES_EXPORT int                 pipes_graph_connect(struct pipes_graph* graph, int from, int fromfd, int to, int tofd);
+PIPES_EXPORT int                 pipes_graph_open(   struct pipes_graph* graph, struct pipes_attr const* attr);
+PIPES_EXPORT struct pipes_chain* pipes_graph_chain(  struct pipes_graph* graph);
+PIPES_EXPORT int                 pipes_graph_wait(   struct pipes_graph* graph, int status[]);
 
 PIPES_EXPORT int pipes_take_in( struct pipes_chain chain[]);
 PIPES_EXPORT int pipes_take_out(struct pipes_chain chain[]);
 PIPES_EXPORT int pipes_take_err(struct pipes_chain chain[]);
 
+PIPES_EXPORT int  pipes_capture_chain(struct pipes_chain chain[], void const* input, size_t size,
+                                      struct pipes_buffer* out, struct pipes_buffer* err, int status[]);
+PIPES_EXPORT int  pipes_capture_chain_stats(struct pipes_chain chain[], void const* input, size_t size,
+                                            struct pipes_buffer* out, struct pipes_buffer* err,
+                                            struct pipes_stats stats[]);
+PIPES_EXPORT void pipes_buffer_free(  struct pipes_buffer* buffer);
+
+PIPES_EXPORT int pipes_map(  int fd, struct pipes_view* view);
+PIPES_EXPORT int pipes_unmap(struct pipes_view* view);
+
+PIPES_EXPORT void pipes_path_cache_flush(void);
+
+PIPES_EXPORT void pipes_trace_set(struct pipes_trace_callbacks const* callbacks, void* ctx);
+
+PIPES_EXPORT int   pipes_spawner_start(void);
+PIPES_EXPORT int   pipes_spawner_stop(void);
+PIPES_EXPORT pid_t pipes_spawner_pid(void);
+
+PIPES_EXPORT ssize_t pipes_forward(      int from, int to, size_t count);
+PIPES_EXPORT ssize_t pipes_forward_all(  int from, int to);
+PIPES_EXPORT ssize_t pipes_forward_chain(struct pipes_chain chain[], int to);
+
+PIPES_EXPORT ssize_t pipes_feed(      int fd, struct iovec const iov[], size_t count, int flags);
+PIPES_EXPORT ssize_t pipes_feed_chain(struct pipes_chain chain[], struct iovec const iov[], size_t count, int flags);
+
+PIPES_EXPORT int pipes_fanout(      int from, int const to[], size_t count);
+PIPES_EXPORT int pipes_fanout_chain(struct pipes_chain chain[], struct pipes_chain *const targets[], size_t count);
+
+PIPES_EXPORT int pipes_merge(int const from[], size_t count, int to);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,64 @@
+#define _POSIX_SOURCE
+#define _GNU_SOURCE
+
+#include "internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#ifdef F_SETPIPE_SZ
+static int pipes_pipe_max_size() {
+	FILE *fp = fopen("/proc/sys/fs/pipe-max-size", "re");
+
+	if (fp == NULL) {
+		return -1;
+	}
+
+	int size = -1;
+	if (fscanf(fp, "%d", &size) != 1) {
+		size = -1;
+	}
+
+	fclose(fp);
+
+	return size;
+}
+#endif
+
+static int pipes_set_pipe_size(int fd, int size) {
+#ifdef F_SETPIPE_SZ
+	int granted = fcntl(fd, F_SETPIPE_SZ, size);
+
+	if (granted == -1 && errno == EPERM) {
+		// Unprivileged processes can't exceed pipe-max-size, so get as
+		// close to the requested size as possible.
+		const int max = pipes_pipe_max_size();
+
+		if (max > 0 && max < size) {
+			granted = fcntl(fd, F_SETPIPE_SZ, max);
+		}
+	}
+
+	if (granted == -1) {
+		granted = fcntl(fd, F_GETPIPE_SZ);
+	}
+
+	return granted;
+#else
+	(void)fd;
+	(void)size;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+void pipes_resize_pipe(int fd, int size, int *granted) {
+	if (size > 0) {
+		const int actual = pipes_set_pipe_size(fd, size);
+
+		if (actual > 0 && (*granted == 0 || actual < *granted)) {
+			*granted = actual;
+		}
+	}
+}
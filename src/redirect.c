@@ -1,7 +1,14 @@
+#define _POSIX_SOURCE
+#define _GNU_SOURCE
+
+#include "internal.h"
+
+#include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <limits.h>
 
 void pipes_redirect_fd(int oldfd, int newfd, const char *msg) {
 	if (oldfd > -1) {
@@ -40,3 +47,55 @@ void pipes_redirect_fd(int oldfd, int newfd, const char *msg) {
 		}
 	}
 }
+
+int pipes_fdmap_check(struct pipes_fdmap const map[], size_t count) {
+	int lowfd = STDERR_FILENO + 1;
+
+	if (count > PIPES_MAX_FDMAP) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (size_t index = 0; index < count; ++ index) {
+		if (map[index].fd < 0 || map[index].target <= STDERR_FILENO || map[index].target == INT_MAX) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		for (size_t other = 0; other < index; ++ other) {
+			if (map[other].target == map[index].target) {
+				errno = EINVAL;
+				return -1;
+			}
+		}
+
+		if (map[index].target >= lowfd) {
+			lowfd = map[index].target + 1;
+		}
+	}
+
+	return lowfd;
+}
+
+int pipes_redirect_map_prepare(struct pipes_fdmap const map[], size_t count, int lowfd, int moved[]) {
+	for (size_t index = 0; index < count; ++ index) {
+		moved[index] = fcntl(map[index].fd, F_DUPFD_CLOEXEC, lowfd);
+
+		if (moved[index] == -1) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int pipes_redirect_map(struct pipes_fdmap const map[], size_t count, int const moved[]) {
+	// moved is above all targets, so no dup2() overwrites another source
+	for (size_t index = 0; index < count; ++ index) {
+		if (dup2(moved[index], map[index].target) == -1) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,420 @@
+#define _POSIX_SOURCE
+#define _GNU_SOURCE
+
+#include "internal.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
+
+#ifndef PATH_MAX
+#	define PATH_MAX 4096
+#endif
+
+#ifdef __linux__
+#	include <sys/syscall.h>
+#	ifndef CLOSE_RANGE_CLOEXEC
+#		define CLOSE_RANGE_CLOEXEC (1U << 2)
+#	endif
+#endif
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+#	define PIPES_HAVE_ADDCLOSEFROM
+#endif
+
+#ifdef __APPLE__
+#	include <crt_externs.h>
+#	define environ (*_NSGetEnviron())
+#else
+	extern char **environ;
+#endif
+
+// Set the close on exec flag of all file descriptors from lowfd on.
+static int pipes_cloexec_from(int lowfd) {
+#if defined(__linux__) && defined(SYS_close_range)
+	if (syscall(SYS_close_range, lowfd, ~0U, CLOSE_RANGE_CLOEXEC) == 0) {
+		return 0;
+	}
+#endif
+	const long maxfd = sysconf(_SC_OPEN_MAX);
+
+	for (long fd = lowfd; fd < maxfd; ++ fd) {
+		int flags = fcntl((int)fd, F_GETFD);
+
+		if (flags != -1 && (flags & FD_CLOEXEC) == 0 &&
+		    fcntl((int)fd, F_SETFD, flags | FD_CLOEXEC) == -1) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Report errno through the status pipe (if any) and exit. Runs in the child.
+static void pipes_child_fail(int status, char const* msg) {
+	const int errnum = errno;
+
+	perror(msg);
+
+	if (status > -1) {
+		while (write(status, &errnum, sizeof(errnum)) == -1 && errno == EINTR);
+	}
+
+	exit(EXIT_FAILURE);
+}
+
+// status is the write end of a close on exec pipe or -1. If exec fails the
+// errno is written to it. If pidfd isn't NULL it gets a pidfd of the child
+// or -1, see pipes_clone().
+static pid_t pipes_spawn_fork(char const* path, char const *const argv[], char const *const envp[],
+                              struct pipes_limits const* limits, int infd, int outfd, int errfd,
+                              struct pipes_fdmap const map[], size_t nmap, int lowfd, int flags, int status,
+                              int *pidfd) {
+	pid_t pid = pipes_clone(0, limits && (limits->flags & PIPES_LIMITS_CGROUP) ? limits->cgroupfd : -1, pidfd);
+
+	if (pid != 0) {
+		// parent or error
+		return pid;
+	}
+
+	// child
+	int moved[PIPES_MAX_FDMAP];
+
+	if (pipes_redirect_map_prepare(map, nmap, lowfd, moved) == -1) {
+		pipes_child_fail(status, "redirecting file descriptors");
+	}
+
+	pipes_redirect_fd(infd, STDIN_FILENO, "redirecting stdin");
+
+	if (outfd == PIPES_TO_STDERR) {
+		if (dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+			perror("redirecting stdout");
+			exit(EXIT_FAILURE);
+		}
+	}
+	else {
+		pipes_redirect_fd(outfd, STDOUT_FILENO, "redirecting stdout");
+	}
+
+	if (errfd == PIPES_TO_STDOUT) {
+		if (dup2(STDOUT_FILENO, STDERR_FILENO) == -1) {
+			perror("redirecting stderr");
+			exit(EXIT_FAILURE);
+		}
+	}
+	else {
+		pipes_redirect_fd(errfd, STDERR_FILENO, "redirecting stderr");
+	}
+
+	if ((flags & PIPES_ATTR_CLOSE_FDS) && pipes_cloexec_from(STDERR_FILENO + 1) == -1) {
+		pipes_child_fail(status, "closing file descriptors");
+	}
+
+	if (pipes_redirect_map(map, nmap, moved) == -1) {
+		pipes_child_fail(status, "redirecting file descriptors");
+	}
+
+	if (limits && pipes_limits_apply(limits) == -1) {
+		pipes_child_fail(status, "applying limits");
+	}
+
+	if (envp) {
+		environ = (char**)envp;
+	}
+
+	if (path) {
+		execve(path, (char * const*)argv, environ);
+	}
+	// Also if the cached path went stale or the file is a script without
+	// a #! line, which only execvp() runs using /bin/sh.
+	execvp(argv[0], (char * const*)argv);
+	pipes_child_fail(status, argv[0]);
+
+	return -1; // not reached
+}
+
+// Like pipes_spawn_fork(), but if exec is traced wait until the child
+// executed its program and report that. The status pipe is closed by a
+// successful exec.
+static pid_t pipes_spawn_fork_traced(char const* path, char const *const argv[], char const *const envp[],
+                                     struct pipes_limits const* limits, int infd, int outfd, int errfd,
+                                     struct pipes_fdmap const map[], size_t nmap, int lowfd, int flags,
+                                     int *pidfd) {
+	int status[2];
+
+	if (!PIPES_TRACING_EXEC) {
+		return pipes_spawn_fork(path, argv, envp, limits, infd, outfd, errfd, map, nmap, lowfd, flags, -1,
+		                        pidfd);
+	}
+
+	if (pipe2(status, O_CLOEXEC) == -1) {
+		return -1;
+	}
+
+	// keep the write end out of the way of the standard streams and the
+	// mapped file descriptors
+	if (status[1] < lowfd) {
+		const int fd = fcntl(status[1], F_DUPFD_CLOEXEC, lowfd);
+		const int errnum = errno;
+
+		close(status[1]);
+
+		if (fd == -1) {
+			close(status[0]);
+			errno = errnum;
+			return -1;
+		}
+
+		status[1] = fd;
+	}
+
+	const pid_t pid = pipes_spawn_fork(path, argv, envp, limits, infd, outfd, errfd, map, nmap, lowfd, flags,
+	                                   status[1], pidfd);
+	const int errnum = errno;
+
+	close(status[1]);
+
+	if (pid > 0) {
+		int error = 0;
+		ssize_t count;
+
+		do {
+			count = read(status[0], &error, sizeof(error));
+		} while (count == -1 && errno == EINTR);
+
+		PIPES_TRACEPOINT_EXEC(pid, count == (ssize_t)sizeof(error) ? error : 0);
+	}
+
+	close(status[0]);
+
+	errno = errnum;
+
+	return pid;
+}
+
+static pid_t pipes_spawn_posix(char const* path, char const *const argv[], char const *const envp[],
+                               int infd, int outfd, int errfd,
+                               struct pipes_fdmap const map[], size_t nmap, int lowfd, int flags) {
+	// There is no way to run code in the child between the file actions, so
+	// any source file descriptor that is itself a standard stream is moved
+	// out of the way first. Otherwise e.g. swapping stdin and stdout or
+	// passing a file descriptor that already is the target would not work.
+	int fds[]    = {infd, outfd, errfd};
+	int tmpfds[] = {-1, -1, -1};
+	int errnum   = 0;
+	pid_t pid    = -1;
+
+	// The mapped file descriptors are moved above all targets for the
+	// same reason. These are closed by the exec.
+	int moved[PIPES_MAX_FDMAP];
+	size_t nmoved = 0;
+
+	for (; nmoved < nmap; ++ nmoved) {
+		moved[nmoved] = fcntl(map[nmoved].fd, F_DUPFD_CLOEXEC, lowfd);
+
+		if (moved[nmoved] == -1) {
+			errnum = errno;
+			goto cleanup;
+		}
+	}
+
+	for (int index = 0; index < 3; ++ index) {
+		if (fds[index] > -1 && fds[index] <= STDERR_FILENO) {
+			tmpfds[index] = fcntl(fds[index], F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+
+			if (tmpfds[index] == -1) {
+				errnum = errno;
+				goto cleanup;
+			}
+
+			fds[index] = tmpfds[index];
+		}
+	}
+
+	posix_spawn_file_actions_t actions;
+
+	errnum = posix_spawn_file_actions_init(&actions);
+	if (errnum != 0) {
+		goto cleanup;
+	}
+
+	if (fds[0] > -1) {
+		errnum = posix_spawn_file_actions_adddup2(&actions, fds[0], STDIN_FILENO);
+		if (errnum != 0) goto destroy;
+	}
+
+	if (fds[1] == PIPES_TO_STDERR) {
+		errnum = posix_spawn_file_actions_adddup2(&actions, STDERR_FILENO, STDOUT_FILENO);
+		if (errnum != 0) goto destroy;
+	}
+	else if (fds[1] > -1) {
+		errnum = posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+		if (errnum != 0) goto destroy;
+	}
+
+	if (fds[2] == PIPES_TO_STDOUT) {
+		errnum = posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+		if (errnum != 0) goto destroy;
+	}
+	else if (fds[2] > -1) {
+		errnum = posix_spawn_file_actions_adddup2(&actions, fds[2], STDERR_FILENO);
+		if (errnum != 0) goto destroy;
+	}
+
+	// Passed file descriptors don't necessarily have the close on exec flag
+	// set, so close them explicitly (the fork backend does the same).
+	for (int index = 0; index < 3; ++ index) {
+		if (fds[index] > STDERR_FILENO) {
+			errnum = posix_spawn_file_actions_addclose(&actions, fds[index]);
+			if (errnum != 0) goto destroy;
+		}
+	}
+
+	for (size_t index = 0; index < nmap; ++ index) {
+		errnum = posix_spawn_file_actions_adddup2(&actions, moved[index], map[index].target);
+		if (errnum != 0) goto destroy;
+	}
+
+	if (flags & PIPES_ATTR_CLOSE_FDS) {
+		// Everything below lowfd that isn't a target is closed one by one,
+		// closing a file descriptor that isn't open is no error here.
+		for (int fd = STDERR_FILENO + 1; fd < lowfd; ++ fd) {
+			size_t index = 0;
+			while (index < nmap && map[index].target != fd) ++ index;
+
+			if (index == nmap) {
+				errnum = posix_spawn_file_actions_addclose(&actions, fd);
+				if (errnum != 0) goto destroy;
+			}
+		}
+
+#ifdef PIPES_HAVE_ADDCLOSEFROM
+		errnum = posix_spawn_file_actions_addclosefrom_np(&actions, lowfd);
+#else
+		errnum = ENOTSUP;
+#endif
+		if (errnum != 0) goto destroy;
+	}
+
+	if (path) {
+		errnum = posix_spawn(&pid, path, &actions, NULL,
+			(char * const*)argv, envp ? (char * const*)envp : environ);
+	}
+
+	// the cached path might have gone stale
+	if (path == NULL || errnum == ENOENT) {
+		errnum = posix_spawnp(&pid, argv[0], &actions, NULL,
+			(char * const*)argv, envp ? (char * const*)envp : environ);
+	}
+
+	if (errnum != 0) {
+		pid = -1;
+	}
+
+destroy:
+	posix_spawn_file_actions_destroy(&actions);
+
+cleanup:
+	for (int index = 0; index < 3; ++ index) {
+		if (tmpfds[index] > -1) {
+			close(tmpfds[index]);
+		}
+	}
+
+	for (size_t index = 0; index < nmoved; ++ index) {
+		close(moved[index]);
+	}
+
+	if (errnum != 0) {
+		errno = errnum;
+	}
+
+	return pid;
+}
+
+pid_t pipes_spawn(char const* path, char const *const argv[], char const *const envp[],
+                  struct pipes_attr const* attr, int infd, int outfd, int errfd,
+                  struct pipes_fdmap const map[], size_t nmap, int *pidfd) {
+	const int backend = attr ? attr->spawn : PIPES_SPAWN_DEFAULT;
+	const int flags   = attr ? attr->flags : 0;
+	struct pipes_limits const* limits = attr ? attr->limits : NULL;
+	char resolved[PATH_MAX];
+	pid_t pid;
+
+	*pidfd = -1;
+
+	PIPES_TRACEPOINT_SPAWN(argv);
+
+	if (limits && pipes_limits_check(limits) == -1) {
+		return -1;
+	}
+
+	const int lowfd = pipes_fdmap_check(map, nmap);
+	if (lowfd == -1) {
+		return -1;
+	}
+
+	// Search PATH here instead of in the child, so it isn't done by
+	// failing execve() calls after every fork.
+	if (path == NULL && argv[0] && pipes_resolve_executable(argv[0], envp, resolved, sizeof(resolved)) == 0) {
+		path = resolved;
+	}
+
+	switch (backend) {
+		case PIPES_SPAWN_DEFAULT:
+			if (pipes_spawner_pid() > -1) {
+				pid = pipes_spawner_spawn(path, argv, envp, limits, infd, outfd, errfd, map, nmap);
+
+				// ENOTCONN means the spawn server died in the meantime
+				if (pid != -1 || errno != ENOTCONN) {
+					PIPES_TRACEPOINT_EXEC(pid, pid == -1 ? errno : 0);
+					break;
+				}
+			}
+			pid = pipes_spawn_fork_traced(path, argv, envp, limits, infd, outfd, errfd, map, nmap, lowfd, flags,
+			                              flags & PIPES_ATTR_PIDFD ? pidfd : NULL);
+			break;
+
+		case PIPES_SPAWN_FORK:
+			pid = pipes_spawn_fork_traced(path, argv, envp, limits, infd, outfd, errfd, map, nmap, lowfd, flags,
+			                              flags & PIPES_ATTR_PIDFD ? pidfd : NULL);
+			break;
+
+		case PIPES_SPAWN_POSIX:
+			// posix_spawn() can't run anything between fork and exec
+			if (limits) {
+				errno = ENOTSUP;
+				return -1;
+			}
+			// posix_spawn() and the spawn server only return after the
+			// exec, so it is done (or failed) by now
+			pid = pipes_spawn_posix(path, argv, envp, infd, outfd, errfd, map, nmap, lowfd, flags);
+			PIPES_TRACEPOINT_EXEC(pid, pid == -1 ? errno : 0);
+			break;
+
+		case PIPES_SPAWN_SERVER:
+			pid = pipes_spawner_spawn(path, argv, envp, limits, infd, outfd, errfd, map, nmap);
+			PIPES_TRACEPOINT_EXEC(pid, pid == -1 ? errno : 0);
+			break;
+
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+
+	if (pid > 0 && (flags & PIPES_ATTR_PIDFD) && *pidfd < 0) {
+		// The spawn server, posix_spawn() and fork() without clone3() can't
+		// hand out a pidfd with the process. Opening it from the pid is
+		// racy: another thread calling wait() or waitpid(-1) (or SIGCHLD
+		// being ignored) can reap the child, and the pid can be reused
+		// before this. Not having pidfd support is not an error, the wait
+		// functions fall back to waitpid().
+		*pidfd = pipes_pidfd_open(pid);
+	}
+
+	return pid;
+}
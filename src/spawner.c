@@ -0,0 +1,776 @@
+#define _POSIX_SOURCE
+#define _GNU_SOURCE
+
+#include "internal.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#	include <sched.h>
+#	include <sys/syscall.h>
+#endif
+
+#ifdef __APPLE__
+#	include <crt_externs.h>
+#	define environ (*_NSGetEnviron())
+#else
+	extern char **environ;
+#endif
+
+#ifndef O_PATH
+#	define O_PATH O_RDONLY
+#endif
+
+/* The spawn server is a child of the calling process that is forked once by
+ * pipes_spawner_start(), while the calling process is still small. For each
+ * spawn it receives argv, the environment, the standard streams, the
+ * working directory and optionally limits and more file descriptors over a
+ * unix socket and clones the
+ * new process with CLONE_PARENT, so the new process is a child of the
+ * calling process and can be waited for as usual. */
+
+#define PIPES_SPAWNER_STDIN  0x1
+#define PIPES_SPAWNER_STDOUT 0x2
+#define PIPES_SPAWNER_STDERR 0x4
+#define PIPES_SPAWNER_CWD    0x8
+#define PIPES_SPAWNER_CGROUP 0x10
+#define PIPES_SPAWNER_MAXFDS 5
+
+// the strings start with the path of the executable
+#define PIPES_SPAWNER_PATH   0x100
+
+// the payload starts with struct pipes_spawner_limits, followed by the
+// rlimits and the CPU mask
+#define PIPES_SPAWNER_LIMITS 0x200
+
+// more file descriptors follow the flagged ones and the payload continues
+// with their number and targets as uint32_t values
+#define PIPES_SPAWNER_FDMAP  0x400
+
+struct pipes_spawner_request {
+	uint32_t size; // bytes of the payload (limits and strings) that follows
+	uint32_t argc;
+	uint32_t envc;
+	uint32_t fds;  // PIPES_SPAWNER_* flags of the passed file descriptors, path and limits
+};
+
+// The server is a fork of the calling process, so struct pipes_rlimit can be
+// sent as is.
+struct pipes_spawner_limits {
+	int32_t  flags; // PIPES_LIMITS_NICE and PIPES_LIMITS_IOPRIO
+	int32_t  nice;
+	int32_t  ioprio;
+	uint32_t nrlimits;
+	uint32_t cpus_size;
+};
+
+struct pipes_spawner_reply {
+	int32_t pid;
+	int32_t errnum;
+};
+
+static pthread_mutex_t pipes_spawner_lock = PTHREAD_MUTEX_INITIALIZER;
+static int   pipes_spawner_fd  = -1;
+static pid_t pipes_spawner_pid_ = -1;
+
+static int pipes_send_all(int fd, void const *buf, size_t size) {
+	char const *ptr = buf;
+
+	while (size > 0) {
+		ssize_t count = send(fd, ptr, size, MSG_NOSIGNAL);
+
+		if (count == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		ptr  += count;
+		size -= (size_t)count;
+	}
+
+	return 0;
+}
+
+static int pipes_recv_all(int fd, void *buf, size_t size) {
+	char *ptr = buf;
+
+	while (size > 0) {
+		ssize_t count = recv(fd, ptr, size, 0);
+
+		if (count == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		if (count == 0) {
+			errno = EPIPE;
+			return -1;
+		}
+
+		ptr  += count;
+		size -= (size_t)count;
+	}
+
+	return 0;
+}
+
+#ifdef __linux__
+static void pipes_spawner_close_fds(int keep) {
+#ifdef SYS_close_range
+	if ((keep <= 3 || syscall(SYS_close_range, 3, keep - 1, 0) == 0) &&
+	    syscall(SYS_close_range, keep + 1, ~0U, 0) == 0) {
+		return;
+	}
+#endif
+	const long maxfd = sysconf(_SC_OPEN_MAX);
+	for (long fd = 3; fd < maxfd; ++ fd) {
+		if (fd != keep) {
+			close((int)fd);
+		}
+	}
+}
+
+// Runs in the cloned process. Never returns.
+static void pipes_spawner_exec(char const* path, char *argv[], char *envp[], int const fds[],
+                               struct pipes_fdmap const map[], size_t nmap, struct pipes_limits const* limits,
+                               int status) {
+	int moved[PIPES_MAX_FDMAP];
+	const int lowfd = pipes_fdmap_check(map, nmap);
+
+	if (lowfd == -1 || pipes_redirect_map_prepare(map, nmap, lowfd, moved) == -1) goto error;
+
+	for (int index = 0; index < 3; ++ index) {
+		if (fds[index] > -1) {
+			if (dup2(fds[index], index) == -1) goto error;
+		}
+		else {
+			close(index);
+		}
+	}
+
+	if (fds[3] > -1 && fchdir(fds[3]) == -1) goto error;
+
+	// the working directory might be one of the targets
+	if (pipes_redirect_map(map, nmap, moved) == -1) goto error;
+
+	if (limits && pipes_limits_apply(limits) == -1) goto error;
+
+	environ = envp;
+	if (path) {
+		execve(path, argv, envp);
+	}
+	// see pipes_spawn_fork()
+	execvp(argv[0], argv);
+
+error:
+	(void)0;
+	int errnum = errno;
+	while (write(status, &errnum, sizeof(errnum)) == -1 && errno == EINTR);
+	_exit(127);
+}
+
+static struct pipes_spawner_reply pipes_spawner_clone(char const* path, char *argv[], char *envp[], int const fds[],
+                                                      struct pipes_fdmap const map[], size_t nmap,
+                                                      struct pipes_limits const* limits) {
+	struct pipes_spawner_reply reply = { -1, 0 };
+	int status[2];
+
+	// The status pipe is closed on a successful exec, otherwise it
+	// transports the errno of the failed exec.
+	if (pipe2(status, O_CLOEXEC) == -1) {
+		reply.errnum = errno;
+		return reply;
+	}
+
+	// keep the write end out of the way of the mapped file descriptors
+	const int lowfd = pipes_fdmap_check(map, nmap);
+	if (lowfd == -1 || status[1] < lowfd) {
+		const int fd = lowfd == -1 ? -1 : fcntl(status[1], F_DUPFD_CLOEXEC, lowfd);
+		const int errnum = errno;
+
+		close(status[1]);
+
+		if (fd == -1) {
+			close(status[0]);
+			reply.errnum = errnum;
+			return reply;
+		}
+
+		status[1] = fd;
+	}
+
+	// Like fork(), but the new process becomes a sibling of the spawn
+	// server, i.e. a child of the process that started the server.
+	pid_t pid = pipes_clone(CLONE_PARENT, fds[4], NULL);
+
+	if (pid == 0) {
+		close(status[0]);
+		pipes_spawner_exec(path, argv, envp, fds, map, nmap, limits, status[1]);
+	}
+
+	close(status[1]);
+
+	if (pid == -1) {
+		reply.errnum = errno;
+	}
+	else {
+		int errnum = 0;
+		ssize_t count;
+
+		do {
+			count = read(status[0], &errnum, sizeof(errnum));
+		} while (count == -1 && errno == EINTR);
+
+		reply.pid    = pid;
+		reply.errnum = count == (ssize_t)sizeof(errnum) ? errnum : 0;
+	}
+
+	close(status[0]);
+
+	return reply;
+}
+
+static int pipes_spawner_handle(int sock) {
+	struct pipes_spawner_request request;
+	struct pipes_spawner_reply reply = { -1, 0 };
+	int fds[] = {-1, -1, -1, -1, -1};
+	struct pipes_fdmap map[PIPES_MAX_FDMAP];
+	size_t nmap   = 0;
+	char *strings = NULL;
+	char **argv   = NULL;
+	char **envp   = NULL;
+	int status    = -1;
+
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * (PIPES_SPAWNER_MAXFDS + PIPES_MAX_FDMAP))];
+		struct cmsghdr align;
+	} control;
+
+	struct iovec iov = { &request, sizeof(request) };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	ssize_t count;
+	do {
+		count = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (count == -1 && errno == EINTR);
+
+	if (count <= 0) {
+		// the calling process closed the socket or exited
+		return -1;
+	}
+
+	// the file descriptors come with the first byte
+	int received[PIPES_SPAWNER_MAXFDS + PIPES_MAX_FDMAP];
+	size_t nfds = 0;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			size_t size = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			if (size > PIPES_SPAWNER_MAXFDS + PIPES_MAX_FDMAP - nfds) {
+				size = PIPES_SPAWNER_MAXFDS + PIPES_MAX_FDMAP - nfds;
+			}
+			memcpy(received + nfds, CMSG_DATA(cmsg), size * sizeof(int));
+			nfds += size;
+		}
+	}
+
+	if ((size_t)count < sizeof(request) &&
+	    pipes_recv_all(sock, (char*)&request + count, sizeof(request) - (size_t)count) == -1) {
+		for (size_t index = 0; index < nfds; ++ index) {
+			close(received[index]);
+		}
+		return -1;
+	}
+
+	size_t next = 0;
+	for (int index = 0; index < PIPES_SPAWNER_MAXFDS; ++ index) {
+		if ((request.fds & (1u << index)) && next < nfds) {
+			fds[index] = received[next ++];
+		}
+	}
+
+	// the rest are the mapped file descriptors, their targets come later
+	if (request.fds & PIPES_SPAWNER_FDMAP) {
+		while (next < nfds && nmap < PIPES_MAX_FDMAP) {
+			map[nmap ++].fd = received[next ++];
+		}
+	}
+
+	// more file descriptors than announced
+	while (next < nfds) {
+		close(received[next ++]);
+	}
+
+	strings = malloc(request.size + 1);
+	argv    = calloc(request.argc + 1, sizeof(char*));
+	envp    = calloc(request.envc + 1, sizeof(char*));
+
+	if (strings == NULL || argv == NULL || envp == NULL) {
+		// can't skip the strings, so the stream would be out of sync
+		goto cleanup;
+	}
+
+	if (pipes_recv_all(sock, strings, request.size) == -1) {
+		goto cleanup;
+	}
+	strings[request.size] = 0;
+
+	char *ptr  = strings;
+	char *end  = strings + request.size;
+	char *path = NULL;
+
+	struct pipes_rlimit rlimits[PIPES_MAX_RLIMITS];
+	struct pipes_limits limits = PIPES_LIMITS_INIT;
+
+	if (request.fds & PIPES_SPAWNER_LIMITS) {
+		struct pipes_spawner_limits header;
+
+		if (request.size < sizeof(header)) {
+			reply.errnum = EINVAL;
+			goto reply;
+		}
+
+		memcpy(&header, ptr, sizeof(header));
+		ptr += sizeof(header);
+
+		if (header.nrlimits > PIPES_MAX_RLIMITS || header.cpus_size > PIPES_MAX_CPUS_SIZE ||
+		    (size_t)(end - ptr) < header.nrlimits * sizeof(struct pipes_rlimit) + header.cpus_size) {
+			reply.errnum = EINVAL;
+			goto reply;
+		}
+
+		// copied, because the payload isn't aligned
+		memcpy(rlimits, ptr, header.nrlimits * sizeof(struct pipes_rlimit));
+		ptr += header.nrlimits * sizeof(struct pipes_rlimit);
+
+		limits.flags     = header.flags & (PIPES_LIMITS_NICE | PIPES_LIMITS_IOPRIO);
+		limits.nice      = header.nice;
+		limits.ioprio    = header.ioprio;
+		limits.rlimits   = rlimits;
+		limits.nrlimits  = header.nrlimits;
+		limits.cpus      = header.cpus_size ? ptr : NULL;
+		limits.cpus_size = header.cpus_size;
+		ptr += header.cpus_size;
+	}
+
+	if (request.fds & PIPES_SPAWNER_FDMAP) {
+		uint32_t count = 0;
+
+		if ((size_t)(end - ptr) < sizeof(count)) {
+			reply.errnum = EINVAL;
+			goto reply;
+		}
+
+		memcpy(&count, ptr, sizeof(count));
+		ptr += sizeof(count);
+
+		if (count != nmap || (size_t)(end - ptr) < count * sizeof(uint32_t)) {
+			reply.errnum = EINVAL;
+			goto reply;
+		}
+
+		for (size_t index = 0; index < nmap; ++ index) {
+			uint32_t target;
+			memcpy(&target, ptr, sizeof(target));
+			ptr += sizeof(target);
+			map[index].target = target > INT32_MAX ? -1 : (int)target;
+		}
+	}
+
+	if (request.fds & PIPES_SPAWNER_PATH) {
+		path = ptr;
+		ptr += strlen(ptr) + 1;
+	}
+
+	for (uint32_t index = 0; index < request.argc + request.envc; ++ index) {
+		if (ptr >= end) {
+			reply.errnum = EINVAL;
+			goto reply;
+		}
+
+		if (index < request.argc) {
+			argv[index] = ptr;
+		}
+		else {
+			envp[index - request.argc] = ptr;
+		}
+
+		ptr += strlen(ptr) + 1;
+	}
+
+	if (request.argc == 0 || (request.fds & PIPES_SPAWNER_CWD && fds[3] < 0) ||
+	    (request.fds & PIPES_SPAWNER_CGROUP && fds[4] < 0) || (path && !*path)) {
+		reply.errnum = EINVAL;
+		goto reply;
+	}
+
+	reply = pipes_spawner_clone(path, argv, envp, fds, map, nmap,
+	                            request.fds & PIPES_SPAWNER_LIMITS ? &limits : NULL);
+
+reply:
+	status = pipes_send_all(sock, &reply, sizeof(reply));
+
+cleanup:
+	for (int index = 0; index < PIPES_SPAWNER_MAXFDS; ++ index) {
+		if (fds[index] > -1) {
+			close(fds[index]);
+		}
+	}
+
+	for (size_t index = 0; index < nmap; ++ index) {
+		close(map[index].fd);
+	}
+
+	free(strings);
+	free(argv);
+	free(envp);
+
+	return status;
+}
+
+static void pipes_spawner_serve(int sock) {
+	// Don't hold on to the streams of the calling process, e.g. a pipe the
+	// calling process writes to would otherwise never see end of file.
+	int null = open("/dev/null", O_RDWR);
+	if (null > -1) {
+		for (int fd = 0; fd < 3; ++ fd) {
+			if (fd != null) {
+				dup2(null, fd);
+			}
+		}
+
+		if (null > 2) {
+			close(null);
+		}
+	}
+
+	if (sock < 3) {
+		int fd = fcntl(sock, F_DUPFD_CLOEXEC, 3);
+		if (fd == -1) {
+			_exit(EXIT_FAILURE);
+		}
+		sock = fd;
+	}
+
+	pipes_spawner_close_fds(sock);
+
+	while (pipes_spawner_handle(sock) == 0);
+
+	_exit(EXIT_SUCCESS);
+}
+#endif
+
+int pipes_spawner_start(void) {
+#ifdef __linux__
+	pthread_mutex_lock(&pipes_spawner_lock);
+
+	if (pipes_spawner_fd > -1) {
+		pthread_mutex_unlock(&pipes_spawner_lock);
+		return 0;
+	}
+
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+		int errnum = errno;
+		pthread_mutex_unlock(&pipes_spawner_lock);
+		errno = errnum;
+		return -1;
+	}
+
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		close(sv[0]);
+		pipes_spawner_serve(sv[1]);
+	}
+
+	int errnum = errno;
+	close(sv[1]);
+
+	if (pid == -1) {
+		close(sv[0]);
+		pthread_mutex_unlock(&pipes_spawner_lock);
+		errno = errnum;
+		return -1;
+	}
+
+	pipes_spawner_fd   = sv[0];
+	pipes_spawner_pid_ = pid;
+
+	pthread_mutex_unlock(&pipes_spawner_lock);
+
+	return 0;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+// expects pipes_spawner_lock to be held
+static int pipes_spawner_shutdown(void) {
+	if (pipes_spawner_fd < 0) {
+		return 0;
+	}
+
+	close(pipes_spawner_fd);
+	pipes_spawner_fd = -1;
+
+	// the server exits when it reads end of file
+	pid_t pid = pipes_spawner_pid_;
+	pipes_spawner_pid_ = -1;
+
+	pid_t result;
+	do {
+		result = waitpid(pid, NULL, 0);
+	} while (result == -1 && errno == EINTR);
+
+	return result == -1 && errno != ECHILD ? -1 : 0;
+}
+
+int pipes_spawner_stop(void) {
+	pthread_mutex_lock(&pipes_spawner_lock);
+	int status = pipes_spawner_shutdown();
+	int errnum = errno;
+	pthread_mutex_unlock(&pipes_spawner_lock);
+
+	if (status != 0) {
+		errno = errnum;
+	}
+
+	return status;
+}
+
+pid_t pipes_spawner_pid(void) {
+	pthread_mutex_lock(&pipes_spawner_lock);
+	pid_t pid = pipes_spawner_pid_;
+	pthread_mutex_unlock(&pipes_spawner_lock);
+
+	return pid;
+}
+
+static int pipes_fd_valid(int fd) {
+	return fcntl(fd, F_GETFD) != -1;
+}
+
+pid_t pipes_spawner_spawn(char const* path, char const *const argv[], char const *const envp[],
+                          struct pipes_limits const* limits, int infd, int outfd, int errfd,
+                          struct pipes_fdmap const map[], size_t nmap) {
+	// Resolve the redirections the same way the fork backend does them, but
+	// with the standard streams of the calling process as the defaults.
+	const int in  = infd  > -1 ? infd : STDIN_FILENO;
+	const int out = outfd == PIPES_TO_STDERR ? STDERR_FILENO : outfd > -1 ? outfd : STDOUT_FILENO;
+	const int err = errfd == PIPES_TO_STDOUT ? out : errfd > -1 ? errfd : STDERR_FILENO;
+
+	struct pipes_spawner_request request = { 0, 0, 0, 0 };
+	int fds[PIPES_SPAWNER_MAXFDS + PIPES_MAX_FDMAP];
+	int nfds = 0;
+
+	const int stdfds[] = {in, out, err};
+	for (int index = 0; index < 3; ++ index) {
+		// a closed standard stream stays closed in the child
+		if (pipes_fd_valid(stdfds[index])) {
+			fds[nfds ++]  = stdfds[index];
+			request.fds  |= 1u << index;
+		}
+	}
+
+	int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (cwd > -1) {
+		fds[nfds ++]  = cwd;
+		request.fds  |= PIPES_SPAWNER_CWD;
+	}
+
+	if (limits && (limits->flags & PIPES_LIMITS_CGROUP)) {
+		fds[nfds ++]  = limits->cgroupfd;
+		request.fds  |= PIPES_SPAWNER_CGROUP;
+	}
+
+	// checked by pipes_spawn(), so they fit
+	for (size_t index = 0; index < nmap; ++ index) {
+		fds[nfds ++] = map[index].fd;
+	}
+
+	if (envp == NULL) {
+		envp = (char const *const*)environ;
+	}
+
+	size_t size = 0;
+	if (limits) {
+		size += sizeof(struct pipes_spawner_limits) + limits->nrlimits * sizeof(struct pipes_rlimit) +
+		        limits->cpus_size * (limits->cpus != NULL);
+		request.fds |= PIPES_SPAWNER_LIMITS;
+	}
+
+	if (nmap > 0) {
+		size += sizeof(uint32_t) * (nmap + 1);
+		request.fds |= PIPES_SPAWNER_FDMAP;
+	}
+
+	if (path) {
+		size += strlen(path) + 1;
+		request.fds |= PIPES_SPAWNER_PATH;
+	}
+
+	for (char const *const* ptr = argv; *ptr; ++ ptr) {
+		size += strlen(*ptr) + 1;
+		++ request.argc;
+	}
+
+	for (char const *const* ptr = envp; ptr && *ptr; ++ ptr) {
+		size += strlen(*ptr) + 1;
+		++ request.envc;
+	}
+
+	pid_t pid = -1;
+	int errnum = 0;
+	char *strings = malloc(size ? size : 1);
+
+	if (strings == NULL || size > UINT32_MAX) {
+		errnum = strings ? E2BIG : ENOMEM;
+		goto cleanup;
+	}
+
+	request.size = (uint32_t)size;
+
+	char *ptr = strings;
+	if (limits) {
+		struct pipes_spawner_limits header = {
+			limits->flags & (PIPES_LIMITS_NICE | PIPES_LIMITS_IOPRIO),
+			limits->nice, limits->ioprio, (uint32_t)limits->nrlimits,
+			limits->cpus ? (uint32_t)limits->cpus_size : 0
+		};
+
+		memcpy(ptr, &header, sizeof(header));
+		ptr += sizeof(header);
+
+		if (limits->nrlimits > 0) {
+			memcpy(ptr, limits->rlimits, limits->nrlimits * sizeof(struct pipes_rlimit));
+			ptr += limits->nrlimits * sizeof(struct pipes_rlimit);
+		}
+
+		if (limits->cpus) {
+			memcpy(ptr, limits->cpus, limits->cpus_size);
+			ptr += limits->cpus_size;
+		}
+	}
+
+	if (nmap > 0) {
+		const uint32_t count = (uint32_t)nmap;
+		memcpy(ptr, &count, sizeof(count));
+		ptr += sizeof(count);
+
+		for (size_t index = 0; index < nmap; ++ index) {
+			const uint32_t target = (uint32_t)map[index].target;
+			memcpy(ptr, &target, sizeof(target));
+			ptr += sizeof(target);
+		}
+	}
+
+	if (path) {
+		const size_t len = strlen(path) + 1;
+		memcpy(ptr, path, len);
+		ptr += len;
+	}
+
+	for (char const *const* arg = argv; *arg; ++ arg) {
+		const size_t len = strlen(*arg) + 1;
+		memcpy(ptr, *arg, len);
+		ptr += len;
+	}
+
+	for (char const *const* var = envp; var && *var; ++ var) {
+		const size_t len = strlen(*var) + 1;
+		memcpy(ptr, *var, len);
+		ptr += len;
+	}
+
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * (PIPES_SPAWNER_MAXFDS + PIPES_MAX_FDMAP))];
+		struct cmsghdr align;
+	} control;
+	memset(&control, 0, sizeof(control));
+
+	struct iovec iov = { &request, sizeof(request) };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov    = &iov;
+	msg.msg_iovlen = 1;
+
+	if (nfds > 0) {
+		msg.msg_control    = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)nfds);
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type  = SCM_RIGHTS;
+		cmsg->cmsg_len   = CMSG_LEN(sizeof(int) * (size_t)nfds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * (size_t)nfds);
+	}
+
+	struct pipes_spawner_reply reply = { -1, 0 };
+
+	pthread_mutex_lock(&pipes_spawner_lock);
+
+	if (pipes_spawner_fd < 0) {
+		pthread_mutex_unlock(&pipes_spawner_lock);
+		errnum = ENOTCONN;
+		goto cleanup;
+	}
+
+	ssize_t count;
+	do {
+		count = sendmsg(pipes_spawner_fd, &msg, MSG_NOSIGNAL);
+	} while (count == -1 && errno == EINTR);
+
+	if (count == -1 ||
+	    pipes_send_all(pipes_spawner_fd, (char*)&request + count, sizeof(request) - (size_t)count) == -1 ||
+	    pipes_send_all(pipes_spawner_fd, strings, size) == -1 ||
+	    pipes_recv_all(pipes_spawner_fd, &reply, sizeof(reply)) == -1) {
+		// The server is gone or the stream is out of sync. Either way it
+		// can't be used anymore.
+		pipes_spawner_shutdown();
+		pthread_mutex_unlock(&pipes_spawner_lock);
+		errnum = ENOTCONN;
+		goto cleanup;
+	}
+
+	pthread_mutex_unlock(&pipes_spawner_lock);
+
+	if (reply.errnum != 0) {
+		errnum = reply.errnum;
+
+		if (reply.pid > 0) {
+			// exec failed, the process is our child and needs to be reaped
+			while (waitpid(reply.pid, NULL, 0) == -1 && errno == EINTR);
+		}
+	}
+	else {
+		pid = reply.pid;
+	}
+
+cleanup:
+	if (cwd > -1) {
+		close(cwd);
+	}
+
+	free(strings);
+
+	if (errnum != 0) {
+		errno = errnum;
+	}
+
+	return pid;
+}
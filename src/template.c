@@ -0,0 +1,296 @@
+#define _POSIX_SOURCE
+#define _GNU_SOURCE
+
+#include "pipes.h"
+#include "internal.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifndef PATH_MAX
+#	define PATH_MAX 4096
+#endif
+
+struct pipes_template {
+	size_t count;                  // number of stages
+	size_t pool_size;
+	struct pipes_chain *chain;     // count + 1 stages to copy into instances
+	struct pipes_attr attr;
+	int has_attr;
+	struct pipes_attr *attrs;      // copies of the per stage attributes
+	char const **paths;            // resolved executables
+	char const **vectors;          // argv and envp arrays of all stages
+	char *strings;                 // all strings of vectors and paths
+
+	struct pipes_chain *instances; // pool_size * (count + 1) stages
+	int (*fds)[3];                 // pool_size * count
+	size_t *unused;                // stack of unused instance indices
+	size_t nunused;
+	pthread_mutex_t lock;
+};
+
+static size_t pipes_vector_count(char const *const vector[]) {
+	size_t count = 0;
+	while (vector && vector[count]) ++ count;
+	return count;
+}
+
+// Copy the NULL terminated vector to *vectors and its strings to *strings
+// and advance both.
+static char const** pipes_vector_copy(char const *const vector[], char const ***vectors, char **strings) {
+	if (vector == NULL) {
+		return NULL;
+	}
+
+	char const** copy = *vectors;
+
+	for (size_t index = 0; vector[index]; ++ index) {
+		const size_t len = strlen(vector[index]) + 1;
+
+		memcpy(*strings, vector[index], len);
+		copy[index] = *strings;
+		*strings += len;
+	}
+
+	copy[pipes_vector_count(vector)] = NULL;
+	*vectors += pipes_vector_count(vector) + 1;
+
+	return copy;
+}
+
+static int pipes_template_check(struct pipes const* pipes) {
+	// Actual file descriptors would be closed by the first instance and all
+	// instances would share the array of extra file descriptors.
+	return pipes->infd < -1 && pipes->outfd < -1 && pipes->errfd < -1 && pipes->nfds == 0;
+}
+
+struct pipes_template* pipes_template_new(struct pipes_chain const chain[], struct pipes_attr const* attr,
+                                          size_t pool_size) {
+	size_t count    = 0;
+	size_t nvectors = 0;
+	size_t size     = 0;
+	int errnum      = 0;
+
+	if (chain == NULL || chain[0].argv == NULL || pool_size == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	for (; chain[count].argv; ++ count) {
+		struct pipes_chain const* stage = &chain[count];
+
+		if ((stage->fn == NULL && stage->argv[0] == NULL) || !pipes_template_check(&stage->pipes) ||
+		    (count > 0 && stage->pipes.infd == PIPES_PIPE && chain[count - 1].pipes.outfd != PIPES_PIPE)) {
+			errno = EINVAL;
+			return NULL;
+		}
+
+		nvectors += pipes_vector_count(stage->argv) + 1;
+		for (char const *const* arg = stage->argv; *arg; ++ arg) {
+			size += strlen(*arg) + 1;
+		}
+
+		if (stage->envp) {
+			nvectors += pipes_vector_count(stage->envp) + 1;
+			for (char const *const* var = stage->envp; *var; ++ var) {
+				size += strlen(*var) + 1;
+			}
+		}
+	}
+
+	if (pool_size > SIZE_MAX / (count + 1) / sizeof(struct pipes_chain)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	struct pipes_template* tmpl = calloc(1, sizeof(struct pipes_template));
+
+	if (tmpl == NULL) {
+		return NULL;
+	}
+
+	tmpl->count     = count;
+	tmpl->pool_size = pool_size;
+
+	if (attr) {
+		tmpl->attr     = *attr;
+		tmpl->has_attr = 1;
+	}
+
+	tmpl->chain     = calloc(count + 1, sizeof(struct pipes_chain));
+	tmpl->attrs     = calloc(count, sizeof(struct pipes_attr));
+	tmpl->paths     = calloc(count, sizeof(char const*));
+	tmpl->vectors   = calloc(nvectors, sizeof(char const*));
+	tmpl->strings   = malloc(size + count * PATH_MAX);
+	tmpl->instances = calloc(pool_size * (count + 1), sizeof(struct pipes_chain));
+	tmpl->fds       = calloc(pool_size * count, sizeof(*tmpl->fds));
+	tmpl->unused    = calloc(pool_size, sizeof(size_t));
+
+	if (tmpl->chain == NULL || tmpl->attrs == NULL || tmpl->paths == NULL || tmpl->vectors == NULL ||
+	    tmpl->strings == NULL || tmpl->instances == NULL || tmpl->fds == NULL || tmpl->unused == NULL) {
+		goto error;
+	}
+
+	char const **vectors = tmpl->vectors;
+	char *strings = tmpl->strings;
+
+	for (size_t index = 0; index <= count; ++ index) {
+		struct pipes_chain *stage = &tmpl->chain[index];
+
+		stage->pipes = chain[index].pipes;
+		stage->pipes.pid   = -1;
+		stage->pipes.pidfd = -1;
+
+		if (index == count) {
+			break;
+		}
+
+		stage->argv = pipes_vector_copy(chain[index].argv, &vectors, &strings);
+		stage->envp = pipes_vector_copy(chain[index].envp, &vectors, &strings);
+		stage->fn   = chain[index].fn;
+		stage->ctx  = chain[index].ctx;
+
+		if (chain[index].attr) {
+			tmpl->attrs[index] = *chain[index].attr;
+			stage->attr = &tmpl->attrs[index];
+		}
+	}
+
+	// Resolve the executables now, so the children don't have to search
+	// PATH. This also fails early for commands that don't exist.
+	for (size_t index = 0; index < count; ++ index) {
+		struct pipes_chain *stage = &tmpl->chain[index];
+
+		if (stage->fn) {
+			continue;
+		}
+
+		if (pipes_find_executable(stage->argv[0], pipes_search_path(stage->envp), strings, PATH_MAX) == -1) {
+			goto error;
+		}
+
+		tmpl->paths[index] = strings;
+		strings += strlen(strings) + 1;
+	}
+
+	for (size_t index = 0; index < pool_size; ++ index) {
+		tmpl->unused[index] = pool_size - index - 1;
+	}
+	tmpl->nunused = pool_size;
+
+	errnum = pthread_mutex_init(&tmpl->lock, NULL);
+	if (errnum != 0) {
+		errno = errnum;
+		goto error;
+	}
+
+	return tmpl;
+
+error:
+	errnum = errno;
+
+	free(tmpl->chain);
+	free(tmpl->attrs);
+	free(tmpl->paths);
+	free(tmpl->vectors);
+	free(tmpl->strings);
+	free(tmpl->instances);
+	free(tmpl->fds);
+	free(tmpl->unused);
+	free(tmpl);
+
+	errno = errnum;
+
+	return NULL;
+}
+
+void pipes_template_free(struct pipes_template* tmpl) {
+	if (tmpl == NULL) {
+		return;
+	}
+
+	pthread_mutex_destroy(&tmpl->lock);
+
+	free(tmpl->chain);
+	free(tmpl->attrs);
+	free(tmpl->paths);
+	free(tmpl->vectors);
+	free(tmpl->strings);
+	free(tmpl->instances);
+	free(tmpl->fds);
+	free(tmpl->unused);
+	free(tmpl);
+}
+
+struct pipes_chain* pipes_template_open(struct pipes_template* tmpl) {
+	pthread_mutex_lock(&tmpl->lock);
+
+	if (tmpl->nunused == 0) {
+		pthread_mutex_unlock(&tmpl->lock);
+		errno = EAGAIN;
+		return NULL;
+	}
+
+	const size_t index = tmpl->unused[-- tmpl->nunused];
+
+	pthread_mutex_unlock(&tmpl->lock);
+
+	struct pipes_chain *chain = &tmpl->instances[index * (tmpl->count + 1)];
+
+	memcpy(chain, tmpl->chain, (tmpl->count + 1) * sizeof(struct pipes_chain));
+
+	if (pipes_open_stages(chain, tmpl->count, tmpl->has_attr ? &tmpl->attr : NULL,
+	                      tmpl->paths, &tmpl->fds[index * tmpl->count]) == -1) {
+		const int errnum = errno;
+
+		pthread_mutex_lock(&tmpl->lock);
+		tmpl->unused[tmpl->nunused ++] = index;
+		pthread_mutex_unlock(&tmpl->lock);
+
+		errno = errnum;
+		return NULL;
+	}
+
+	return chain;
+}
+
+int pipes_template_release(struct pipes_template* tmpl, struct pipes_chain chain[]) {
+	const size_t stride = tmpl->count + 1;
+
+	// released instances have no stages until they are opened again
+	if (chain < tmpl->instances || chain >= tmpl->instances + tmpl->pool_size * stride ||
+	    (size_t)(chain - tmpl->instances) % stride != 0 || chain->argv == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	const size_t index = (size_t)(chain - tmpl->instances) / stride;
+	int status = 0;
+	int errnum = 0;
+
+	if (pipes_close_chain(chain) == -1) {
+		status = -1;
+		errnum = errno;
+	}
+
+	if (pipes_wait_chain(chain, NULL) == -1 && status == 0) {
+		status = -1;
+		errnum = errno;
+	}
+
+	chain->argv = NULL;
+
+	pthread_mutex_lock(&tmpl->lock);
+	tmpl->unused[tmpl->nunused ++] = index;
+	pthread_mutex_unlock(&tmpl->lock);
+
+	if (status == -1) {
+		errno = errnum;
+	}
+
+	return status;
+}
@@ -0,0 +1,288 @@
+#define _POSIX_SOURCE
+#define _GNU_SOURCE
+
+#include "internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#	include <sched.h>
+#endif
+
+#define PIPES_CPU_BITS (8 * sizeof(unsigned long))
+
+// A set of CPUs that share their last level cache.
+struct pipes_cpu_group {
+	size_t offset; // into pipes_topology.cpus
+	size_t count;
+	int node;
+	int rank;      // index of the group within its node
+};
+
+static struct {
+	int    cpus[PIPES_MAX_CPUS];
+	struct pipes_cpu_group groups[PIPES_MAX_CPUS];
+	size_t ngroups;
+} pipes_topology;
+
+static pthread_once_t pipes_topology_once = PTHREAD_ONCE_INIT;
+static unsigned long pipes_topology_next = 0;
+
+static void pipes_mask_set(unsigned long mask[], int cpu) {
+	mask[(size_t)cpu / PIPES_CPU_BITS] |= 1UL << ((size_t)cpu % PIPES_CPU_BITS);
+}
+
+static int pipes_mask_isset(unsigned long const mask[], int cpu) {
+	return (mask[(size_t)cpu / PIPES_CPU_BITS] >> ((size_t)cpu % PIPES_CPU_BITS)) & 1;
+}
+
+#ifdef __linux__
+static int pipes_read_sysfs(char const* path, char* buf, size_t size) {
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd == -1) {
+		return -1;
+	}
+
+	ssize_t count;
+	do {
+		count = read(fd, buf, size - 1);
+	} while (count == -1 && errno == EINTR);
+
+	close(fd);
+
+	if (count < 0) {
+		return -1;
+	}
+
+	buf[count] = 0;
+
+	return 0;
+}
+
+// Parse a list like "0-3,8-11" as used by sysfs into mask.
+static int pipes_parse_cpulist(char const* list, unsigned long mask[]) {
+	memset(mask, 0, PIPES_MAX_CPUS / 8);
+
+	while (*list && *list != '\n') {
+		char *end = NULL;
+		const long first = strtol(list, &end, 10);
+		long last = first;
+
+		if (end == list) {
+			return -1;
+		}
+
+		if (*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+
+			if (end == list) {
+				return -1;
+			}
+		}
+
+		for (long cpu = first; cpu <= last && cpu < PIPES_MAX_CPUS; ++ cpu) {
+			if (cpu >= 0) {
+				pipes_mask_set(mask, (int)cpu);
+			}
+		}
+
+		list = *end == ',' ? end + 1 : end;
+	}
+
+	return 0;
+}
+
+static int pipes_read_cpulist(char const* path, unsigned long mask[]) {
+	char buf[4096];
+
+	if (pipes_read_sysfs(path, buf, sizeof(buf)) == -1) {
+		return -1;
+	}
+
+	return pipes_parse_cpulist(buf, mask);
+}
+
+// The CPUs that share the cache of the highest level with cpu.
+static int pipes_read_llc(int cpu, unsigned long mask[]) {
+	char path[128];
+	char buf[32];
+	long level = 0;
+
+	for (int index = 0;; ++ index) {
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+
+		if (pipes_read_sysfs(path, buf, sizeof(buf)) == -1) {
+			break;
+		}
+
+		const long value = strtol(buf, NULL, 10);
+
+		if (value >= level) {
+			snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+
+			if (pipes_read_cpulist(path, mask) == 0) {
+				level = value;
+			}
+		}
+	}
+
+	return level > 0 ? 0 : -1;
+}
+
+static void pipes_topology_add_group(unsigned long const members[], unsigned long const allowed[],
+                                     int node, size_t *ncpus) {
+	struct pipes_cpu_group *group = &pipes_topology.groups[pipes_topology.ngroups];
+	group->offset = *ncpus;
+	group->count  = 0;
+	group->node   = node;
+	group->rank   = 0;
+
+	for (int cpu = 0; cpu < PIPES_MAX_CPUS; ++ cpu) {
+		if (pipes_mask_isset(members, cpu) && pipes_mask_isset(allowed, cpu)) {
+			pipes_topology.cpus[(*ncpus) ++] = cpu;
+			++ group->count;
+		}
+	}
+
+	if (group->count > 0) {
+		for (size_t index = 0; index < pipes_topology.ngroups; ++ index) {
+			if (pipes_topology.groups[index].node == node) {
+				++ group->rank;
+			}
+		}
+		++ pipes_topology.ngroups;
+	}
+}
+
+static int pipes_group_compare(void const* lhs, void const* rhs) {
+	struct pipes_cpu_group const* a = lhs;
+	struct pipes_cpu_group const* b = rhs;
+
+	// interleave the nodes, so consecutive chains land on different nodes
+	if (a->rank != b->rank) return a->rank < b->rank ? -1 : 1;
+	if (a->node != b->node) return a->node < b->node ? -1 : 1;
+	return 0;
+}
+
+// Group the CPUs the process may run on by their last level cache.
+static void pipes_topology_init(void) {
+	unsigned long allowed[PIPES_MAX_CPUS / PIPES_CPU_BITS];
+	unsigned long assigned[PIPES_MAX_CPUS / PIPES_CPU_BITS];
+	unsigned long members[PIPES_MAX_CPUS / PIPES_CPU_BITS];
+	unsigned long mask[PIPES_MAX_CPUS / PIPES_CPU_BITS];
+	unsigned long nodes[PIPES_MAX_CPUS / PIPES_CPU_BITS];
+	int node_of[PIPES_MAX_CPUS];
+	char path[128];
+	size_t ncpus = 0;
+
+	memset(allowed, 0, sizeof(allowed));
+	if (sched_getaffinity(0, sizeof(allowed), (cpu_set_t*)allowed) == -1) {
+		return;
+	}
+
+	memset(node_of, 0, sizeof(node_of));
+
+	// without NUMA information everything is node 0
+	if (pipes_read_cpulist("/sys/devices/system/node/online", nodes) == -1) {
+		memset(nodes, 0, sizeof(nodes));
+	}
+
+	for (int node = 0; node < PIPES_MAX_CPUS; ++ node) {
+		if (!pipes_mask_isset(nodes, node)) {
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+		if (pipes_read_cpulist(path, mask) == -1) {
+			continue;
+		}
+
+		for (int cpu = 0; cpu < PIPES_MAX_CPUS; ++ cpu) {
+			if (pipes_mask_isset(mask, cpu)) {
+				node_of[cpu] = node;
+			}
+		}
+	}
+
+	memset(assigned, 0, sizeof(assigned));
+
+	for (int cpu = 0; cpu < PIPES_MAX_CPUS; ++ cpu) {
+		if (!pipes_mask_isset(allowed, cpu) || pipes_mask_isset(assigned, cpu)) {
+			continue;
+		}
+
+		if (pipes_read_llc(cpu, members) == -1) {
+			// no cache information, so group by node
+			memset(members, 0, sizeof(members));
+			for (int other = cpu; other < PIPES_MAX_CPUS; ++ other) {
+				if (node_of[other] == node_of[cpu]) {
+					pipes_mask_set(members, other);
+				}
+			}
+		}
+
+		pipes_mask_set(members, cpu);
+
+		for (size_t index = 0; index < sizeof(members) / sizeof(members[0]); ++ index) {
+			members[index] &= ~assigned[index];
+			assigned[index] |= members[index];
+		}
+
+		pipes_topology_add_group(members, allowed, node_of[cpu], &ncpus);
+	}
+
+	qsort(pipes_topology.groups, pipes_topology.ngroups, sizeof(struct pipes_cpu_group), pipes_group_compare);
+}
+#else
+static void pipes_topology_init(void) {
+	// no placement
+}
+#endif
+
+struct pipes_attr const* pipes_place_stage(struct pipes_placement* placement, struct pipes_attr const* attr) {
+	// explicit affinities win and posix_spawn() can't set them at all
+	if (attr == NULL || !(attr->flags & PIPES_ATTR_PLACE) || attr->spawn == PIPES_SPAWN_POSIX ||
+	    (attr->limits && attr->limits->cpus)) {
+		return attr;
+	}
+
+	pthread_once(&pipes_topology_once, pipes_topology_init);
+
+	if (pipes_topology.ngroups == 0) {
+		return attr;
+	}
+
+	// Every stage may run on all CPUs of the group, which keeps the data in
+	// the shared cache. Pinning stages to single CPUs would pile the stages
+	// of concurrent chains onto the same few cores.
+	if (placement->group == (size_t)-1) {
+		placement->group = __atomic_fetch_add(&pipes_topology_next, 1, __ATOMIC_RELAXED) % pipes_topology.ngroups;
+
+		struct pipes_cpu_group const* group = &pipes_topology.groups[placement->group];
+
+		memset(placement->cpus, 0, sizeof(placement->cpus));
+		for (size_t index = 0; index < group->count; ++ index) {
+			pipes_mask_set(placement->cpus, pipes_topology.cpus[group->offset + index]);
+		}
+	}
+
+	struct pipes_limits const init = PIPES_LIMITS_INIT;
+
+	placement->attr   = *attr;
+	placement->limits = attr->limits ? *attr->limits : init;
+
+	placement->limits.cpus      = placement->cpus;
+	placement->limits.cpus_size = sizeof(placement->cpus);
+	placement->attr.limits      = &placement->limits;
+
+	return &placement->attr;
+}
@@ -0,0 +1,73 @@
+#define _POSIX_SOURCE
+#define _GNU_SOURCE
+
+#include "pipes.h"
+#include "internal.h"
+
+#include <errno.h>
+#include <string.h>
+
+struct pipes_tracer pipes_tracer;
+
+#ifdef PIPES_USDT
+// The section is where the probe notes point to, the tracers find them there.
+#	define PIPES_USDT_SEMAPHORE_DEF(NAME) \
+		unsigned short pipes_##NAME##_semaphore __attribute__((unused)) __attribute__((section(".probes")))
+
+PIPES_USDT_SEMAPHORE_DEF(spawn);
+PIPES_USDT_SEMAPHORE_DEF(exec);
+PIPES_USDT_SEMAPHORE_DEF(exit);
+PIPES_USDT_SEMAPHORE_DEF(read);
+PIPES_USDT_SEMAPHORE_DEF(write);
+PIPES_USDT_SEMAPHORE_DEF(open_chain);
+PIPES_USDT_SEMAPHORE_DEF(chain_opened);
+PIPES_USDT_SEMAPHORE_DEF(close_chain);
+#endif
+
+void pipes_trace_set(struct pipes_trace_callbacks const* callbacks, void* ctx) {
+	if (callbacks) {
+		pipes_tracer.callbacks = *callbacks;
+		pipes_tracer.ctx       = ctx;
+	}
+	else {
+		memset(&pipes_tracer, 0, sizeof(pipes_tracer));
+	}
+}
+
+// The callbacks are tested again, so clearing them concurrently can't make
+// these call NULL. errno is preserved, because the callers might be about to
+// report an error.
+void pipes_trace_spawn(char const *const argv[]) {
+	void (*callback)(char const *const argv[], long long time, void* ctx) = pipes_tracer.callbacks.spawn;
+	const int errnum = errno;
+	if (callback) callback(argv, pipes_clock(), pipes_tracer.ctx);
+	errno = errnum;
+}
+
+void pipes_trace_exec(pid_t pid, int error) {
+	void (*callback)(pid_t pid, int error, long long time, void* ctx) = pipes_tracer.callbacks.exec;
+	const int errnum = errno;
+	if (callback) callback(pid, error, pipes_clock(), pipes_tracer.ctx);
+	errno = errnum;
+}
+
+void pipes_trace_exit(pid_t pid, int status) {
+	void (*callback)(pid_t pid, int status, long long time, void* ctx) = pipes_tracer.callbacks.exit;
+	const int errnum = errno;
+	if (callback) callback(pid, status, pipes_clock(), pipes_tracer.ctx);
+	errno = errnum;
+}
+
+void pipes_trace_io(int fd, int direction, size_t size) {
+	void (*callback)(int fd, int direction, size_t size, long long time, void* ctx) = pipes_tracer.callbacks.io;
+	const int errnum = errno;
+	if (callback) callback(fd, direction, size, pipes_clock(), pipes_tracer.ctx);
+	errno = errnum;
+}
+
+void pipes_trace_chain(struct pipes_chain const chain[], int event) {
+	void (*callback)(struct pipes_chain const chain[], int event, long long time, void* ctx) = pipes_tracer.callbacks.chain;
+	const int errnum = errno;
+	if (callback) callback(chain, event, pipes_clock(), pipes_tracer.ctx);
+	errno = errnum;
+}
@@ -0,0 +1,399 @@
+#define _POSIX_SOURCE
+#define _GNU_SOURCE
+
+#include "internal.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#if defined(__linux__) && defined(__has_include)
+#	if __has_include(<linux/io_uring.h>)
+#		include <sys/mman.h>
+#		include <sys/syscall.h>
+#		include <linux/io_uring.h>
+#		if defined(SYS_io_uring_setup) && defined(SYS_io_uring_enter) && defined(IORING_FEAT_EXT_ARG)
+#			define PIPES_HAVE_URING
+#		endif
+#	endif
+#endif
+
+#ifdef PIPES_HAVE_URING
+
+// Minimal io_uring ring using the raw system calls, so there is no
+// dependency on liburing. Submissions are guarded by sqlock and reaping
+// completions by cqlock, so several threads may use one ring.
+struct pipes_uring {
+	int fd;
+	pthread_mutex_t sqlock;
+	pthread_mutex_t cqlock;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned  sq_mask;
+	unsigned  sq_entries;
+	struct io_uring_sqe *sqes;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned  cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void  *sq_ring;
+	size_t sq_ring_size;
+	void  *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+static int pipes_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                             void *arg, size_t argsize) {
+	return (int)syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsize);
+}
+
+static void pipes_uring_unmap(struct pipes_uring *ring) {
+	if (ring->sqes && ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED) {
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	}
+}
+
+struct pipes_uring* pipes_uring_new(unsigned entries) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	struct pipes_uring *ring = calloc(1, sizeof(struct pipes_uring));
+
+	if (ring == NULL) {
+		return NULL;
+	}
+
+	ring->fd = (int)syscall(SYS_io_uring_setup, entries, &params);
+
+	if (ring->fd == -1) {
+		// ENOSYS, or EPERM if io_uring is disabled by sysctl or seccomp
+		free(ring);
+		return NULL;
+	}
+
+	int errnum = 0;
+
+	// Without NODROP completions could get lost if the completion queue
+	// overflows and without EXT_ARG there is no way to wait with a timeout.
+	if ((params.features & (IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)) !=
+	    (IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)) {
+		errnum = ENOSYS;
+		goto error;
+	}
+
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes  + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size    = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size) {
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+	if (ring->sq_ring == MAP_FAILED) {
+		errnum = errno;
+		goto error;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	}
+	else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+
+		if (ring->cq_ring == MAP_FAILED) {
+			errnum = errno;
+			goto error;
+		}
+	}
+
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+	if (ring->sqes == MAP_FAILED) {
+		errnum = errno;
+		goto error;
+	}
+
+	char *sq = ring->sq_ring;
+	char *cq = ring->cq_ring;
+
+	ring->sq_head    = (unsigned*)(sq + params.sq_off.head);
+	ring->sq_tail    = (unsigned*)(sq + params.sq_off.tail);
+	ring->sq_array   = (unsigned*)(sq + params.sq_off.array);
+	ring->sq_mask    = *(unsigned*)(sq + params.sq_off.ring_mask);
+	ring->sq_entries = *(unsigned*)(sq + params.sq_off.ring_entries);
+
+	ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	ring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+	ring->cqes    = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	errnum = pthread_mutex_init(&ring->sqlock, NULL);
+	if (errnum != 0) {
+		goto error;
+	}
+
+	errnum = pthread_mutex_init(&ring->cqlock, NULL);
+	if (errnum != 0) {
+		pthread_mutex_destroy(&ring->sqlock);
+		goto error;
+	}
+
+	return ring;
+
+error:
+	pipes_uring_unmap(ring);
+	close(ring->fd);
+	free(ring);
+	errno = errnum;
+
+	return NULL;
+}
+
+void pipes_uring_free(struct pipes_uring *ring) {
+	if (ring == NULL) {
+		return;
+	}
+
+	pipes_uring_unmap(ring);
+	close(ring->fd);
+	pthread_mutex_destroy(&ring->sqlock);
+	pthread_mutex_destroy(&ring->cqlock);
+	free(ring);
+}
+
+// Entries between the kernel's head and our tail haven't been consumed yet.
+// This is also what another thread might be submitting right now, so don't
+// keep a separate count: when two calls race the kernel hands the entries to
+// one of them and the other one just submits fewer (or none).
+static unsigned pipes_uring_unsubmitted(struct pipes_uring *ring) {
+	return __atomic_load_n(ring->sq_tail, __ATOMIC_RELAXED) - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+// expects sqlock to be held
+static int pipes_uring_flush(struct pipes_uring *ring) {
+	unsigned unsubmitted;
+
+	while ((unsubmitted = pipes_uring_unsubmitted(ring)) > 0) {
+		int count = pipes_uring_enter(ring->fd, unsubmitted, 0, 0, NULL, 0);
+
+		if (count == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		// A wait() in another thread might have submitted the entries in the
+		// meantime. Only give up if nobody made any progress.
+		if (count == 0 && pipes_uring_unsubmitted(ring) == unsubmitted) {
+			errno = EBUSY;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int pipes_uring_push(struct pipes_uring *ring, int opcode, int fd, void *buf, size_t size,
+                            unsigned events, void *data) {
+	pthread_mutex_lock(&ring->sqlock);
+
+	if (pipes_uring_unsubmitted(ring) >= ring->sq_entries) {
+		// submission queue is full, so hand it over to the kernel now
+		if (pipes_uring_flush(ring) == -1) {
+			int errnum = errno;
+			pthread_mutex_unlock(&ring->sqlock);
+			errno = errnum;
+			return -1;
+		}
+	}
+
+	const unsigned tail = *ring->sq_tail;
+	const unsigned index = tail & ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode    = (__u8)opcode;
+	sqe->fd        = fd;
+	sqe->user_data = (__u64)(uintptr_t)data;
+
+	if (opcode == IORING_OP_POLL_ADD) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		events = (events << 16) | (events >> 16);
+#endif
+		sqe->poll32_events = events;
+	}
+	else {
+		// pipes are not seekable, -1 means "use the current position"
+		sqe->off  = (__u64)-1;
+		sqe->addr = (__u64)(uintptr_t)buf;
+		sqe->len  = size > 0x7FFFF000 ? 0x7FFFF000 : (__u32)size;
+	}
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&ring->sqlock);
+
+	return 0;
+}
+
+int pipes_uring_read(struct pipes_uring *ring, int fd, void *buf, size_t size, void *data) {
+	return pipes_uring_push(ring, IORING_OP_READ, fd, buf, size, 0, data);
+}
+
+int pipes_uring_write(struct pipes_uring *ring, int fd, void const *buf, size_t size, void *data) {
+	return pipes_uring_push(ring, IORING_OP_WRITE, fd, (void*)buf, size, 0, data);
+}
+
+int pipes_uring_poll(struct pipes_uring *ring, int fd, void *data) {
+	return pipes_uring_push(ring, IORING_OP_POLL_ADD, fd, NULL, 0, POLLIN, data);
+}
+
+int pipes_uring_submit(struct pipes_uring *ring) {
+	pthread_mutex_lock(&ring->sqlock);
+	int status = pipes_uring_flush(ring);
+	int errnum = errno;
+	pthread_mutex_unlock(&ring->sqlock);
+
+	if (status != 0) {
+		errno = errnum;
+	}
+
+	return status;
+}
+
+int pipes_uring_wait(struct pipes_uring *ring, struct pipes_uring_event events[], size_t count, int timeout) {
+	struct __kernel_timespec ts = {
+		.tv_sec  = timeout > 0 ? timeout / 1000 : 0,
+		.tv_nsec = timeout > 0 ? (timeout % 1000) * 1000000L : 0
+	};
+
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+
+	if (timeout >= 0) {
+		arg.ts = (__u64)(uintptr_t)&ts;
+	}
+
+	// Pending submissions go into the same system call as the wait. The
+	// lock is not held during the call, so a concurrent push() or wait() may
+	// submit the same entries. The kernel clamps to_submit to what is left,
+	// but then it returns without waiting, so go again in that case.
+	int errnum = 0;
+	for (;;) {
+		const unsigned to_submit = pipes_uring_unsubmitted(ring);
+		int submitted = pipes_uring_enter(ring->fd, to_submit, timeout == 0 ? 0 : 1,
+			IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+		if (submitted == -1) {
+			errnum = errno;
+			break;
+		}
+
+		if ((unsigned)submitted >= to_submit || timeout == 0) {
+			break;
+		}
+
+		if (submitted == 0 && pipes_uring_unsubmitted(ring) == to_submit) {
+			// the kernel doesn't take any more right now
+			errnum = EBUSY;
+			break;
+		}
+	}
+
+	if (errnum != 0 && errnum != ETIME && errnum != EINTR && errnum != EBUSY) {
+		errno = errnum;
+		return -1;
+	}
+
+	pthread_mutex_lock(&ring->cqlock);
+
+	unsigned head = *ring->cq_head;
+	const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	size_t index = 0;
+
+	while (head != tail && index < count) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+
+		events[index].data = (void*)(uintptr_t)cqe->user_data;
+		events[index].res  = cqe->res;
+
+		++ index;
+		++ head;
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&ring->cqlock);
+
+	return (int)index;
+}
+
+#else
+
+struct pipes_uring* pipes_uring_new(unsigned entries) {
+	(void)entries;
+	errno = ENOSYS;
+	return NULL;
+}
+
+void pipes_uring_free(struct pipes_uring *ring) {
+	(void)ring;
+}
+
+int pipes_uring_read(struct pipes_uring *ring, int fd, void *buf, size_t size, void *data) {
+	(void)ring; (void)fd; (void)buf; (void)size; (void)data;
+	errno = ENOSYS;
+	return -1;
+}
+
+int pipes_uring_write(struct pipes_uring *ring, int fd, void const *buf, size_t size, void *data) {
+	(void)ring; (void)fd; (void)buf; (void)size; (void)data;
+	errno = ENOSYS;
+	return -1;
+}
+
+int pipes_uring_poll(struct pipes_uring *ring, int fd, void *data) {
+	(void)ring; (void)fd; (void)data;
+	errno = ENOSYS;
+	return -1;
+}
+
+int pipes_uring_submit(struct pipes_uring *ring) {
+	(void)ring;
+	errno = ENOSYS;
+	return -1;
+}
+
+int pipes_uring_wait(struct pipes_uring *ring, struct pipes_uring_event events[], size_t count, int timeout) {
+	(void)ring; (void)events; (void)count; (void)timeout;
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif
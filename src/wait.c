@@ -0,0 +1,387 @@
+#define _POSIX_SOURCE
+#define _GNU_SOURCE
+
+#include "internal.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+int pipes_pidfd_open(pid_t pid) {
+#ifdef SYS_pidfd_open
+	return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+	(void)pid;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int pipes_pidfd_kill(pid_t pid, int pidfd, int sig) {
+#ifdef SYS_pidfd_send_signal
+	if (pidfd > -1) {
+		return (int)syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+	}
+#else
+	(void)pidfd;
+#endif
+	return kill(pid, sig);
+}
+
+long long pipes_clock(void) {
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+		return 0;
+	}
+
+	return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+int pipes_reap(pid_t *pid, int *pidfd, int *status, int options) {
+	return pipes_reap_rusage(pid, pidfd, status, options, NULL);
+}
+
+int pipes_reap_rusage(pid_t *pid, int *pidfd, int *status, int options, struct rusage *rusage) {
+	int wstatus = 0;
+	pid_t result;
+
+	do {
+		result = wait4(*pid, &wstatus, options, rusage);
+	} while (result == -1 && errno == EINTR);
+
+	if (result == 0) {
+		return 0;
+	}
+
+	int errnum = errno;
+
+	if (result == -1 && errnum != ECHILD) {
+		return -1;
+	}
+
+	// On ECHILD someone else already reaped the process (or SIGCHLD is
+	// ignored). Either way there is nothing left to wait for.
+	*pid = -1;
+
+	if (*pidfd > -1) {
+		close(*pidfd);
+		*pidfd = -1;
+	}
+
+	if (result == -1) {
+		errno = errnum;
+		return -1;
+	}
+
+	if (status) {
+		*status = wstatus;
+	}
+
+	PIPES_TRACEPOINT_EXIT(result, wstatus);
+
+	return 1;
+}
+
+// Whether the process or function of proc wasn't reaped yet.
+static int pipes_proc_running(struct pipes_proc const* proc) {
+	return proc->function ? *proc->pidfd > -1 : *proc->pid > -1;
+}
+
+// Upper bound in milliseconds for the back-off between waitpid() calls when
+// there are no pidfds to poll.
+#define PIPES_POLL_MAX_DELAY 64
+
+int pipes_poll_procs(struct pipes_proc procs[], size_t count, int status[], int timeout) {
+	struct pollfd *fds = calloc(count ? count : 1, sizeof(struct pollfd));
+
+	if (fds == NULL) {
+		return -1;
+	}
+
+	const long long deadline = timeout > 0 ? pipes_clock() + timeout * 1000000LL : 0;
+	int running  = 0;
+	int waiting  = -1; // processes running before the first wait
+	int fallback = 0;  // some process has no pidfd
+	int delay    = 1;
+
+	for (;;) {
+		running = 0;
+
+		for (size_t index = 0; index < count; ++ index) {
+			if (!pipes_proc_running(&procs[index])) continue;
+
+			int result = procs[index].function ?
+				pipes_function_reap(procs[index].pidfd, status ? &status[index] : NULL, WNOHANG) :
+				pipes_reap(procs[index].pid, procs[index].pidfd,
+					status ? &status[index] : NULL, WNOHANG);
+
+			if (result == -1 && errno != ECHILD) {
+				running = -1;
+				goto cleanup;
+			}
+
+			if (result == 0) {
+				++ running;
+			}
+		}
+
+		if (running == 0 || timeout == 0) {
+			break;
+		}
+
+		if (waiting > -1) {
+			// With pidfds poll() already waited for an exit or the timeout.
+			// Without them keep looking until something exited.
+			if (!fallback || running < waiting) {
+				break;
+			}
+
+			if (timeout > 0 && pipes_clock() >= deadline) {
+				break;
+			}
+		}
+		else {
+			waiting = running;
+		}
+
+		nfds_t nfds = 0;
+		for (size_t index = 0; index < count; ++ index) {
+			if (!pipes_proc_running(&procs[index])) continue;
+
+			if (*procs[index].pidfd < 0 && !fallback) {
+				*procs[index].pidfd = pipes_pidfd_open(*procs[index].pid);
+			}
+
+			if (*procs[index].pidfd < 0) {
+				// No pidfds before Linux 5.3, or pidfd_open() is blocked
+				// by seccomp. Poll with waitpid() instead.
+				fallback = 1;
+				continue;
+			}
+
+			fds[nfds].fd     = *procs[index].pidfd;
+			fds[nfds].events = POLLIN;
+			++ nfds;
+		}
+
+		int wait = timeout;
+
+		if (fallback) {
+			wait = delay;
+
+			if (timeout > 0) {
+				const long long left = (deadline - pipes_clock() + 999999LL) / 1000000LL;
+				if (left < wait) {
+					wait = left > 0 ? (int)left : 0;
+				}
+			}
+
+			if (delay < PIPES_POLL_MAX_DELAY) {
+				delay *= 2;
+			}
+		}
+
+		int ready;
+		do {
+			ready = poll(fds, nfds, wait);
+		} while (ready == -1 && errno == EINTR && timeout < 0 && !fallback);
+
+		if (ready == -1 && errno != EINTR) {
+			running = -1;
+			goto cleanup;
+		}
+	}
+
+cleanup:
+	(void)0;
+
+	int errnum = errno;
+
+	free(fds);
+
+	if (running == -1) {
+		errno = errnum;
+	}
+
+	return running;
+}
+
+int pipes_wait(struct pipes* pipes, int* status) {
+	if (pipes->pid < 0) {
+		errno = ECHILD;
+		return -1;
+	}
+
+	return pipes_reap(&pipes->pid, &pipes->pidfd, status, 0) == -1 ? -1 : 0;
+}
+
+int pipes_wait_chain(struct pipes_chain chain[], int status[]) {
+	int result = 0;
+
+	for (size_t index = 0; chain[index].argv; ++ index) {
+		if (chain[index].fn) {
+			if (chain[index].pipes.pidfd > -1 &&
+			    pipes_function_reap(&chain[index].pipes.pidfd, status ? &status[index] : NULL, 0) == -1) {
+				result = -1;
+			}
+		}
+		else if (chain[index].pipes.pid > -1) {
+			if (pipes_reap(&chain[index].pipes.pid, &chain[index].pipes.pidfd,
+			               status ? &status[index] : NULL, 0) == -1) {
+				result = -1;
+			}
+		}
+	}
+
+	return result;
+}
+
+int pipes_poll_chain(struct pipes_chain chain[], int status[], int timeout) {
+	size_t count = 0;
+	while (chain[count].argv) ++ count;
+
+	struct pipes_proc *procs = calloc(count ? count : 1, sizeof(struct pipes_proc));
+
+	if (procs == NULL) {
+		return -1;
+	}
+
+	for (size_t index = 0; index < count; ++ index) {
+		procs[index].pid      = &chain[index].pipes.pid;
+		procs[index].pidfd    = &chain[index].pipes.pidfd;
+		procs[index].function = chain[index].fn != NULL;
+	}
+
+	int running = pipes_poll_procs(procs, count, status, timeout);
+	int errnum  = errno;
+
+	free(procs);
+
+	if (running == -1) {
+		errno = errnum;
+	}
+
+	return running;
+}
+
+static void pipes_stats_begin(struct pipes const* pipes, struct pipes_stats* stats) {
+	memset(stats, 0, sizeof(*stats));
+
+	stats->bytes_in  = pipes->bytes_in;
+	stats->bytes_out = pipes->bytes_out;
+	stats->bytes_err = pipes->bytes_err;
+}
+
+// Reap pipes and fill in the rest of stats. The wall time is measured up to
+// now, so it is the run time of the process as long as it is reaped as soon
+// as it exits. Function stages have no resource usage of their own. Returns
+// the same as pipes_reap().
+static int pipes_stats_reap(struct pipes* pipes, int function, struct pipes_stats* stats, int options) {
+	const long long started = pipes->started;
+	const int result = function ?
+		pipes_function_reap(&pipes->pidfd, &stats->status, options) :
+		pipes_reap_rusage(&pipes->pid, &pipes->pidfd, &stats->status, options, &stats->rusage);
+
+	if (result == 1) {
+		const long long wall = started > 0 ? pipes_clock() - started : 0;
+
+		stats->wall.tv_sec  = (time_t)(wall / 1000000000LL);
+		stats->wall.tv_usec = (suseconds_t)(wall % 1000000000LL / 1000);
+	}
+
+	return result;
+}
+
+int pipes_wait_stats(struct pipes* pipes, struct pipes_stats* stats) {
+	if (pipes->pid < 0) {
+		errno = ECHILD;
+		return -1;
+	}
+
+	pipes_stats_begin(pipes, stats);
+
+	return pipes_stats_reap(pipes, 0, stats, 0) == -1 ? -1 : 0;
+}
+
+int pipes_wait_chain_stats(struct pipes_chain chain[], struct pipes_stats stats[]) {
+	size_t count = 0;
+	while (chain[count].argv) ++ count;
+
+	struct pollfd *fds = calloc(count ? count : 1, sizeof(struct pollfd));
+
+	if (fds == NULL) {
+		return -1;
+	}
+
+	int result = 0;
+	int errnum = 0;
+
+	for (size_t index = 0; index < count; ++ index) {
+		pipes_stats_begin(&chain[index].pipes, &stats[index]);
+	}
+
+	// Reap the stages in the order they exit, so the wall time of an early
+	// stage doesn't include the time spent waiting for a later one.
+	for (;;) {
+		nfds_t nfds = 0;
+
+		for (size_t index = 0; index < count; ++ index) {
+			struct pipes *pipes = &chain[index].pipes;
+			const int function = chain[index].fn != NULL;
+
+			if (function ? pipes->pidfd < 0 : pipes->pid < 0) continue;
+
+			const int reaped = pipes_stats_reap(pipes, function, &stats[index], WNOHANG);
+
+			if (reaped == -1) {
+				result = -1;
+				errnum = errno;
+			}
+			else if (reaped == 0) {
+				if (pipes->pidfd < 0) {
+					pipes->pidfd = pipes_pidfd_open(pipes->pid);
+				}
+
+				if (pipes->pidfd < 0) {
+					// no pidfds, wait for the stages one after another
+					if (pipes_stats_reap(pipes, function, &stats[index], 0) == -1) {
+						result = -1;
+						errnum = errno;
+					}
+					continue;
+				}
+
+				fds[nfds].fd      = pipes->pidfd;
+				fds[nfds].events  = POLLIN;
+				fds[nfds].revents = 0;
+				++ nfds;
+			}
+		}
+
+		if (nfds == 0 || result == -1) {
+			break;
+		}
+
+		if (poll(fds, nfds, -1) == -1 && errno != EINTR) {
+			result = -1;
+			errnum = errno;
+			break;
+		}
+	}
+
+	free(fds);
+
+	if (result == -1) {
+		errno = errnum;
+	}
+
+	return result;
+}
@@ -0,0 +1,196 @@
+#define _GNU_SOURCE
+
+#include "internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+
+// Deliberately tiny, so the pushing threads keep running into a full
+// submission queue while the reaper is inside pipes_uring_wait().
+#define TEST_URING_ENTRIES 8
+#define TEST_URING_TIMEOUT 1000
+
+struct test_pusher {
+	pthread_t thread;
+	struct pipes_uring *ring;
+	int  fd;
+	long ops;
+	long completed;
+	int  error;
+};
+
+struct test_reaper {
+	pthread_t thread;
+	struct pipes_uring *ring;
+	long total;
+	int  error;
+};
+
+static void *test_push(void *ptr) {
+	struct test_pusher *pusher = ptr;
+	static char const byte = 'x';
+
+	for (long op = 0; op < pusher->ops; ++ op) {
+		while (pipes_uring_write(pusher->ring, pusher->fd, &byte, 1, pusher) == -1) {
+			// the kernel refuses new submissions while completions overflow
+			if (errno != EBUSY && errno != EAGAIN && errno != EINTR) {
+				pusher->error = errno;
+				return NULL;
+			}
+			sched_yield();
+		}
+	}
+
+	// the reaper might be asleep already, hand over what is left
+	while (pipes_uring_submit(pusher->ring) == -1) {
+		if (errno != EBUSY && errno != EAGAIN && errno != EINTR) {
+			pusher->error = errno;
+			break;
+		}
+		sched_yield();
+	}
+
+	return NULL;
+}
+
+static void *test_reap(void *ptr) {
+	struct test_reaper *reaper = ptr;
+	struct pipes_uring_event events[TEST_URING_ENTRIES * 2];
+	long reaped = 0;
+
+	while (reaped < reaper->total) {
+		int count = pipes_uring_wait(reaper->ring, events, sizeof(events) / sizeof(events[0]),
+		                             TEST_URING_TIMEOUT);
+
+		if (count == -1) {
+			if (errno == EINTR) continue;
+			reaper->error = errno;
+			return NULL;
+		}
+
+		if (count == 0) {
+			// An overwritten submission never completes. Everything else
+			// finishes way faster than the timeout.
+			fprintf(stderr, "uring: %ld of %ld operations never completed\n",
+				reaper->total - reaped, reaper->total);
+			reaper->error = EIO;
+			return NULL;
+		}
+
+		for (int index = 0; index < count; ++ index) {
+			struct test_pusher *pusher = events[index].data;
+
+			if (events[index].res != 1) {
+				reaper->error = events[index].res < 0 ? -events[index].res : EIO;
+				return NULL;
+			}
+
+			++ pusher->completed;
+		}
+
+		reaped += count;
+	}
+
+	return NULL;
+}
+
+#define TEST_URING_OPS     20000
+#define TEST_URING_THREADS 16
+
+// Several threads push writes into one small ring while another thread
+// submits and reaps with pipes_uring_wait(). Every write has to complete
+// exactly once.
+int main(void) {
+	struct pipes_uring *ring = pipes_uring_new(TEST_URING_ENTRIES);
+
+	if (ring == NULL) {
+		fprintf(stderr, "uring: io_uring not available, skipping: %s\n", strerror(errno));
+		return 0;
+	}
+
+	const int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+	if (fd == -1) {
+		perror("opening /dev/null");
+		pipes_uring_free(ring);
+		return 1;
+	}
+
+	struct test_pusher pushers[TEST_URING_THREADS];
+	int status = 0;
+
+	for (long threads = 1; threads <= TEST_URING_THREADS && status == 0; threads *= 2) {
+		const long ops = TEST_URING_OPS / threads;
+		struct test_reaper reaper = { .ring = ring, .total = ops * threads };
+
+		// the reaper counts completions per pusher, so set them up first
+		for (long index = 0; index < threads; ++ index) {
+			pushers[index].ring      = ring;
+			pushers[index].fd        = fd;
+			pushers[index].ops       = ops;
+			pushers[index].completed = 0;
+			pushers[index].error     = 0;
+		}
+
+		int errnum = pthread_create(&reaper.thread, NULL, test_reap, &reaper);
+		if (errnum != 0) {
+			fprintf(stderr, "error creating thread: %s\n", strerror(errnum));
+			status = 1;
+			break;
+		}
+
+		long started = 0;
+		for (; started < threads; ++ started) {
+			errnum = pthread_create(&pushers[started].thread, NULL, test_push, &pushers[started]);
+			if (errnum != 0) {
+				fprintf(stderr, "error creating thread: %s\n", strerror(errnum));
+				break;
+			}
+		}
+
+		int error = 0;
+		for (long index = 0; index < started; ++ index) {
+			pthread_join(pushers[index].thread, NULL);
+
+			if (pushers[index].error != 0) {
+				error = pushers[index].error;
+			}
+		}
+
+		// the reaper only stops once everything completed or nothing did
+		// for a whole timeout
+		pthread_join(reaper.thread, NULL);
+
+		if (reaper.error != 0) {
+			error = reaper.error;
+		}
+
+		for (long index = 0; index < started && error == 0; ++ index) {
+			if (pushers[index].completed != ops) {
+				error = EIO;
+			}
+		}
+
+		if (started < threads || error != 0) {
+			if (error != 0) {
+				fprintf(stderr, "uring: %ld threads: %s\n", threads, strerror(error));
+			}
+			status = 1;
+		}
+	}
+
+	close(fd);
+	pipes_uring_free(ring);
+
+	if (status == 0) {
+		printf("uring: ok\n");
+	}
+
+	return status;
+}